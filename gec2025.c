@@ -1,8 +1,13 @@
 #include <ctype.h>
 #include <direct.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <io.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <windows.h>
@@ -13,7 +18,7 @@
  * This program reads GTFS (General Transit Feed Specification) CSV files
  * and allows users to search for transit stops by name or ID.
  * It prompts for origin and final stop inputs and displays matching stop
- * information.
+ * information. Batch modes load the full timetable for routing tools.
  */
 
 /**
@@ -136,16 +141,35 @@ typedef struct {
 /**
  * StopTime structure
  * Represents a stop time from the stop_times.csv file.
- * Tracks when a trip stops at a particular stop.
+ * Tracks when a trip stops at a particular stop. Identifiers are resolved to
+ * array indices and times are parsed to seconds at load time, so routing
+ * never compares strings.
  */
 typedef struct {
-  char* trip_id;         ///< ID of the trip
-  char* arrival_time;    ///< Arrival time at this stop
-  char* departure_time;  ///< Departure time from this stop
-  char* stop_id;         ///< ID of the stop
-  int stop_sequence;     ///< Sequence number of stop in the trip
+  int trip;            ///< Index of the trip in Timetable.trips
+  int stop;            ///< Index of the stop in Timetable.stops
+  int arrival_time;    ///< Arrival time in seconds after service-day midnight
+  int departure_time;  ///< Departure time in seconds after service-day midnight
+  int stop_sequence;   ///< Sequence number of stop in the trip
+  float shape_dist;    ///< shape_dist_traveled (unit of shapes.csv), or -1
+                       ///< if empty
 } StopTime;
 
+/**
+ * Route structure
+ * Represents a route from the routes.csv file.
+ */
+typedef struct {
+  char* route_id;          ///< Unique identifier for the route
+  char* route_short_name;  ///< Public route number (e.g., "99")
+  char* route_long_name;   ///< Full route name
+} Route;
+
+/** Trip attributes (Trip.attributes bits and query filter masks). */
+#define TRIP_WHEELCHAIR 1u  ///< wheelchair_accessible = 1
+#define TRIP_BIKES 2u       ///< bikes_allowed = 1
+#define NUM_TRIP_ATTRIBUTES 2
+
 /**
  * Trip structure
  * Represents a trip from the trips.csv file.
@@ -153,13 +177,267 @@ typedef struct {
  * route.
  */
 typedef struct {
-  char* route_id;       ///< ID of the route this trip belongs to
-  char* service_id;     ///< Service ID for schedule patterns
-  char* trip_id;        ///< Unique identifier for the trip
-  char* trip_headsign;  ///< Direction/destination displayed on the vehicle
-  int direction_id;     ///< Direction ID (0 or 1, typically)
+  char* route_id;         ///< ID of the route this trip belongs to
+  char* service_id;       ///< Service ID for schedule patterns
+  char* trip_id;          ///< Unique identifier for the trip
+  char* trip_headsign;    ///< Direction/destination displayed on the vehicle
+  char* block_id;         ///< Vehicle block shared by consecutive trips of
+                          ///< one vehicle ("" if none)
+  int direction_id;       ///< Direction ID (0 or 1, typically)
+  int route;              ///< Index of the route in Timetable.routes, or -1
+  int service;            ///< Index of service_id in Timetable.service_ids
+  int first_stop_time;    ///< Index of the trip's first entry in stop_times
+  int num_stop_times;     ///< Number of stop_times entries for the trip
+  int block_prev;         ///< Trip of the same block this one continues
+                          ///< (riders stay seated), or -1
+  int block_next;         ///< Trip of the same block continuing this one,
+                          ///< or -1
+  unsigned attributes;    ///< TRIP_* bits of the amenities the trip offers
+  int frequency;          ///< First of the trip's rows in
+                          ///< Timetable.frequencies, or -1 if scheduled
+  int shape;              ///< Index of the trip's shape in
+                          ///< Timetable.shapes, or -1 if none
 } Trip;
 
+/**
+ * Shape structure
+ * One polyline of shapes.csv. Its points are the slice
+ * [first_point, first_point + num_points) of the timetable's flat
+ * shape_lat / shape_lon / shape_dist arrays, in shape_pt_sequence order, so
+ * a trip's geometry is read in place without copying.
+ */
+typedef struct {
+  char* shape_id;   ///< Unique identifier for the shape
+  int first_point;  ///< Index of the shape's first point
+  int num_points;   ///< Number of points
+} Shape;
+
+/**
+ * ShapeAnchor structure
+ * Where a stop time lies on its trip's shape. The shape between two
+ * consecutive stop times a and a + 1 is the anchor of a, the shape points
+ * in [anchors[a].point + 1, anchors[a + 1].point + 1), then the anchor of
+ * a + 1 (see ride_shape()).
+ */
+typedef struct {
+  int point;   ///< Shape point at or just before the stop, or -1 if the
+               ///< trip has no shape
+  double lat;  ///< Latitude of the stop's position on the shape
+  double lon;  ///< Longitude of the stop's position on the shape
+  double dist_m;  ///< Metres along the shape (along the trip, stop to stop
+                  ///< in a straight line, if it has no shape); a ride's
+                  ///< length is the difference between its two anchors
+} ShapeAnchor;
+
+/**
+ * Frequency structure
+ * One row of frequencies.csv: the trip runs every `headway` seconds from
+ * start_time until end_time. Its stop_times only give the running times
+ * between stops, relative to the first departure. The departures are never
+ * expanded into trips; the routing scan generates them (see FreqStream).
+ */
+typedef struct {
+  int trip;           ///< Index of the template trip
+  int start_time;     ///< First departure from the first stop, in seconds
+  int end_time;       ///< Departures are before this time
+  int headway;        ///< Seconds between departures
+  int num_instances;  ///< Departures in [start_time, end_time)
+  int first_id;       ///< Id of instance 0's first connection among the
+                      ///< frequency connection ids (see CsaCursor)
+} Frequency;
+
+/**
+ * Connection structure
+ * One vehicle movement between two consecutive stops of a trip. The
+ * timetable keeps every connection in a single array sorted by departure
+ * time, which is the input of the connection scan algorithm (CSA).
+ */
+typedef struct {
+  int dep_stop;  ///< Index of the stop the vehicle departs from
+  int arr_stop;  ///< Index of the stop the vehicle arrives at
+  int dep_time;  ///< Departure time in seconds
+  int arr_time;  ///< Arrival time in seconds
+  int trip;      ///< Index of the trip operating the connection
+} Connection;
+
+/**
+ * Departure structure
+ * One scheduled departure from a stop, as listed on a departure board.
+ */
+typedef struct {
+  int time;  ///< Departure time in seconds
+  int trip;  ///< Index of the departing trip
+} Departure;
+
+/**
+ * FrequencyCall structure
+ * A frequency-based trip's departure from one stop, shared by all of its
+ * instances (see Timetable.frequency_call_offsets).
+ */
+typedef struct {
+  int frequency;  ///< Index into Timetable.frequencies
+  int offset;     ///< Departure here minus the first stop's, in seconds
+} FrequencyCall;
+
+/**
+ * Footpath structure
+ * A walking transfer to a nearby stop. Footpaths are stored per origin stop
+ * in a CSR array (see Timetable.footpath_offsets).
+ */
+typedef struct {
+  int to_stop;    ///< Index of the stop walked to
+  int walk_time;  ///< Walking time in seconds
+} Footpath;
+
+/**
+ * IdIndex structure
+ * Open-addressing hash table mapping GTFS string identifiers to array
+ * indices. Keys are borrowed from the owning records and are not copied.
+ */
+typedef struct {
+  const char** keys;  ///< Slot keys, NULL for empty slots
+  int* values;        ///< Slot values (array indices)
+  unsigned capacity;  ///< Number of slots (power of two)
+} IdIndex;
+
+/**
+ * Timetable structure
+ * The whole feed loaded into memory. Stops and trips keep their CSV order;
+ * stop_times are grouped by trip and ordered by stop_sequence.
+ */
+typedef struct {
+  Stop* stops;              ///< All stops, in stops.csv order
+  int num_stops;            ///< Number of stops
+  IdIndex stop_index;       ///< stop_id -> index into stops
+  Route* routes;            ///< All routes, in routes.csv order
+  int num_routes;           ///< Number of routes
+  IdIndex route_index;      ///< route_id -> index into routes
+  Trip* trips;              ///< All trips, in trips.csv order
+  int num_trips;            ///< Number of trips
+  IdIndex trip_index;       ///< trip_id -> index into trips
+  StopTime* stop_times;     ///< All stop times, grouped by trip
+  int num_stop_times;       ///< Number of stop times
+  Frequency* frequencies;   ///< frequencies.csv rows, sorted by trip
+  int num_frequencies;      ///< Number of frequency rows
+  int num_frequency_connections;  ///< Connections of every instance of
+                                  ///< every row (ids only, never stored)
+  int max_frequency_vehicles;     ///< Proven bound on the instances of
+                                  ///< both days in a FreqStream at once
+  Shape* shapes;            ///< All shapes, in order of first appearance
+  int num_shapes;           ///< Number of shapes
+  IdIndex shape_index;      ///< shape_id -> index into shapes
+  double* shape_lat;        ///< Latitude of every shape point, grouped by
+                            ///< shape
+  double* shape_lon;        ///< Longitude of every shape point
+  double* shape_dist;       ///< Cumulative shape_dist_traveled of every
+                            ///< shape point, in the feed's unit
+  double* shape_m;          ///< Length in metres of every shape point's
+                            ///< shape up to that point
+  int num_shape_points;     ///< Number of shape points
+  ShapeAnchor* shape_anchors;  ///< Per stop time: its position on the
+                               ///< trip's shape (parallel to stop_times)
+  Connection* connections;  ///< All connections, sorted by departure time
+  Connection* connections_by_arrival;  ///< Same connections, by arrival time
+  int num_connections;      ///< Number of connections
+  int* departure_offsets;   ///< Per stop: start of its slice of departures
+                            ///< (num_stops + 1 entries)
+  Departure* departures;    ///< Departures grouped by stop, sorted by time
+  int* frequency_call_offsets;  ///< Per stop: start of its slice of
+                                ///< frequency_calls (num_stops + 1)
+  FrequencyCall* frequency_calls;  ///< Frequency rows' departures grouped
+                                   ///< by stop
+  int* footpath_offsets;    ///< Per stop: start of its slice of footpaths
+                            ///< (num_stops + 1 entries)
+  Footpath* footpaths;      ///< Walking transfers grouped by origin stop
+  char** service_ids;       ///< Distinct service_ids (trips and calendar)
+  int num_services;         ///< Number of service_ids
+  IdIndex service_index;    ///< service_id -> index into service_ids
+  int has_calendar;         ///< Nonzero if calendar files were found
+  int calendar_first_day;   ///< Day number of the first calendar day
+  int calendar_num_days;    ///< Number of days covered by the calendar
+  uint64_t* service_days;   ///< Per service: bitmask of active days
+                            ///< (calendar_num_days bits, 64 per word)
+  int trip_mask_words;      ///< 32-bit words in one trip bitset
+  uint32_t* day_trips;      ///< Per calendar day: bitset of active trips
+  uint32_t* all_trips;      ///< Bitset with every trip set (no filtering)
+  uint32_t* attribute_trips;  ///< Per TRIP_* bit: bitset of trips offering
+                              ///< it (NUM_TRIP_ATTRIBUTES rows)
+  unsigned feed_hash;       ///< Fingerprint of the loaded schedule and
+                            ///< footpaths, used to validate cache files
+  unsigned shape_hash;      ///< Fingerprint of the shapes, validating
+                            ///< cached geometry
+} Timetable;
+
+/**
+ * TimetableOptions structure
+ * Settings that affect how the timetable is preprocessed at load time.
+ */
+typedef struct {
+  double walk_radius_m;   ///< Max straight-line distance of a footpath
+  double walk_speed_mps;  ///< Walking speed used for footpath times
+  int service_day;        ///< Day queries run on (see parse_gtfs_date()),
+                          ///< INT_MIN for every trip regardless of calendar
+  unsigned require;       ///< TRIP_* attributes every ridden trip must offer
+  double time_limit_ms;   ///< Wall-clock budget of one query, 0 = none
+} TimetableOptions;
+
+/** Default footpath radius, in metres. */
+#define DEFAULT_WALK_RADIUS_M 250.0
+/** Default walking speed, in metres per second (about 4.5 km/h). */
+#define DEFAULT_WALK_SPEED_MPS 1.25
+/** Mean Earth radius, in metres. */
+#define EARTH_RADIUS_M 6371000.0
+
+/** Tests bit `t` of a trip bitset (see timetable_active_trips()). */
+#define TRIP_ACTIVE(mask, t) (((mask)[(t) >> 5] >> ((t) & 31)) & 1u)
+
+/** Seconds per day; stop times past 24:00:00 fall on the next day. */
+#define SECONDS_PER_DAY 86400
+
+/**
+ * ServiceDay structure
+ * The trips a query on one day may ride: that day's own trips, plus the
+ * previous service day's trips whose stop times run past 24:00:00 and so
+ * fall on the query day (seen with their times shifted back one day).
+ */
+typedef struct {
+  const uint32_t* active;     ///< Trips running on the query day
+  const uint32_t* overnight;  ///< Trips running on the previous day
+  uint32_t* filtered;         ///< Storage behind both when narrowed by
+                              ///< service_day_require(), else NULL
+} ServiceDay;
+
+/** Sentinel for "not reached" in per-stop time labels. */
+#define TIME_INFINITY 0x7fffffff
+
+/** Upper bound on the number of vehicle legs in a reported journey. */
+#define MAX_JOURNEY_LEGS 32
+
+/**
+ * JourneyLeg structure
+ * One ride on a single vehicle: one trip, or several consecutive trips of a
+ * block the rider stays seated through.
+ */
+typedef struct {
+  int trip;       ///< Index of the trip ridden, or -1 for a walking leg
+  int last_trip;  ///< Trip at to_stop: trip, or a later trip of its block
+                  ///< reached by staying seated (-1 for a walking leg)
+  int from_stop;  ///< Index of the boarding stop
+  int to_stop;    ///< Index of the alighting stop
+  int dep_time;   ///< Departure time from from_stop, in seconds
+  int arr_time;   ///< Arrival time at to_stop, in seconds
+} JourneyLeg;
+
+/**
+ * Journey structure
+ * A routing result: the legs from origin to destination, in travel order.
+ * Vehicle legs and walking legs may alternate.
+ */
+typedef struct {
+  JourneyLeg legs[MAX_JOURNEY_LEGS];  ///< Legs in travel order
+  int num_legs;                       ///< Number of legs (0 if origin==dest)
+} Journey;
+
 // ============================================================================
 // UTILITY FUNCTIONS
 // ============================================================================
@@ -250,6 +528,447 @@ void str_to_lower_copy(const char* src, char* dest, size_t destSize) {
   dest[i] = '\0';
 }
 
+/**
+ * resolve_data_path()
+ *
+ * Finds a data file, searching the same locations as the stop lookup:
+ * 1. The path provided (relative to the current directory)
+ * 2. Parent directories (walks up the directory tree)
+ * 3. The executable's directory and its parents
+ *
+ * Parameters:
+ *   relPath - Relative path to the file (e.g., "./csv_files/trips.csv")
+ *   outPath - Output buffer for the path that exists
+ *   outSize - Size of the output buffer
+ *
+ * Returns:
+ *   1 if the file was found (path stored in outPath), 0 otherwise
+ */
+int resolve_data_path(const char* relPath, char* outPath, size_t outSize) {
+  FILE* fp = fopen(relPath, "r");
+  if (fp) {
+    fclose(fp);
+    strncpy(outPath, relPath, outSize);
+    outPath[outSize - 1] = '\0';
+    return 1;
+  }
+
+  // Try from current working directory and parent directories
+  if (find_file_in_ancestors(relPath, outPath, outSize, 6)) return 1;
+
+  // Try from executable directory (useful when debugger runs with different
+  // cwd)
+  char exeDir[1024];
+  char oldcwd[1024];
+  if (!get_exe_dir(exeDir, sizeof(exeDir))) return 0;
+  if (_getcwd(oldcwd, sizeof(oldcwd)) == NULL) return 0;
+  if (_chdir(exeDir) != 0) return 0;
+  int found = find_file_in_ancestors(relPath, outPath, outSize, 6);
+  _chdir(oldcwd);
+  return found;
+}
+
+/**
+ * open_data_file()
+ *
+ * Opens a data file found by resolve_data_path().
+ *
+ * Returns:
+ *   Open FILE* on success, NULL if the file could not be found or opened
+ */
+FILE* open_data_file(const char* relPath) {
+  char resolved[1200];
+  if (!resolve_data_path(relPath, resolved, sizeof(resolved))) return NULL;
+  return fopen(resolved, "r");
+}
+
+/**
+ * dataset_file_path()
+ *
+ * Builds the path of a file stored next to the CSV files (e.g., a cache of
+ * preprocessed data), whether or not that file exists yet.
+ *
+ * Parameters:
+ *   name    - File name (e.g., "trip_transfers.bin")
+ *   outPath - Output buffer
+ *   outSize - Size of the output buffer
+ *
+ * Returns:
+ *   1 on success, 0 if the dataset directory could not be found
+ */
+int dataset_file_path(const char* name, char* outPath, size_t outSize) {
+  char stops[1200];
+  if (!resolve_data_path("./csv_files/stops.csv", stops, sizeof(stops)))
+    return 0;
+  char* p = strrchr(stops, '\\');
+  char* q = strrchr(stops, '/');
+  if (!p || (q && q > p)) p = q;
+  if (p)
+    p[1] = '\0';
+  else
+    stops[0] = '\0';
+  snprintf(outPath, outSize, "%s%s", stops, name);
+  return 1;
+}
+
+/**
+ * split_csv_line()
+ *
+ * Splits one CSV record in place. Unlike strtok(), empty fields are kept
+ * (GTFS uses them for optional columns) and double-quoted fields may contain
+ * commas and doubled quotes.
+ *
+ * Parameters:
+ *   line      - Record to split; modified in place, newline already removed
+ *   fields    - Output array of pointers into line
+ *   maxFields - Capacity of fields
+ *
+ * Returns:
+ *   Number of fields found
+ */
+int split_csv_line(char* line, char** fields, int maxFields) {
+  int fc = 0;
+  char* p = line;
+  while (fc < maxFields) {
+    char* out = p;
+    int quoted = 0;
+    fields[fc++] = out;
+    if (*p == '"') {
+      quoted = 1;
+      p++;
+    }
+    for (;;) {
+      char ch = *p;
+      if (ch == '\0') {
+        *out = '\0';
+        return fc;
+      }
+      if (quoted && ch == '"') {
+        // A doubled quote is a literal quote, a single one closes the field
+        if (p[1] == '"') {
+          *out++ = '"';
+          p += 2;
+        } else {
+          quoted = 0;
+          p++;
+        }
+        continue;
+      }
+      if (!quoted && ch == ',') {
+        *out = '\0';
+        p++;
+        break;
+      }
+      *out++ = ch;
+      p++;
+    }
+  }
+  return fc;
+}
+
+/**
+ * CsvReader structure
+ * Streams the records of a CSV file with a header row, giving access to
+ * fields by column name.
+ */
+typedef struct {
+  FILE* fp;              ///< Open file
+  char header[4096];     ///< Header line storage
+  char* columns[64];     ///< Column names (point into header)
+  int num_columns;       ///< Number of columns in the header
+  char line[4096];       ///< Current record storage
+  char* fields[64];      ///< Current record fields (point into line)
+  int num_fields;        ///< Number of fields in the current record
+} CsvReader;
+
+/**
+ * csv_open()
+ *
+ * Opens a CSV file (see open_data_file()) and parses its header row.
+ *
+ * Returns:
+ *   1 on success, 0 if the file is missing or empty
+ */
+int csv_open(CsvReader* r, const char* relPath) {
+  r->fp = open_data_file(relPath);
+  if (!r->fp) {
+    fprintf(stderr, "opening '%s': %s\n", relPath, strerror(errno));
+    return 0;
+  }
+  if (!fgets(r->header, sizeof(r->header), r->fp)) {
+    fclose(r->fp);
+    r->fp = NULL;
+    return 0;
+  }
+  r->header[strcspn(r->header, "\r\n")] = '\0';
+  r->num_columns = split_csv_line(r->header, r->columns, 64);
+  r->num_fields = 0;
+  return 1;
+}
+
+/**
+ * csv_column()
+ *
+ * Returns:
+ *   Index of the named column, or -1 if the file has no such column
+ */
+int csv_column(const CsvReader* r, const char* name) {
+  for (int i = 0; i < r->num_columns; ++i)
+    if (strcmp(r->columns[i], name) == 0) return i;
+  return -1;
+}
+
+/**
+ * csv_next()
+ *
+ * Reads the next non-empty record.
+ *
+ * Returns:
+ *   1 if a record was read, 0 at end of file
+ */
+int csv_next(CsvReader* r) {
+  while (fgets(r->line, sizeof(r->line), r->fp)) {
+    r->line[strcspn(r->line, "\r\n")] = '\0';
+    if (r->line[0] == '\0') continue;
+    r->num_fields = split_csv_line(r->line, r->fields, 64);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * csv_field()
+ *
+ * Returns:
+ *   Field at the given column of the current record, or "" if the column is
+ *   missing (-1) or the record is short
+ */
+const char* csv_field(const CsvReader* r, int column) {
+  if (column < 0 || column >= r->num_fields) return "";
+  return r->fields[column];
+}
+
+void csv_close(CsvReader* r) {
+  if (r->fp) fclose(r->fp);
+  r->fp = NULL;
+}
+
+/**
+ * parse_gtfs_time()
+ *
+ * Parses a GTFS "H:MM:SS" / "HH:MM:SS" time into seconds after midnight of
+ * the service day. Hours may exceed 23 for trips that run past midnight.
+ *
+ * Returns:
+ *   Seconds after midnight, or -1 if the string is empty or malformed
+ */
+int parse_gtfs_time(const char* s) {
+  int parts[3] = {0, 0, 0};
+  int n = 0;
+  while (*s == ' ') s++;
+  if (!isdigit((unsigned char)*s)) return -1;
+  while (n < 3) {
+    if (!isdigit((unsigned char)*s)) return -1;
+    while (isdigit((unsigned char)*s)) parts[n] = parts[n] * 10 + (*s++ - '0');
+    n++;
+    if (*s != ':') break;
+    s++;
+  }
+  if (n != 3 || parts[1] > 59 || parts[2] > 59) return -1;
+  return parts[0] * 3600 + parts[1] * 60 + parts[2];
+}
+
+/**
+ * format_gtfs_time()
+ *
+ * Formats seconds after midnight as "HH:MM:SS" (hours may exceed 23).
+ *
+ * Parameters:
+ *   seconds - Time to format
+ *   out     - Output buffer (at least 16 bytes)
+ *   outSize - Size of the output buffer
+ */
+void format_gtfs_time(int seconds, char* out, size_t outSize) {
+  if (seconds < 0) {
+    snprintf(out, outSize, "--:--:--");
+    return;
+  }
+  snprintf(out, outSize, "%02d:%02d:%02d", seconds / 3600, seconds / 60 % 60,
+           seconds % 60);
+}
+
+/**
+ * parse_gtfs_date()
+ *
+ * Converts a GTFS "YYYYMMDD" date into a day number (days since
+ * 1970-01-01), so dates can index bitmasks and differ by subtraction.
+ *
+ * Returns:
+ *   Day number, or INT_MIN if the string is malformed or names a day the
+ *   month does not have (e.g. 20260230)
+ */
+int parse_gtfs_date(const char* s) {
+  int ymd = 0;
+  for (int i = 0; i < 8; ++i) {
+    if (!isdigit((unsigned char)s[i])) return INT_MIN;
+    ymd = ymd * 10 + (s[i] - '0');
+  }
+  int y = ymd / 10000, m = ymd / 100 % 100, d = ymd % 100;
+  static const int monthDays[12] = {31, 28, 31, 30, 31, 30,
+                                    31, 31, 30, 31, 30, 31};
+  if (m < 1 || m > 12 || d < 1) return INT_MIN;
+  int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+  if (d > monthDays[m - 1] + (m == 2 && leap)) return INT_MIN;
+  // Days-from-civil, counting years from March so leap days come last
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  int yoe = y - era * 400;
+  int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+/**
+ * parse_trip_attributes()
+ *
+ * Parses a comma-separated list of trip attributes ("wheelchair",
+ * "bikes").
+ *
+ * Returns:
+ *   The TRIP_* bits, or 0 if the list is empty or names an unknown
+ *   attribute
+ */
+unsigned parse_trip_attributes(const char* list) {
+  unsigned bits = 0;
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    if (len == 10 && strncmp(list, "wheelchair", len) == 0)
+      bits |= TRIP_WHEELCHAIR;
+    else if (len == 5 && strncmp(list, "bikes", len) == 0)
+      bits |= TRIP_BIKES;
+    else
+      return 0;
+    list += len;
+    if (*list == ',') ++list;
+  }
+  return bits;
+}
+
+/**
+ * day_of_week()
+ *
+ * Returns:
+ *   0 for Monday through 6 for Sunday, for a parse_gtfs_date() day number
+ */
+int day_of_week(int day) {
+  int w = (day + 3) % 7;  // 1970-01-01 was a Thursday
+  return w < 0 ? w + 7 : w;
+}
+
+/**
+ * now_seconds()
+ *
+ * Returns:
+ *   Monotonic wall-clock time in seconds, for timing and benchmarks
+ */
+double now_seconds(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER t;
+  if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart / (double)freq.QuadPart;
+}
+
+/** Connections (or other units of work) between two time-limit checks. */
+#define TIME_LIMIT_CHECK_INTERVAL 1024
+
+/**
+ * time_limit_reached()
+ *
+ * Returns:
+ *   1 if `limit` (a now_seconds() time, 0 for none) has passed
+ */
+int time_limit_reached(double limit) {
+  return limit > 0 && now_seconds() >= limit;
+}
+
+/**
+ * Arena structure
+ * Bump allocator over one fixed block, reset between queries. Allocations
+ * fail once the block is used up, which gives each query a hard memory
+ * budget without calling malloc on the query path.
+ */
+typedef struct {
+  unsigned char* base;  ///< The block
+  size_t capacity;      ///< Size of the block in bytes
+  size_t used;          ///< Bytes handed out since the last reset
+} Arena;
+
+int arena_init(Arena* a, size_t capacity) {
+  a->base = malloc(capacity > 0 ? capacity : 1);
+  a->capacity = a->base ? capacity : 0;
+  a->used = 0;
+  return a->base != NULL;
+}
+
+/**
+ * arena_alloc()
+ *
+ * Returns:
+ *   `size` bytes aligned to 16, or NULL if the budget is used up
+ */
+void* arena_alloc(Arena* a, size_t size) {
+  size_t start = (a->used + 15) & ~(size_t)15;
+  if (start > a->capacity || size > a->capacity - start) return NULL;
+  a->used = start + size;
+  return a->base + start;
+}
+
+void arena_reset(Arena* a) { a->used = 0; }
+
+void arena_free(Arena* a) {
+  free(a->base);
+  memset(a, 0, sizeof(*a));
+}
+
+/**
+ * ByteBuffer structure
+ * Growable output buffer meant to be reused: byte_buffer_reset() keeps the
+ * allocation, so once it has grown to the largest output, writing into it
+ * allocates nothing.
+ */
+typedef struct {
+  unsigned char* data;  ///< Bytes written (not NUL-terminated)
+  size_t len;           ///< Number of bytes written
+  size_t capacity;      ///< Allocated size
+} ByteBuffer;
+
+/**
+ * byte_buffer_reserve()
+ *
+ * Ensures room for `extra` more bytes, doubling the allocation.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure (the contents are kept)
+ */
+int byte_buffer_reserve(ByteBuffer* b, size_t extra) {
+  if (b->capacity - b->len >= extra) return 1;
+  size_t cap = b->capacity ? b->capacity : 256;
+  while (cap - b->len < extra) cap *= 2;
+  unsigned char* p = realloc(b->data, cap);
+  if (!p) return 0;
+  b->data = p;
+  b->capacity = cap;
+  return 1;
+}
+
+void byte_buffer_reset(ByteBuffer* b) { b->len = 0; }
+
+void byte_buffer_free(ByteBuffer* b) {
+  free(b->data);
+  memset(b, 0, sizeof(*b));
+}
+
 // ============================================================================
 // STOP SEARCH FUNCTIONS
 // ============================================================================
@@ -274,44 +993,11 @@ void str_to_lower_copy(const char* src, char* dest, size_t destSize) {
  *   1 if stop found and displayed, 0 if no match or file error
  */
 int find_stop_in_csv(const char* stopsPath, const char* query) {
-  FILE* fp = fopen(stopsPath, "r");
-  char resolved[1200];
-
-  // If file not found at the provided path, search for it
+  FILE* fp = open_data_file(stopsPath);
   if (!fp) {
-    // Try from current working directory and parent directories
-    if (find_file_in_ancestors(stopsPath, resolved, sizeof(resolved), 6)) {
-      printf("found stops file at: %s\n", resolved);
-      fp = fopen(resolved, "r");
-      if (!fp) {
-        fprintf(stderr, "opening stops file '%s': %s\n", resolved,
-                strerror(errno));
-        return 0;
-      }
-    } else {
-      // Try from executable directory (useful when debugger runs with different
-      // cwd)
-      char exeDir[1024];
-      if (get_exe_dir(exeDir, sizeof(exeDir))) {
-        char oldcwd[1024];
-        if (_getcwd(oldcwd, sizeof(oldcwd)) != NULL) {
-          if (_chdir(exeDir) == 0) {
-            if (find_file_in_ancestors(stopsPath, resolved, sizeof(resolved),
-                                       6)) {
-              printf("found stops file at: %s\n", resolved);
-              fp = fopen(resolved, "r");
-            }
-            _chdir(oldcwd);
-          }
-        }
-      }
-    }
-
-    if (!fp) {
-      fprintf(stderr, "opening stops file '%s': %s\n", stopsPath,
-              strerror(errno));
-      return 0;
-    }
+    fprintf(stderr, "opening stops file '%s': %s\n", stopsPath,
+            strerror(errno));
+    return 0;
   }
 
   // Read the first line (header) to determine column indices
@@ -391,15 +1077,8877 @@ int find_stop_in_csv(const char* stopsPath, const char* query) {
 }
 
 // ============================================================================
-// MAIN PROGRAM
+// GEOMETRY
 // ============================================================================
 
+/** Degrees to radians. */
+#define DEG_TO_RAD (3.14159265358979323846 / 180.0)
+
 /**
- * main()
- *
- * Entry point for the GTFS stop lookup program.
+ * Hops up to this many metres may use the equirectangular approximation
+ * (see geo_distances_fast_m()); its relative error stays below 1e-7 there
+ * (see run_geo_bench_mode()).
+ */
+#define GEO_FAST_MAX_M 10000.0
+
+/**
+ * haversine_m()
+ *
+ * Great-circle distance between two points given in degrees.
+ *
+ * Returns:
+ *   Distance in metres
+ */
+double haversine_m(double lat1, double lon1, double lat2, double lon2) {
+  double dLat = (lat2 - lat1) * DEG_TO_RAD;
+  double dLon = (lon2 - lon1) * DEG_TO_RAD;
+  double a = sin(dLat / 2) * sin(dLat / 2) +
+             cos(lat1 * DEG_TO_RAD) * cos(lat2 * DEG_TO_RAD) *
+                 sin(dLon / 2) * sin(dLon / 2);
+  return 2.0 * EARTH_RADIUS_M * atan2(sqrt(a), sqrt(1 - a));
+}
+
+/**
+ * GeoPoints structure
+ * Coordinates in structure-of-arrays form for the batch distance kernels.
+ * Radians and the cosine of the latitude are computed once per point, so
+ * the kernels are branch-free loops over contiguous arrays.
+ */
+typedef struct {
+  double* lat;      ///< Latitudes, in radians
+  double* lon;      ///< Longitudes, in radians
+  double* cos_lat;  ///< Cosine of each latitude
+  int count;        ///< Number of points
+} GeoPoints;
+
+/**
+ * geo_points_init()
+ *
+ * Allocates room for n points (set them with geo_points_set()).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int geo_points_init(GeoPoints* g, int n) {
+  size_t size = (size_t)(n > 0 ? n : 1) * sizeof(double);
+  g->lat = malloc(size);
+  g->lon = malloc(size);
+  g->cos_lat = malloc(size);
+  g->count = n;
+  return g->lat && g->lon && g->cos_lat;
+}
+
+/** Stores point i, given in degrees. */
+void geo_points_set(GeoPoints* g, int i, double latDeg, double lonDeg) {
+  g->lat[i] = latDeg * DEG_TO_RAD;
+  g->lon[i] = lonDeg * DEG_TO_RAD;
+  g->cos_lat[i] = cos(g->lat[i]);
+}
+
+void geo_points_free(GeoPoints* g) {
+  free(g->lat);
+  free(g->lon);
+  free(g->cos_lat);
+  g->lat = g->lon = g->cos_lat = NULL;
+  g->count = 0;
+}
+
+/**
+ * geo_distances_m()
+ *
+ * Batch haversine: great-circle distances from (latDeg, lonDeg) to points
+ * [from, end) of `to`, written to out[0 .. end - from). Same results as
+ * haversine_m(), with the origin's trigonometry done once per batch.
+ */
+void geo_distances_m(double latDeg, double lonDeg, const GeoPoints* to,
+                     int from, int end, double* restrict out) {
+  const double* restrict lat = to->lat;
+  const double* restrict lon = to->lon;
+  const double* restrict cosLat = to->cos_lat;
+  double lat0 = latDeg * DEG_TO_RAD, lon0 = lonDeg * DEG_TO_RAD;
+  double cos0 = cos(lat0);
+  for (int i = from; i < end; ++i) {
+    double sLat = sin((lat[i] - lat0) * 0.5);
+    double sLon = sin((lon[i] - lon0) * 0.5);
+    double a = sLat * sLat + cos0 * cosLat[i] * sLon * sLon;
+    if (a > 1.0) a = 1.0;
+    out[i - from] = 2.0 * EARTH_RADIUS_M * asin(sqrt(a));
+  }
+}
+
+/**
+ * geo_distances_fast_m()
+ *
+ * Like geo_distances_m(), but on the equirectangular approximation: the
+ * longitude difference is scaled by the mean of the two latitude cosines.
+ * Only a square root runs in the loop, no trigonometry, so it is about ten
+ * times faster and vectorizes where the compiler may (e.g. with -O3
+ * -fno-math-errno). Only meant for short hops (see GEO_FAST_MAX_M).
+ */
+void geo_distances_fast_m(double latDeg, double lonDeg, const GeoPoints* to,
+                          int from, int end, double* restrict out) {
+  const double* restrict lat = to->lat;
+  const double* restrict lon = to->lon;
+  const double* restrict cosLat = to->cos_lat;
+  double lat0 = latDeg * DEG_TO_RAD, lon0 = lonDeg * DEG_TO_RAD;
+  double cos0 = cos(lat0);
+  for (int i = from; i < end; ++i) {
+    double x = (lon[i] - lon0) * 0.5 * (cos0 + cosLat[i]);
+    double y = lat[i] - lat0;
+    out[i - from] = EARTH_RADIUS_M * sqrt(x * x + y * y);
+  }
+}
+
+/**
+ * geo_path_length_m()
+ *
+ * Length of the polyline through n points given in degrees (e.g. a slice
+ * of the shape arrays), summing the haversine length of each piece. Each
+ * point's latitude cosine serves both pieces it ends.
+ *
+ * Parameters:
+ *   cumulative - If not NULL, receives the length up to each of the n
+ *                points (0 for the first)
+ *
+ * Returns:
+ *   Length in metres (0 for fewer than two points)
+ */
+double geo_path_length_m(const double* lat, const double* lon, int n,
+                         double* cumulative) {
+  if (cumulative && n > 0) cumulative[0] = 0.0;
+  if (n < 2) return 0.0;
+  double total = 0.0;
+  double prevCos = cos(lat[0] * DEG_TO_RAD);
+  for (int i = 1; i < n; ++i) {
+    double c = cos(lat[i] * DEG_TO_RAD);
+    double sLat = sin((lat[i] - lat[i - 1]) * (0.5 * DEG_TO_RAD));
+    double sLon = sin((lon[i] - lon[i - 1]) * (0.5 * DEG_TO_RAD));
+    double a = sLat * sLat + prevCos * c * sLon * sLon;
+    if (a > 1.0) a = 1.0;
+    total += 2.0 * EARTH_RADIUS_M * asin(sqrt(a));
+    if (cumulative) cumulative[i] = total;
+    prevCos = c;
+  }
+  return total;
+}
+
+// ============================================================================
+// TIMETABLE LOADING
+// ============================================================================
+
+/**
+ * hash_id()
+ *
+ * FNV-1a hash of a GTFS identifier.
+ */
+unsigned hash_id(const char* s) {
+  unsigned h = 2166136261u;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * hash_bytes()
+ *
+ * FNV-1a hash of a memory block, continuing from `h` (start with
+ * 2166136261u).
+ */
+unsigned hash_bytes(const void* data, size_t size, unsigned h) {
+  const unsigned char* p = data;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * id_index_init()
+ *
+ * Allocates an empty index able to hold at least `expected` keys at a load
+ * factor of at most one half.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int id_index_init(IdIndex* idx, int expected) {
+  unsigned cap = 16;
+  while (cap < (unsigned)expected * 2) cap <<= 1;
+  idx->capacity = cap;
+  idx->keys = calloc(cap, sizeof(*idx->keys));
+  idx->values = malloc(cap * sizeof(*idx->values));
+  return idx->keys && idx->values;
+}
+
+/**
+ * id_index_put()
+ *
+ * Inserts or replaces a key. The key string must outlive the index.
+ */
+void id_index_put(IdIndex* idx, const char* key, int value) {
+  unsigned mask = idx->capacity - 1;
+  unsigned i = hash_id(key) & mask;
+  while (idx->keys[i] && strcmp(idx->keys[i], key) != 0) i = (i + 1) & mask;
+  idx->keys[i] = key;
+  idx->values[i] = value;
+}
+
+/**
+ * id_index_get()
+ *
+ * Returns:
+ *   Value stored for key, or -1 if the key is absent
+ */
+int id_index_get(const IdIndex* idx, const char* key) {
+  if (idx->capacity == 0) return -1;
+  unsigned mask = idx->capacity - 1;
+  unsigned i = hash_id(key) & mask;
+  while (idx->keys[i]) {
+    if (strcmp(idx->keys[i], key) == 0) return idx->values[i];
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+void id_index_free(IdIndex* idx) {
+  free(idx->keys);
+  free(idx->values);
+  idx->keys = NULL;
+  idx->values = NULL;
+  idx->capacity = 0;
+}
+
+/**
+ * grow_array()
+ *
+ * Ensures *arr has room for `needed` elements, doubling its capacity.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure (*arr is left untouched)
+ */
+int grow_array(void** arr, int* capacity, int needed, size_t elemSize) {
+  if (needed <= *capacity) return 1;
+  int cap = *capacity ? *capacity : 256;
+  while (cap < needed) cap *= 2;
+  void* p = realloc(*arr, (size_t)cap * elemSize);
+  if (!p) return 0;
+  *arr = p;
+  *capacity = cap;
+  return 1;
+}
+
+/**
+ * load_stops()
+ *
+ * Loads stops.csv into tt->stops and builds the stop_id index.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int load_stops(Timetable* tt, const char* path) {
+  CsvReader r;
+  if (!csv_open(&r, path)) return 0;
+  int c_id = csv_column(&r, "stop_id");
+  int c_name = csv_column(&r, "stop_name");
+  int c_desc = csv_column(&r, "stop_desc");
+  int c_lat = csv_column(&r, "stop_lat");
+  int c_lon = csv_column(&r, "stop_lon");
+  int cap = 0;
+  while (csv_next(&r)) {
+    if (!grow_array((void**)&tt->stops, &cap, tt->num_stops + 1,
+                    sizeof(Stop))) {
+      csv_close(&r);
+      return 0;
+    }
+    Stop* s = &tt->stops[tt->num_stops++];
+    s->stop_id = strdup(csv_field(&r, c_id));
+    s->stop_name = strdup(csv_field(&r, c_name));
+    s->stop_desc = strdup(csv_field(&r, c_desc));
+    s->stop_lat = atof(csv_field(&r, c_lat));
+    s->stop_lon = atof(csv_field(&r, c_lon));
+  }
+  csv_close(&r);
+
+  if (!id_index_init(&tt->stop_index, tt->num_stops)) return 0;
+  for (int i = 0; i < tt->num_stops; ++i)
+    id_index_put(&tt->stop_index, tt->stops[i].stop_id, i);
+  return 1;
+}
+
+/**
+ * load_routes()
+ *
+ * Loads routes.csv into tt->routes and builds the route_id index.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int load_routes(Timetable* tt, const char* path) {
+  CsvReader r;
+  if (!csv_open(&r, path)) return 0;
+  int c_id = csv_column(&r, "route_id");
+  int c_short = csv_column(&r, "route_short_name");
+  int c_long = csv_column(&r, "route_long_name");
+  int cap = 0;
+  while (csv_next(&r)) {
+    if (!grow_array((void**)&tt->routes, &cap, tt->num_routes + 1,
+                    sizeof(Route))) {
+      csv_close(&r);
+      return 0;
+    }
+    Route* rt = &tt->routes[tt->num_routes++];
+    rt->route_id = strdup(csv_field(&r, c_id));
+    rt->route_short_name = strdup(csv_field(&r, c_short));
+    rt->route_long_name = strdup(csv_field(&r, c_long));
+  }
+  csv_close(&r);
+
+  if (!id_index_init(&tt->route_index, tt->num_routes)) return 0;
+  for (int i = 0; i < tt->num_routes; ++i)
+    id_index_put(&tt->route_index, tt->routes[i].route_id, i);
+  return 1;
+}
+
+/**
+ * ShapeRow structure
+ * One parsed row of shapes.csv, kept until the rows are grouped by shape.
+ */
+typedef struct {
+  int shape;     ///< Index of the shape in Timetable.shapes
+  int sequence;  ///< shape_pt_sequence
+  double lat;    ///< shape_pt_lat
+  double lon;    ///< shape_pt_lon
+  double dist;   ///< shape_dist_traveled, or -1 if empty
+} ShapeRow;
+
+/** qsort comparator: shape rows by shape, then shape_pt_sequence. */
+int compare_shape_rows(const void* a, const void* b) {
+  const ShapeRow* x = a;
+  const ShapeRow* y = b;
+  if (x->shape != y->shape) return x->shape < y->shape ? -1 : 1;
+  return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+/**
+ * intern_shape()
+ *
+ * Returns:
+ *   Index of shape_id in tt->shapes, adding an empty shape if new (the
+ *   index is rebuilt at twice the size when half full); -1 on allocation
+ *   failure
+ */
+int intern_shape(Timetable* tt, int* capacity, const char* shapeId) {
+  int idx = id_index_get(&tt->shape_index, shapeId);
+  if (idx >= 0) return idx;
+  if (!grow_array((void**)&tt->shapes, capacity, tt->num_shapes + 1,
+                  sizeof(Shape)))
+    return -1;
+  if ((unsigned)(tt->num_shapes + 1) * 2 > tt->shape_index.capacity) {
+    id_index_free(&tt->shape_index);
+    if (!id_index_init(&tt->shape_index, (tt->num_shapes + 1) * 2))
+      return -1;
+    for (int i = 0; i < tt->num_shapes; ++i)
+      id_index_put(&tt->shape_index, tt->shapes[i].shape_id, i);
+  }
+  idx = tt->num_shapes++;
+  Shape* sh = &tt->shapes[idx];
+  sh->shape_id = strdup(shapeId);
+  sh->first_point = 0;
+  sh->num_points = 0;
+  id_index_put(&tt->shape_index, sh->shape_id, idx);
+  return idx;
+}
+
+/**
+ * load_shapes()
+ *
+ * Loads the optional shapes.csv into one flat array per coordinate,
+ * grouped by shape and ordered by shape_pt_sequence, and builds the
+ * shape_id index. An empty shape_dist_traveled repeats the previous
+ * point's value (0 for a shape's first point).
+ *
+ * Returns:
+ *   1 on success or if the file does not exist, 0 on allocation failure
+ */
+int load_shapes(Timetable* tt) {
+  char resolved[1200];
+  if (!resolve_data_path("./csv_files/shapes.csv", resolved,
+                         sizeof(resolved)))
+    return 1;
+  CsvReader r;
+  if (!csv_open(&r, resolved)) return 1;
+  int c_id = csv_column(&r, "shape_id");
+  int c_lat = csv_column(&r, "shape_pt_lat");
+  int c_lon = csv_column(&r, "shape_pt_lon");
+  int c_seq = csv_column(&r, "shape_pt_sequence");
+  int c_dist = csv_column(&r, "shape_dist_traveled");
+  ShapeRow* rows = NULL;
+  int numRows = 0, rowCap = 0, shapeCap = 0;
+  int ok = 1;
+  while (ok && csv_next(&r)) {
+    const char* dist = csv_field(&r, c_dist);
+    ShapeRow row;
+    row.shape = intern_shape(tt, &shapeCap, csv_field(&r, c_id));
+    row.sequence = atoi(csv_field(&r, c_seq));
+    row.lat = atof(csv_field(&r, c_lat));
+    row.lon = atof(csv_field(&r, c_lon));
+    row.dist = dist[0] ? atof(dist) : -1.0;
+    ok = row.shape >= 0 && grow_array((void**)&rows, &rowCap, numRows + 1,
+                                      sizeof(ShapeRow));
+    if (ok) rows[numRows++] = row;
+  }
+  csv_close(&r);
+
+  if (ok) {
+    tt->shape_lat = malloc((size_t)(numRows ? numRows : 1) * sizeof(double));
+    tt->shape_lon = malloc((size_t)(numRows ? numRows : 1) * sizeof(double));
+    tt->shape_dist = malloc((size_t)(numRows ? numRows : 1) *
+                            sizeof(double));
+    tt->shape_m = malloc((size_t)(numRows ? numRows : 1) * sizeof(double));
+    ok = tt->shape_lat && tt->shape_lon && tt->shape_dist && tt->shape_m;
+  }
+  if (ok) {
+    qsort(rows, (size_t)numRows, sizeof(ShapeRow), compare_shape_rows);
+    for (int i = 0; i < numRows; ++i) {
+      Shape* sh = &tt->shapes[rows[i].shape];
+      if (sh->num_points == 0) sh->first_point = i;
+      double dist = rows[i].dist;
+      if (dist < 0) dist = sh->num_points ? tt->shape_dist[i - 1] : 0.0;
+      sh->num_points++;
+      tt->shape_lat[i] = rows[i].lat;
+      tt->shape_lon[i] = rows[i].lon;
+      tt->shape_dist[i] = dist;
+    }
+    tt->num_shape_points = numRows;
+    // Metres are measured here rather than trusted from shape_dist, whose
+    // unit varies between feeds
+    for (int s = 0; s < tt->num_shapes; ++s) {
+      const Shape* sh = &tt->shapes[s];
+      geo_path_length_m(tt->shape_lat + sh->first_point,
+                        tt->shape_lon + sh->first_point, sh->num_points,
+                        tt->shape_m + sh->first_point);
+    }
+  }
+  free(rows);
+  return ok;
+}
+
+/**
+ * trip_shape()
+ *
+ * Returns:
+ *   The trip's shape, whose points are read in place from
+ *   tt->shape_lat / shape_lon / shape_dist starting at first_point; NULL if
+ *   the trip has no shape
+ */
+const Shape* trip_shape(const Timetable* tt, int trip) {
+  int s = tt->trips[trip].shape;
+  return s >= 0 ? &tt->shapes[s] : NULL;
+}
+
+/**
+ * load_trips()
+ *
+ * Loads trips.csv into tt->trips, resolves each trip's shape_id against
+ * the shapes loaded before, and builds the trip_id index.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int load_trips(Timetable* tt, const char* path) {
+  CsvReader r;
+  if (!csv_open(&r, path)) return 0;
+  int c_route = csv_column(&r, "route_id");
+  int c_service = csv_column(&r, "service_id");
+  int c_id = csv_column(&r, "trip_id");
+  int c_headsign = csv_column(&r, "trip_headsign");
+  int c_dir = csv_column(&r, "direction_id");
+  int c_block = csv_column(&r, "block_id");
+  int c_wheelchair = csv_column(&r, "wheelchair_accessible");
+  int c_bikes = csv_column(&r, "bikes_allowed");
+  int c_shape = csv_column(&r, "shape_id");
+  int cap = 0;
+  while (csv_next(&r)) {
+    if (!grow_array((void**)&tt->trips, &cap, tt->num_trips + 1,
+                    sizeof(Trip))) {
+      csv_close(&r);
+      return 0;
+    }
+    Trip* t = &tt->trips[tt->num_trips++];
+    t->route_id = strdup(csv_field(&r, c_route));
+    t->service_id = strdup(csv_field(&r, c_service));
+    t->trip_id = strdup(csv_field(&r, c_id));
+    t->trip_headsign = strdup(csv_field(&r, c_headsign));
+    t->block_id = strdup(csv_field(&r, c_block));
+    t->direction_id = atoi(csv_field(&r, c_dir));
+    t->route = id_index_get(&tt->route_index, t->route_id);
+    t->service = -1;
+    t->first_stop_time = 0;
+    t->num_stop_times = 0;
+    t->block_prev = -1;
+    t->block_next = -1;
+    t->frequency = -1;
+    t->shape = id_index_get(&tt->shape_index, csv_field(&r, c_shape));
+    // GTFS: 1 = available, 2 = not available, empty/0 = unknown
+    t->attributes = 0;
+    if (atoi(csv_field(&r, c_wheelchair)) == 1)
+      t->attributes |= TRIP_WHEELCHAIR;
+    if (atoi(csv_field(&r, c_bikes)) == 1) t->attributes |= TRIP_BIKES;
+  }
+  csv_close(&r);
+
+  if (!id_index_init(&tt->trip_index, tt->num_trips)) return 0;
+  for (int i = 0; i < tt->num_trips; ++i)
+    id_index_put(&tt->trip_index, tt->trips[i].trip_id, i);
+  return 1;
+}
+
+/** qsort comparator: stop times by trip, then stop_sequence. */
+int compare_stop_times(const void* a, const void* b) {
+  const StopTime* x = a;
+  const StopTime* y = b;
+  if (x->trip != y->trip) return x->trip < y->trip ? -1 : 1;
+  return (x->stop_sequence > y->stop_sequence) -
+         (x->stop_sequence < y->stop_sequence);
+}
+
+/**
+ * load_stop_times()
+ *
+ * Loads stop_times.csv, resolving trip_id/stop_id to indices and parsing
+ * times. Rows referring to unknown trips or stops are skipped. The result
+ * is sorted by (trip, stop_sequence) and each trip's range is recorded.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int load_stop_times(Timetable* tt, const char* path) {
+  CsvReader r;
+  if (!csv_open(&r, path)) return 0;
+  int c_trip = csv_column(&r, "trip_id");
+  int c_arr = csv_column(&r, "arrival_time");
+  int c_dep = csv_column(&r, "departure_time");
+  int c_stop = csv_column(&r, "stop_id");
+  int c_seq = csv_column(&r, "stop_sequence");
+  int c_dist = csv_column(&r, "shape_dist_traveled");
+  int cap = 0;
+  int skipped = 0;
+  while (csv_next(&r)) {
+    int trip = id_index_get(&tt->trip_index, csv_field(&r, c_trip));
+    int stop = id_index_get(&tt->stop_index, csv_field(&r, c_stop));
+    int arr = parse_gtfs_time(csv_field(&r, c_arr));
+    int dep = parse_gtfs_time(csv_field(&r, c_dep));
+    if (trip < 0 || stop < 0 || (arr < 0 && dep < 0)) {
+      skipped++;
+      continue;
+    }
+    if (!grow_array((void**)&tt->stop_times, &cap, tt->num_stop_times + 1,
+                    sizeof(StopTime))) {
+      csv_close(&r);
+      return 0;
+    }
+    StopTime* st = &tt->stop_times[tt->num_stop_times++];
+    st->trip = trip;
+    st->stop = stop;
+    st->arrival_time = arr >= 0 ? arr : dep;
+    st->departure_time = dep >= 0 ? dep : arr;
+    st->stop_sequence = atoi(csv_field(&r, c_seq));
+    const char* dist = csv_field(&r, c_dist);
+    st->shape_dist = dist[0] ? (float)atof(dist) : -1.0f;
+  }
+  csv_close(&r);
+  if (skipped > 0)
+    fprintf(stderr, "skipped %d stop_times rows with unknown ids/times\n",
+            skipped);
+
+  qsort(tt->stop_times, tt->num_stop_times, sizeof(StopTime),
+        compare_stop_times);
+  for (int i = 0; i < tt->num_stop_times; ++i) {
+    Trip* t = &tt->trips[tt->stop_times[i].trip];
+    if (t->num_stop_times == 0) t->first_stop_time = i;
+    t->num_stop_times++;
+  }
+  return 1;
+}
+
+/**
+ * shape_locate_dist()
+ *
+ * Finds where shape_dist_traveled `dist` falls among shape points
+ * [from, end), whose distances never decrease.
+ *
+ * Returns:
+ *   Point at or just before `dist` (`from` if dist lies before it); *t is
+ *   the fraction of the way to the next point
+ */
+int shape_locate_dist(const Timetable* tt, int from, int end, double dist,
+                      double* t) {
+  const double* d = tt->shape_dist;
+  int lo = from, hi = end;  // first point with d >= dist
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (d[mid] < dist) lo = mid + 1;
+    else hi = mid;
+  }
+  *t = 0.0;
+  if (lo == end) return end - 1;
+  if (lo == from || d[lo] == dist) return lo;
+  *t = (dist - d[lo - 1]) / (d[lo] - d[lo - 1]);
+  return lo - 1;
+}
+
+/**
+ * shape_locate_point()
+ *
+ * Finds the point of the polyline through shape points [from, end) nearest
+ * to (lat, lon), on a local flat projection. Used for stop times without
+ * shape_dist_traveled.
+ *
+ * Returns:
+ *   Start point of the nearest piece; *t is the fraction along it
+ */
+int shape_locate_point(const Timetable* tt, int from, int end, double lat,
+                       double lon, double* t) {
+  double kx = cos(lat * DEG_TO_RAD);
+  int best = from;
+  double bestT = 0.0, bestD = -1.0;
+  for (int i = from; i < end; ++i) {
+    double ax = (tt->shape_lon[i] - lon) * kx, ay = tt->shape_lat[i] - lat;
+    double u = 0.0;
+    if (i + 1 < end) {
+      double dx = (tt->shape_lon[i + 1] - tt->shape_lon[i]) * kx;
+      double dy = tt->shape_lat[i + 1] - tt->shape_lat[i];
+      double len = dx * dx + dy * dy;
+      if (len > 0) u = -(ax * dx + ay * dy) / len;
+      if (u < 0) u = 0;
+      if (u > 1) u = 1;
+      ax += u * dx;
+      ay += u * dy;
+    }
+    double d = ax * ax + ay * ay;
+    if (bestD < 0 || d < bestD) {
+      best = i;
+      bestT = u;
+      bestD = d;
+    }
+  }
+  *t = bestT;
+  return best;
+}
+
+/**
+ * shape_anchor_set()
+ *
+ * Sets an anchor `f` of the way from shape point `p` to the next one
+ * (points before `end` belong to the shape).
+ */
+void shape_anchor_set(const Timetable* tt, ShapeAnchor* a, int p, double f,
+                      int end) {
+  int next = p + 1 < end ? p + 1 : p;
+  a->point = p;
+  a->lat = tt->shape_lat[p] + f * (tt->shape_lat[next] - tt->shape_lat[p]);
+  a->lon = tt->shape_lon[p] + f * (tt->shape_lon[next] - tt->shape_lon[p]);
+  a->dist_m = tt->shape_m[p] + f * (tt->shape_m[next] - tt->shape_m[p]);
+}
+
+/**
+ * Distance (metres) beyond which a stop placed by its shape_dist_traveled
+ * is checked against the nearest point of the shape instead.
+ */
+#define SHAPE_ANCHOR_TOLERANCE_M 100.0
+
+/**
+ * build_shape_anchors()
+ *
+ * Places every stop time on its trip's shape once, so drawing a ride is a
+ * lookup (see ride_shape()). Stops are located by their
+ * shape_dist_traveled, or by the nearest point of the shape when it is
+ * empty or lands farther than SHAPE_ANCHOR_TOLERANCE_M from the stop,
+ * always at or after the trip's previous stop. Stop times of trips without
+ * a shape anchor at the stop itself. Each anchor also records its distance
+ * along the trip, so the length of any ride is one subtraction.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_shape_anchors(Timetable* tt) {
+  int n = tt->num_stop_times ? tt->num_stop_times : 1;
+  tt->shape_anchors = malloc((size_t)n * sizeof(ShapeAnchor));
+  if (!tt->shape_anchors) return 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    const Shape* sh = trip_shape(tt, t);
+    int from = sh ? sh->first_point : 0;
+    for (int k = 0; k < trip->num_stop_times; ++k) {
+      int i = trip->first_stop_time + k;
+      const StopTime* st = &tt->stop_times[i];
+      const Stop* stop = &tt->stops[st->stop];
+      ShapeAnchor* a = &tt->shape_anchors[i];
+      a->point = -1;
+      a->lat = stop->stop_lat;
+      a->lon = stop->stop_lon;
+      a->dist_m = 0.0;
+      if (!sh || sh->num_points == 0) {
+        if (k > 0)
+          a->dist_m = a[-1].dist_m + haversine_m(a[-1].lat, a[-1].lon,
+                                                 a->lat, a->lon);
+        continue;
+      }
+      int end = sh->first_point + sh->num_points;
+      double off = -1.0;
+      // The first stop has no distance in many feeds: it is at the start
+      if (st->shape_dist >= 0 || k == 0) {
+        double dist = st->shape_dist >= 0 ? st->shape_dist : 0.0, f;
+        int p = shape_locate_dist(tt, from, end, dist, &f);
+        shape_anchor_set(tt, a, p, f, end);
+        off = haversine_m(a->lat, a->lon, stop->stop_lat, stop->stop_lon);
+      }
+      // Missing or inconsistent distances: snap to the nearest point
+      if (off < 0 || off > SHAPE_ANCHOR_TOLERANCE_M) {
+        ShapeAnchor g;
+        double f;
+        int p = shape_locate_point(tt, from, end, stop->stop_lat,
+                                   stop->stop_lon, &f);
+        shape_anchor_set(tt, &g, p, f, end);
+        if (off < 0 || haversine_m(g.lat, g.lon, stop->stop_lat,
+                                   stop->stop_lon) < off)
+          *a = g;
+      }
+      // The nearest point may lie a little behind the previous stop's
+      if (k > 0 && a->dist_m < a[-1].dist_m) a->dist_m = a[-1].dist_m;
+      from = a->point;
+    }
+  }
+  return 1;
+}
+
+/**
+ * ride_shape()
+ *
+ * Geometry of a ride on one trip from stop time `from` to a later stop time
+ * `to` of the same trip (indices into tt->stop_times): the anchor of
+ * `from`, shape points [*first, *end) of the flat shape arrays, then the
+ * anchor of `to` (see tt->shape_anchors). A journey's geometry is the
+ * concatenation of its rides.
+ *
+ * Returns:
+ *   1 if the trip has a shape, 0 if the ride is drawn stop to stop
+ */
+int ride_shape(const Timetable* tt, int from, int to, int* first, int* end) {
+  const ShapeAnchor* a = &tt->shape_anchors[from];
+  const ShapeAnchor* b = &tt->shape_anchors[to];
+  if (a->point < 0) {
+    *first = *end = 0;
+    return 0;
+  }
+  *first = a->point + 1;
+  *end = b->point + 1;
+  if (*end < *first) *end = *first;
+  return 1;
+}
+
+/** qsort comparator: frequency rows by trip, then start time. */
+int compare_frequencies(const void* a, const void* b) {
+  const Frequency* x = a;
+  const Frequency* y = b;
+  if (x->trip != y->trip) return x->trip < y->trip ? -1 : 1;
+  return (x->start_time > y->start_time) - (x->start_time < y->start_time);
+}
+
+/**
+ * load_frequencies()
+ *
+ * Loads the optional frequencies.csv (GTFS frequencies.txt) as compact
+ * (start, end, headway) templates and marks their trips. Rows referring
+ * to unknown trips, trips with fewer than two stops, or empty periods are
+ * skipped. exact_times is not needed: both kinds run at the headway.
+ *
+ * Returns:
+ *   1 on success or if the file does not exist, 0 on allocation failure
+ */
+int load_frequencies(Timetable* tt) {
+  char resolved[1200];
+  if (!resolve_data_path("./csv_files/frequencies.csv", resolved,
+                         sizeof(resolved)))
+    return 1;
+  CsvReader r;
+  if (!csv_open(&r, resolved)) return 1;
+  int c_trip = csv_column(&r, "trip_id");
+  int c_start = csv_column(&r, "start_time");
+  int c_end = csv_column(&r, "end_time");
+  int c_headway = csv_column(&r, "headway_secs");
+  int cap = 0;
+  int skipped = 0;
+  while (csv_next(&r)) {
+    Frequency f;
+    f.trip = id_index_get(&tt->trip_index, csv_field(&r, c_trip));
+    f.start_time = parse_gtfs_time(csv_field(&r, c_start));
+    f.end_time = parse_gtfs_time(csv_field(&r, c_end));
+    f.headway = atoi(csv_field(&r, c_headway));
+    if (f.trip < 0 || tt->trips[f.trip].num_stop_times < 2 ||
+        f.start_time < 0 || f.end_time <= f.start_time || f.headway <= 0) {
+      skipped++;
+      continue;
+    }
+    if (!grow_array((void**)&tt->frequencies, &cap, tt->num_frequencies + 1,
+                    sizeof(Frequency))) {
+      csv_close(&r);
+      return 0;
+    }
+    tt->frequencies[tt->num_frequencies++] = f;
+  }
+  csv_close(&r);
+  if (skipped > 0)
+    fprintf(stderr, "skipped %d frequencies rows with unknown trips/times\n",
+            skipped);
+
+  qsort(tt->frequencies, (size_t)tt->num_frequencies, sizeof(Frequency),
+        compare_frequencies);
+  int ids = 0, vehicles = 0;
+  for (int i = 0; i < tt->num_frequencies; ++i) {
+    Frequency* f = &tt->frequencies[i];
+    Trip* trip = &tt->trips[f->trip];
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    int lastDep = st[trip->num_stop_times - 2].departure_time -
+                  st[0].departure_time;
+    if (trip->frequency < 0) trip->frequency = i;
+    f->num_instances = (f->end_time - f->start_time + f->headway - 1) /
+                       f->headway;
+    f->first_id = ids;
+    ids += f->num_instances * (trip->num_stop_times - 1);
+    // Instance k of a day is in a FreqStream from when instance k - 1
+    // leaves (or the scan starts) until its own last departure is
+    // emitted, so at scan time T its start lies in [T - lastDep,
+    // T + headway]: at most lastDep / headway + 2 instances per day
+    int running = lastDep / f->headway + 2;
+    if (running > f->num_instances) running = f->num_instances;
+    vehicles += 2 * running;
+  }
+  tt->num_frequency_connections = ids;
+  tt->max_frequency_vehicles = vehicles;
+  return 1;
+}
+
+/**
+ * CalendarRow structure
+ * One parsed row of calendar.csv or calendar_dates.csv, kept until the
+ * service bitmasks are built.
+ */
+typedef struct {
+  char* service_id;  ///< Service the row applies to
+  int weekdays;      ///< calendar.csv: bit 0 = Monday .. bit 6 = Sunday;
+                     ///< calendar_dates.csv: -1
+  int first_day;     ///< First day (day number); the date for exceptions
+  int last_day;      ///< Last day (day number); the date for exceptions
+  int exception;     ///< calendar_dates.csv exception_type (1 add, 2 remove)
+} CalendarRow;
+
+/**
+ * read_calendar_rows()
+ *
+ * Appends the rows of calendar.csv (isDates == 0) or calendar_dates.csv
+ * (isDates == 1) to *rows. Both files are optional.
+ *
+ * Returns:
+ *   1 on success or if the file does not exist, 0 on allocation failure
+ */
+int read_calendar_rows(const char* path, int isDates, CalendarRow** rows,
+                       int* count, int* capacity) {
+  char resolved[1200];
+  if (!resolve_data_path(path, resolved, sizeof(resolved))) return 1;
+  CsvReader r;
+  if (!csv_open(&r, resolved)) return 1;
+  static const char* days[7] = {"monday", "tuesday",  "wednesday", "thursday",
+                                "friday", "saturday", "sunday"};
+  int c_service = csv_column(&r, "service_id");
+  int c_day[7];
+  for (int d = 0; d < 7; ++d) c_day[d] = csv_column(&r, days[d]);
+  int c_start = csv_column(&r, "start_date");
+  int c_end = csv_column(&r, "end_date");
+  int c_date = csv_column(&r, "date");
+  int c_type = csv_column(&r, "exception_type");
+  while (csv_next(&r)) {
+    CalendarRow row;
+    if (isDates) {
+      row.weekdays = -1;
+      row.first_day = row.last_day = parse_gtfs_date(csv_field(&r, c_date));
+      row.exception = atoi(csv_field(&r, c_type));
+    } else {
+      row.weekdays = 0;
+      for (int d = 0; d < 7; ++d)
+        if (atoi(csv_field(&r, c_day[d])) == 1) row.weekdays |= 1 << d;
+      row.first_day = parse_gtfs_date(csv_field(&r, c_start));
+      row.last_day = parse_gtfs_date(csv_field(&r, c_end));
+      row.exception = 0;
+    }
+    if (row.first_day == INT_MIN || row.last_day == INT_MIN) continue;
+    if (!grow_array((void**)rows, capacity, *count + 1, sizeof(CalendarRow))) {
+      csv_close(&r);
+      return 0;
+    }
+    row.service_id = strdup(csv_field(&r, c_service));
+    (*rows)[(*count)++] = row;
+  }
+  csv_close(&r);
+  return 1;
+}
+
+/**
+ * intern_service()
+ *
+ * Returns:
+ *   Index of service_id in tt->service_ids, adding it if new; -1 on
+ *   allocation failure
+ */
+int intern_service(Timetable* tt, int* capacity, const char* serviceId) {
+  int idx = id_index_get(&tt->service_index, serviceId);
+  if (idx >= 0) return idx;
+  if (!grow_array((void**)&tt->service_ids, capacity, tt->num_services + 1,
+                  sizeof(char*)))
+    return -1;
+  idx = tt->num_services++;
+  tt->service_ids[idx] = strdup(serviceId);
+  id_index_put(&tt->service_index, tt->service_ids[idx], idx);
+  return idx;
+}
+
+/**
+ * load_calendar()
+ *
+ * Resolves every trip's service_id and, when calendar.csv and/or
+ * calendar_dates.csv exist, compiles each service into a bitmask of active
+ * days. It then pre-materializes one bitset of active trips per calendar
+ * day, so a query on a given date filters trips with a single bit test and
+ * no per-query work. Without calendar files every trip runs every day.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int load_calendar(Timetable* tt) {
+  CalendarRow* rows = NULL;
+  int numRows = 0, rowCap = 0;
+  int ok = read_calendar_rows("./csv_files/calendar.csv", 0, &rows, &numRows,
+                              &rowCap) &&
+           read_calendar_rows("./csv_files/calendar_dates.csv", 1, &rows,
+                              &numRows, &rowCap);
+
+  int serviceCap = 0;
+  int* rowService = malloc((size_t)(numRows > 0 ? numRows : 1) * sizeof(int));
+  ok = ok && rowService &&
+       id_index_init(&tt->service_index, tt->num_trips + numRows);
+  for (int t = 0; ok && t < tt->num_trips; ++t) {
+    tt->trips[t].service = intern_service(tt, &serviceCap,
+                                          tt->trips[t].service_id);
+    ok = tt->trips[t].service >= 0;
+  }
+  for (int i = 0; ok && i < numRows; ++i) {
+    rowService[i] = intern_service(tt, &serviceCap, rows[i].service_id);
+    ok = rowService[i] >= 0;
+  }
+
+  tt->trip_mask_words = (tt->num_trips + 31) / 32;
+  size_t maskWords = (size_t)(tt->trip_mask_words > 0 ? tt->trip_mask_words
+                                                      : 1);
+  tt->all_trips = ok ? calloc(maskWords, sizeof(uint32_t)) : NULL;
+  ok = ok && tt->all_trips;
+  for (int t = 0; ok && t < tt->num_trips; ++t)
+    tt->all_trips[t >> 5] |= 1u << (t & 31);
+
+  tt->has_calendar = ok && numRows > 0;
+  if (tt->has_calendar) {
+    int first = INT_MAX, last = INT_MIN;
+    for (int i = 0; i < numRows; ++i) {
+      if (rows[i].first_day < first) first = rows[i].first_day;
+      if (rows[i].last_day > last) last = rows[i].last_day;
+    }
+    int numDays = last - first + 1;
+    int words = (numDays + 63) / 64;
+    tt->calendar_first_day = first;
+    tt->calendar_num_days = numDays;
+    tt->service_days =
+        calloc((size_t)tt->num_services * words, sizeof(uint64_t));
+    // One extra, empty row is returned for dates outside the calendar
+    tt->day_trips = calloc((size_t)(numDays + 1) * maskWords, sizeof(uint32_t));
+    ok = tt->service_days && tt->day_trips;
+
+    // Weekly patterns first, then the dated exceptions on top
+    for (int pass = 0; ok && pass < 2; ++pass) {
+      for (int i = 0; i < numRows; ++i) {
+        const CalendarRow* row = &rows[i];
+        if ((row->weekdays < 0) != (pass == 1)) continue;
+        uint64_t* bits = tt->service_days + (size_t)rowService[i] * words;
+        for (int day = row->first_day; day <= row->last_day; ++day) {
+          int d = day - first;
+          uint64_t bit = (uint64_t)1 << (d & 63);
+          if (pass == 0 && (row->weekdays >> day_of_week(day) & 1))
+            bits[d >> 6] |= bit;
+          else if (pass == 1 && row->exception == 1)
+            bits[d >> 6] |= bit;
+          else if (pass == 1 && row->exception == 2)
+            bits[d >> 6] &= ~bit;
+        }
+      }
+    }
+    for (int d = 0; ok && d < numDays; ++d) {
+      uint32_t* mask = tt->day_trips + (size_t)d * maskWords;
+      for (int t = 0; t < tt->num_trips; ++t) {
+        const uint64_t* bits =
+            tt->service_days + (size_t)tt->trips[t].service * words;
+        if (bits[d >> 6] >> (d & 63) & 1) mask[t >> 5] |= 1u << (t & 31);
+      }
+    }
+  }
+
+  for (int i = 0; i < numRows; ++i) free(rows[i].service_id);
+  free(rows);
+  free(rowService);
+  return ok;
+}
+
+/**
+ * timetable_active_trips()
+ *
+ * Returns the bitset of trips running on a service day (bit t of word
+ * t / 32 set when trip t runs; test with TRIP_ACTIVE()).
+ *
+ * Parameters:
+ *   tt  - Loaded timetable
+ *   day - Day number (see parse_gtfs_date()), or INT_MIN for all trips
+ *
+ * Returns:
+ *   The pre-materialized bitset for that day; every trip if day is INT_MIN
+ *   or the feed has no calendar; no trip for days outside the calendar
+ */
+const uint32_t* timetable_active_trips(const Timetable* tt, int day) {
+  if (day == INT_MIN || !tt->has_calendar) return tt->all_trips;
+  int d = day - tt->calendar_first_day;
+  if (d < 0 || d >= tt->calendar_num_days) d = tt->calendar_num_days;
+  return tt->day_trips + (size_t)d * tt->trip_mask_words;
+}
+
+/**
+ * timetable_service_day()
+ *
+ * Fills in the trip bitsets seen by queries on `day` (see ServiceDay).
+ *
+ * Parameters:
+ *   tt  - Loaded timetable
+ *   day - Day number (see parse_gtfs_date()), or INT_MIN for all trips
+ *   out - Output
+ */
+void timetable_service_day(const Timetable* tt, int day, ServiceDay* out) {
+  out->active = timetable_active_trips(tt, day);
+  out->overnight = timetable_active_trips(tt, day == INT_MIN ? day : day - 1);
+  out->filtered = NULL;
+}
+
+/**
+ * build_attribute_trips()
+ *
+ * Builds one trip bitset per trip attribute (Timetable.attribute_trips).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_attribute_trips(Timetable* tt) {
+  size_t words = (size_t)(tt->trip_mask_words > 0 ? tt->trip_mask_words : 1);
+  tt->attribute_trips = calloc(NUM_TRIP_ATTRIBUTES * words, sizeof(uint32_t));
+  if (!tt->attribute_trips) return 0;
+  for (int a = 0; a < NUM_TRIP_ATTRIBUTES; ++a) {
+    uint32_t* row = tt->attribute_trips + a * words;
+    for (int t = 0; t < tt->num_trips; ++t)
+      if (tt->trips[t].attributes & (1u << a)) row[t >> 5] |= 1u << (t & 31);
+  }
+  return 1;
+}
+
+/**
+ * service_day_require()
+ *
+ * Narrows a ServiceDay to trips offering every attribute in `require`.
+ * The attribute bitsets are AND-ed into copies of its trip bitsets, so the
+ * routing loops still test one bit per trip and unfiltered queries pay
+ * nothing. Release the copies with service_day_free().
+ *
+ * Parameters:
+ *   tt      - Loaded timetable
+ *   require - TRIP_* bits; with 0 `day` is left unchanged
+ *   day     - ServiceDay to narrow (from timetable_service_day())
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int service_day_require(const Timetable* tt, unsigned require,
+                        ServiceDay* day) {
+  if (require == 0) return 1;
+  size_t words = (size_t)(tt->trip_mask_words > 0 ? tt->trip_mask_words : 1);
+  uint32_t* buf = malloc(2 * words * sizeof(uint32_t));
+  if (!buf) return 0;
+  for (size_t w = 0; w < words; ++w) {
+    uint32_t mask = ~0u;
+    for (int a = 0; a < NUM_TRIP_ATTRIBUTES; ++a)
+      if (require & (1u << a)) mask &= tt->attribute_trips[a * words + w];
+    buf[w] = day->active[w] & mask;
+    buf[words + w] = day->overnight[w] & mask;
+  }
+  free(day->filtered);
+  day->filtered = buf;
+  day->active = buf;
+  day->overnight = buf + words;
+  return 1;
+}
+
+void service_day_free(ServiceDay* day) {
+  free(day->filtered);
+  day->filtered = NULL;
+}
+
+/**
+ * timetable_query_day()
+ *
+ * The ServiceDay for the date and trip attributes selected in `opts`.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int timetable_query_day(const Timetable* tt, const TimetableOptions* opts,
+                        ServiceDay* out) {
+  timetable_service_day(tt, opts->service_day, out);
+  return service_day_require(tt, opts->require, out);
+}
+
+/** qsort comparator: connections by departure, then arrival time. */
+int compare_connections(const void* a, const void* b) {
+  const Connection* x = a;
+  const Connection* y = b;
+  if (x->dep_time != y->dep_time) return x->dep_time < y->dep_time ? -1 : 1;
+  return (x->arr_time > y->arr_time) - (x->arr_time < y->arr_time);
+}
+
+/**
+ * sort_connections_stable()
+ *
+ * Bottom-up merge sort of a connection array. Unlike qsort() it keeps the
+ * input order of equal elements, which matters for zero-duration hops of
+ * one trip that share a timestamp: they must stay in stop_sequence order.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int sort_connections_stable(Connection* conns, int n,
+                            int (*cmp)(const void*, const void*)) {
+  Connection* tmp = malloc((size_t)(n > 0 ? n : 1) * sizeof(Connection));
+  if (!tmp) return 0;
+  Connection* src = conns;
+  Connection* dst = tmp;
+  for (int width = 1; width < n; width *= 2) {
+    for (int lo = 0; lo < n; lo += 2 * width) {
+      int mid = lo + width < n ? lo + width : n;
+      int hi = lo + 2 * width < n ? lo + 2 * width : n;
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi)
+        dst[k++] = cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+      while (i < mid) dst[k++] = src[i++];
+      while (j < hi) dst[k++] = src[j++];
+    }
+    Connection* t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != conns) memcpy(conns, src, (size_t)n * sizeof(Connection));
+  free(tmp);
+  return 1;
+}
+
+/** Sort key ordering the trips of a block by departure. */
+typedef struct {
+  const char* block_id;  ///< Block of the trip
+  int dep;               ///< First departure
+  int trip;              ///< Index of the trip
+} BlockKey;
+
+int compare_block_keys(const void* a, const void* b) {
+  const BlockKey* x = a;
+  const BlockKey* y = b;
+  int c = strcmp(x->block_id, y->block_id);
+  if (c != 0) return c;
+  if (x->dep != y->dep) return x->dep < y->dep ? -1 : 1;
+  return (x->trip > y->trip) - (x->trip < y->trip);
+}
+
+/**
+ * link_blocks()
+ *
+ * Links each trip to the next trip of its block (Trip.block_prev and
+ * block_next). Two consecutive trips are only linked when the vehicle
+ * stays put in between: the next trip starts at the stop where the
+ * previous one ends, no earlier than it arrives, on the same service.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int link_blocks(Timetable* tt) {
+  BlockKey* keys =
+      malloc((size_t)(tt->num_trips > 0 ? tt->num_trips : 1) *
+             sizeof(BlockKey));
+  if (!keys) return 0;
+  int n = 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    if (trip->block_id[0] == '\0' || trip->num_stop_times < 2 ||
+        trip->frequency >= 0)
+      continue;
+    keys[n].block_id = trip->block_id;
+    keys[n].dep = tt->stop_times[trip->first_stop_time].departure_time;
+    keys[n].trip = t;
+    n++;
+  }
+  qsort(keys, (size_t)n, sizeof(BlockKey), compare_block_keys);
+  for (int k = 0; k + 1 < n; ++k) {
+    if (strcmp(keys[k].block_id, keys[k + 1].block_id) != 0) continue;
+    Trip* a = &tt->trips[keys[k].trip];
+    Trip* b = &tt->trips[keys[k + 1].trip];
+    const StopTime* last = &tt->stop_times[a->first_stop_time +
+                                           a->num_stop_times - 1];
+    const StopTime* first = &tt->stop_times[b->first_stop_time];
+    if (last->stop != first->stop ||
+        first->departure_time < last->arrival_time || a->service != b->service)
+      continue;
+    a->block_next = keys[k + 1].trip;
+    b->block_prev = keys[k].trip;
+  }
+  free(keys);
+  return 1;
+}
+
+/**
+ * build_connections()
+ *
+ * Creates one connection per consecutive stop pair of every scheduled trip
+ * and sorts them (stably) by departure time. Frequency-based trips are
+ * left out; forward scans generate theirs (see FreqStream).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_connections(Timetable* tt) {
+  int n = 0;
+  for (int t = 0; t < tt->num_trips; ++t)
+    if (tt->trips[t].num_stop_times > 1 && tt->trips[t].frequency < 0)
+      n += tt->trips[t].num_stop_times - 1;
+  tt->connections = malloc((size_t)(n > 0 ? n : 1) * sizeof(Connection));
+  if (!tt->connections) return 0;
+
+  int k = 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    if (trip->frequency >= 0) continue;
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+      Connection* c = &tt->connections[k++];
+      c->dep_stop = st[i].stop;
+      c->arr_stop = st[i + 1].stop;
+      c->dep_time = st[i].departure_time;
+      c->arr_time = st[i + 1].arrival_time;
+      c->trip = t;
+    }
+  }
+  tt->num_connections = n;
+  return sort_connections_stable(tt->connections, n, compare_connections);
+}
+
+/** qsort comparator: connections by arrival, then departure time. */
+int compare_connections_by_arrival(const void* a, const void* b) {
+  const Connection* x = a;
+  const Connection* y = b;
+  if (x->arr_time != y->arr_time) return x->arr_time < y->arr_time ? -1 : 1;
+  return (x->dep_time > y->dep_time) - (x->dep_time < y->dep_time);
+}
+
+/**
+ * build_arrival_index()
+ *
+ * Copies the connection array and sorts the copy (stably) by arrival time
+ * for backward scans. A full copy rather than a permutation keeps the
+ * reverse scan as cache-friendly as the forward one.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_arrival_index(Timetable* tt) {
+  size_t n = (size_t)tt->num_connections;
+  tt->connections_by_arrival = malloc((n > 0 ? n : 1) * sizeof(Connection));
+  if (!tt->connections_by_arrival) return 0;
+  memcpy(tt->connections_by_arrival, tt->connections, n * sizeof(Connection));
+  return sort_connections_stable(tt->connections_by_arrival,
+                                 tt->num_connections,
+                                 compare_connections_by_arrival);
+}
+
+/** qsort comparator: departures by time, then trip. */
+int compare_departures(const void* a, const void* b) {
+  const Departure* x = a;
+  const Departure* y = b;
+  if (x->time != y->time) return x->time < y->time ? -1 : 1;
+  return (x->trip > y->trip) - (x->trip < y->trip);
+}
+
+/**
+ * build_departure_boards()
+ *
+ * Builds a CSR array of departures per stop, each stop's slice sorted by
+ * time. A trip's last stop is not a departure and is left out, and so are
+ * frequency-based trips (next_departures() generates those).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_departure_boards(Timetable* tt) {
+  int* offsets = calloc((size_t)tt->num_stops + 1, sizeof(int));
+  if (!offsets) return 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    if (trip->frequency >= 0) continue;
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i)
+      offsets[tt->stop_times[trip->first_stop_time + i].stop + 1]++;
+  }
+  for (int i = 0; i < tt->num_stops; ++i) offsets[i + 1] += offsets[i];
+
+  int total = offsets[tt->num_stops];
+  Departure* deps = malloc((size_t)(total > 0 ? total : 1) * sizeof(Departure));
+  int* fill = malloc((size_t)(tt->num_stops > 0 ? tt->num_stops : 1) *
+                     sizeof(int));
+  if (!deps || !fill) {
+    free(offsets);
+    free(deps);
+    free(fill);
+    return 0;
+  }
+  memcpy(fill, offsets, (size_t)tt->num_stops * sizeof(int));
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    if (trip->frequency >= 0) continue;
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+      const StopTime* st = &tt->stop_times[trip->first_stop_time + i];
+      Departure* d = &deps[fill[st->stop]++];
+      d->time = st->departure_time;
+      d->trip = t;
+    }
+  }
+  free(fill);
+  for (int i = 0; i < tt->num_stops; ++i)
+    qsort(deps + offsets[i], offsets[i + 1] - offsets[i], sizeof(Departure),
+          compare_departures);
+
+  tt->departure_offsets = offsets;
+  tt->departures = deps;
+  return 1;
+}
+
+/**
+ * build_frequency_calls()
+ *
+ * Builds a CSR array of the frequency rows' departures per stop, so a
+ * departure board only generates the rows that call at its stop.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_frequency_calls(Timetable* tt) {
+  int* offsets = calloc((size_t)tt->num_stops + 1, sizeof(int));
+  if (!offsets) return 0;
+  for (int f = 0; f < tt->num_frequencies; ++f) {
+    const Trip* trip = &tt->trips[tt->frequencies[f].trip];
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i)
+      offsets[tt->stop_times[trip->first_stop_time + i].stop + 1]++;
+  }
+  for (int i = 0; i < tt->num_stops; ++i) offsets[i + 1] += offsets[i];
+
+  int total = offsets[tt->num_stops];
+  FrequencyCall* calls =
+      malloc((size_t)(total > 0 ? total : 1) * sizeof(FrequencyCall));
+  int* fill = malloc((size_t)(tt->num_stops > 0 ? tt->num_stops : 1) *
+                     sizeof(int));
+  if (!calls || !fill) {
+    free(offsets);
+    free(calls);
+    free(fill);
+    return 0;
+  }
+  memcpy(fill, offsets, (size_t)tt->num_stops * sizeof(int));
+  for (int f = 0; f < tt->num_frequencies; ++f) {
+    const Trip* trip = &tt->trips[tt->frequencies[f].trip];
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+      FrequencyCall* c = &calls[fill[st[i].stop]++];
+      c->frequency = f;
+      c->offset = st[i].departure_time - st[0].departure_time;
+    }
+  }
+  free(fill);
+
+  tt->frequency_call_offsets = offsets;
+  tt->frequency_calls = calls;
+  return 1;
+}
+
+/** Stop indices sorted by latitude, for the footpath sweep. */
+typedef struct {
+  double lat;
+  int stop;
+} LatKey;
+
+int compare_lat_keys(const void* a, const void* b) {
+  const LatKey* x = a;
+  const LatKey* y = b;
+  return (x->lat > y->lat) - (x->lat < y->lat);
+}
+
+/**
+ * build_footpaths()
+ *
+ * Creates walking transfers between all pairs of distinct stops within
+ * radius_m of each other (the feed has no transfers.txt). Candidate pairs
+ * come from a sweep over stops sorted by latitude, so only stops inside
+ * the radius band are compared, each band in one call of the batch
+ * distance kernel (the equirectangular one for radii up to
+ * GEO_FAST_MAX_M). Footpaths are symmetric and stored in a CSR array so
+ * routing scans them without pointer chasing.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int build_footpaths(Timetable* tt, double radius_m, double speed_mps) {
+  int n = tt->num_stops;
+  int* offsets = calloc((size_t)n + 1, sizeof(int));
+  LatKey* keys = malloc((size_t)(n > 0 ? n : 1) * sizeof(LatKey));
+  double* dist = malloc((size_t)(n > 0 ? n : 1) * sizeof(double));
+  GeoPoints pts;
+  int ok = geo_points_init(&pts, n);
+  if (!offsets || !keys || !dist || !ok) {
+    free(offsets);
+    free(keys);
+    free(dist);
+    geo_points_free(&pts);
+    return 0;
+  }
+  for (int i = 0; i < n; ++i) {
+    keys[i].lat = tt->stops[i].stop_lat;
+    keys[i].stop = i;
+  }
+  qsort(keys, n, sizeof(LatKey), compare_lat_keys);
+  for (int i = 0; i < n; ++i) {
+    const Stop* s = &tt->stops[keys[i].stop];
+    geo_points_set(&pts, i, s->stop_lat, s->stop_lon);
+  }
+  double band = radius_m / EARTH_RADIUS_M / DEG_TO_RAD;
+
+  // Two passes over the same sweep: count per stop, then fill
+  Footpath* paths = NULL;
+  int* fill = NULL;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int a = 0; a < n; ++a) {
+      const Stop* sa = &tt->stops[keys[a].stop];
+      int end = a + 1;
+      while (end < n && keys[end].lat - keys[a].lat <= band) end++;
+      // One batch per stop: every stop of the latitude band above it
+      if (radius_m <= GEO_FAST_MAX_M)
+        geo_distances_fast_m(sa->stop_lat, sa->stop_lon, &pts, a + 1, end,
+                             dist);
+      else
+        geo_distances_m(sa->stop_lat, sa->stop_lon, &pts, a + 1, end, dist);
+      for (int b = a + 1; b < end; ++b) {
+        double d = dist[b - a - 1];
+        if (d > radius_m) continue;
+        if (pass == 0) {
+          offsets[keys[a].stop + 1]++;
+          offsets[keys[b].stop + 1]++;
+        } else {
+          int walk = (int)ceil(d / speed_mps);
+          Footpath* f = &paths[fill[keys[a].stop]++];
+          f->to_stop = keys[b].stop;
+          f->walk_time = walk;
+          f = &paths[fill[keys[b].stop]++];
+          f->to_stop = keys[a].stop;
+          f->walk_time = walk;
+        }
+      }
+    }
+    if (pass == 0) {
+      for (int i = 0; i < n; ++i) offsets[i + 1] += offsets[i];
+      paths = malloc((size_t)(offsets[n] > 0 ? offsets[n] : 1) *
+                     sizeof(Footpath));
+      fill = malloc((size_t)(n > 0 ? n : 1) * sizeof(int));
+      if (!paths || !fill) {
+        free(offsets);
+        free(keys);
+        free(dist);
+        free(paths);
+        free(fill);
+        geo_points_free(&pts);
+        return 0;
+      }
+      memcpy(fill, offsets, (size_t)n * sizeof(int));
+    }
+  }
+  free(keys);
+  free(dist);
+  free(fill);
+  geo_points_free(&pts);
+  tt->footpath_offsets = offsets;
+  tt->footpaths = paths;
+  return 1;
+}
+
+/**
+ * timetable_default_options()
+ *
+ * Fills opts with the defaults used when no command-line options are given.
+ */
+void timetable_default_options(TimetableOptions* opts) {
+  opts->walk_radius_m = DEFAULT_WALK_RADIUS_M;
+  opts->walk_speed_mps = DEFAULT_WALK_SPEED_MPS;
+  opts->service_day = INT_MIN;
+  opts->require = 0;
+  opts->time_limit_ms = 0.0;
+}
+
+/**
+ * query_time_limit()
+ *
+ * Returns:
+ *   The now_seconds() value at which a query started now must stop (the
+ *   time_limit of the scratch structures), or 0 when opts sets no limit
+ */
+double query_time_limit(const TimetableOptions* opts) {
+  if (opts->time_limit_ms <= 0) return 0.0;
+  return now_seconds() + opts->time_limit_ms / 1000.0;
+}
+
+/**
+ * load_timetable()
+ *
+ * Loads stops, routes, the optional shapes, trips, stop times, the
+ * optional headway templates and service calendar from ./csv_files,
+ * places every stop time on its trip's shape, links the trips of each
+ * vehicle block and builds the departure- and arrival-sorted connection
+ * arrays used by the routing engines, plus the per-stop departure boards
+ * and walking footpaths.
+ *
+ * Parameters:
+ *   tt   - Timetable to fill
+ *   opts - Preprocessing settings (see timetable_default_options())
+ *
+ * Returns:
+ *   1 on success, 0 on failure (an error has been printed)
+ */
+int load_timetable(Timetable* tt, const TimetableOptions* opts) {
+  memset(tt, 0, sizeof(*tt));
+  if (!load_stops(tt, "./csv_files/stops.csv")) return 0;
+  if (!load_routes(tt, "./csv_files/routes.csv")) return 0;
+  if (!load_shapes(tt)) return 0;
+  if (!load_trips(tt, "./csv_files/trips.csv")) return 0;
+  if (!load_stop_times(tt, "./csv_files/stop_times.csv")) return 0;
+  if (!build_shape_anchors(tt)) return 0;
+  if (!load_frequencies(tt)) return 0;
+  if (!load_calendar(tt)) return 0;
+  if (!build_attribute_trips(tt)) return 0;
+  if (!link_blocks(tt)) return 0;
+  if (!build_connections(tt)) return 0;
+  if (!build_arrival_index(tt)) return 0;
+  if (!build_departure_boards(tt)) return 0;
+  if (!build_frequency_calls(tt)) return 0;
+  if (!build_footpaths(tt, opts->walk_radius_m, opts->walk_speed_mps))
+    return 0;
+
+  size_t numFootpaths = (size_t)tt->footpath_offsets[tt->num_stops];
+  unsigned h = 2166136261u;
+  h = hash_bytes(tt->stop_times, tt->num_stop_times * sizeof(StopTime), h);
+  h = hash_bytes(tt->footpaths, numFootpaths * sizeof(Footpath), h);
+  h = hash_bytes(tt->footpath_offsets, (tt->num_stops + 1) * sizeof(int), h);
+  for (int t = 0; t < tt->num_trips; ++t) {
+    h = hash_bytes(&tt->trips[t].service, sizeof(int), h);
+    h = hash_bytes(&tt->trips[t].block_next, sizeof(int), h);
+    h = hash_bytes(&tt->trips[t].attributes, sizeof(unsigned), h);
+  }
+  h = hash_bytes(tt->frequencies, tt->num_frequencies * sizeof(Frequency), h);
+  if (tt->has_calendar) {
+    size_t words = (size_t)(tt->calendar_num_days + 63) / 64;
+    h = hash_bytes(tt->service_days,
+                   (size_t)tt->num_services * words * sizeof(uint64_t), h);
+  }
+  tt->feed_hash = h;
+
+  h = 2166136261u;
+  h = hash_bytes(tt->shape_lat, tt->num_shape_points * sizeof(double), h);
+  h = hash_bytes(tt->shape_lon, tt->num_shape_points * sizeof(double), h);
+  for (int i = 0; i < tt->num_shapes; ++i)
+    h = hash_bytes(&tt->shapes[i].num_points, sizeof(int), h);
+  tt->shape_hash = h;
+  return 1;
+}
+
+// ============================================================================
+// DATASET CACHE
+// ============================================================================
+
+/**
+ * CacheHeader structure
+ * Common header of the preprocessed-data files stored next to the CSVs.
+ * A file is only reused when magic, version and source hash all match.
+ */
+typedef struct {
+  char magic[4];       ///< File type tag
+  uint32_t version;    ///< Format version of that file type
+  uint32_t feed_hash;  ///< Timetable.feed_hash (or shape_hash) the data
+                       ///< was built from
+} CacheHeader;
+
+/**
+ * open_cache_file_hash()
+ *
+ * Opens a cache file in the dataset directory. For reading, the header is
+ * checked against `hash`, a fingerprint of the data the file derives
+ * from; stale or foreign files are rejected. For writing, the header is
+ * written.
+ *
+ * Parameters:
+ *   name    - File name (e.g., "trip_transfers.bin")
+ *   magic   - Four-character file type tag
+ *   version - Format version
+ *   hash    - Fingerprint of the source data
+ *   write   - 0 to open for reading, 1 to create for writing
+ *
+ * Returns:
+ *   Open FILE* positioned after the header, or NULL
+ */
+FILE* open_cache_file_hash(const char* name, const char* magic,
+                           uint32_t version, unsigned hash, int write) {
+  char path[1200];
+  if (!dataset_file_path(name, path, sizeof(path))) return NULL;
+  FILE* fp = fopen(path, write ? "wb" : "rb");
+  if (!fp) {
+    if (write) fprintf(stderr, "opening '%s': %s\n", path, strerror(errno));
+    return NULL;
+  }
+  CacheHeader h;
+  if (write) {
+    memcpy(h.magic, magic, 4);
+    h.version = version;
+    h.feed_hash = hash;
+    if (fwrite(&h, sizeof(h), 1, fp) == 1) return fp;
+  } else if (fread(&h, sizeof(h), 1, fp) == 1 &&
+             memcmp(h.magic, magic, 4) == 0 && h.version == version &&
+             h.feed_hash == hash) {
+    return fp;
+  }
+  fclose(fp);
+  return NULL;
+}
+
+/**
+ * open_cache_file()
+ *
+ * Opens a cache file of data derived from the schedule and footpaths
+ * (validated by tt->feed_hash; see open_cache_file_hash()).
+ *
+ * Returns:
+ *   Open FILE* positioned after the header, or NULL
+ */
+FILE* open_cache_file(const Timetable* tt, const char* name, const char* magic,
+                      uint32_t version, int write) {
+  return open_cache_file_hash(name, magic, version, tt->feed_hash, write);
+}
+
+/**
+ * free_timetable()
+ *
+ * Releases everything allocated by load_timetable().
+ */
+void free_timetable(Timetable* tt) {
+  for (int i = 0; i < tt->num_stops; ++i) {
+    free(tt->stops[i].stop_id);
+    free(tt->stops[i].stop_name);
+    free(tt->stops[i].stop_desc);
+  }
+  for (int i = 0; i < tt->num_trips; ++i) {
+    free(tt->trips[i].route_id);
+    free(tt->trips[i].service_id);
+    free(tt->trips[i].trip_id);
+    free(tt->trips[i].trip_headsign);
+    free(tt->trips[i].block_id);
+  }
+  for (int i = 0; i < tt->num_routes; ++i) {
+    free(tt->routes[i].route_id);
+    free(tt->routes[i].route_short_name);
+    free(tt->routes[i].route_long_name);
+  }
+  for (int i = 0; i < tt->num_shapes; ++i) free(tt->shapes[i].shape_id);
+  for (int i = 0; i < tt->num_services; ++i) free(tt->service_ids[i]);
+  free(tt->service_ids);
+  free(tt->service_days);
+  free(tt->day_trips);
+  free(tt->all_trips);
+  free(tt->attribute_trips);
+  free(tt->stops);
+  free(tt->routes);
+  free(tt->trips);
+  free(tt->stop_times);
+  free(tt->frequencies);
+  free(tt->shapes);
+  free(tt->shape_lat);
+  free(tt->shape_lon);
+  free(tt->shape_dist);
+  free(tt->shape_m);
+  free(tt->shape_anchors);
+  free(tt->connections);
+  free(tt->connections_by_arrival);
+  free(tt->departure_offsets);
+  free(tt->departures);
+  free(tt->frequency_call_offsets);
+  free(tt->frequency_calls);
+  free(tt->footpath_offsets);
+  free(tt->footpaths);
+  id_index_free(&tt->stop_index);
+  id_index_free(&tt->route_index);
+  id_index_free(&tt->service_index);
+  id_index_free(&tt->trip_index);
+  id_index_free(&tt->shape_index);
+  memset(tt, 0, sizeof(*tt));
+}
+
+// ============================================================================
+// SHAPE LEVELS OF DETAIL
+// ============================================================================
+
+/** Levels of detail kept per shape; level 0 is the full shape. */
+#define SHAPE_LOD_LEVELS 5
+/**
+ * Simplification tolerance of level 1, in metres; each further level
+ * quadruples it (1, 4, 16, 64 m).
+ */
+#define SHAPE_LOD_BASE_M 1.0
+/** Cache file holding the simplified shapes. */
+#define SHAPE_LOD_CACHE_FILE "shape_lods.bin"
+#define SHAPE_LOD_CACHE_VERSION 1
+
+/**
+ * ShapeLods structure
+ * Every shape simplified at SHAPE_LOD_LEVELS tolerances. A level stores
+ * the indices of the points it keeps into the timetable's flat shape
+ * arrays, so a simplified shape is read in place like the full one. The
+ * levels are nested: each keeps a subset of the points of the one before.
+ */
+typedef struct {
+  int num_shapes;                   ///< Number of shapes
+  int* offsets[SHAPE_LOD_LEVELS];   ///< Per level: start of each shape's
+                                    ///< points (num_shapes + 1 entries)
+  int* points[SHAPE_LOD_LEVELS];    ///< Per level: kept shape points,
+                                    ///< grouped by shape
+} ShapeLods;
+
+/** Simplification tolerance of a level, in metres (0 for level 0). */
+double shape_lod_tolerance_m(int level) {
+  return level > 0 ? SHAPE_LOD_BASE_M * (double)(1 << (2 * (level - 1)))
+                   : 0.0;
+}
+
+/**
+ * shape_lod_for_zoom()
+ *
+ * Picks the coarsest level whose tolerance stays under one pixel of a web
+ * map (256-pixel tiles) at the given zoom and latitude.
+ *
+ * Returns:
+ *   Level, 0 (full detail) when a pixel is smaller than every tolerance
+ */
+int shape_lod_for_zoom(double zoom, double lat) {
+  double metresPerPixel = 2.0 * 3.14159265358979323846 * EARTH_RADIUS_M *
+                          cos(lat * DEG_TO_RAD) / (256.0 * pow(2.0, zoom));
+  int level = 0;
+  while (level + 1 < SHAPE_LOD_LEVELS &&
+         shape_lod_tolerance_m(level + 1) <= metresPerPixel)
+    level++;
+  return level;
+}
+
+/**
+ * shape_importance()
+ *
+ * Douglas-Peucker run to the end on one polyline of n points: each point
+ * gets the largest tolerance at which the simplification still keeps it,
+ * so every level is read off with one comparison per point. Pieces are
+ * split at their farthest point from the chord (an explicit stack instead
+ * of recursion); a point's value is capped by its parent's so the levels
+ * nest exactly as repeated Douglas-Peucker runs would.
+ *
+ * Parameters:
+ *   x, y  - Point coordinates in metres (local flat projection)
+ *   n     - Number of points
+ *   stack - Scratch, 3 * n ints
+ *   out   - Output: importance of each point in metres (endpoints: HUGE_VAL)
+ */
+void shape_importance(const double* x, const double* y, int n, int* stack,
+                      double* out) {
+  for (int i = 0; i < n; ++i) out[i] = 0.0;
+  if (n == 0) return;
+  out[0] = out[n - 1] = HUGE_VAL;
+  int top = 0;
+  if (n > 2) {
+    stack[top++] = 0;
+    stack[top++] = n - 1;
+    stack[top++] = -1;  // parent: none
+  }
+  while (top > 0) {
+    int parent = stack[--top];
+    int b = stack[--top];
+    int a = stack[--top];
+    double dx = x[b] - x[a], dy = y[b] - y[a];
+    double len = dx * dx + dy * dy;
+    int far = a + 1;
+    double farD = -1.0;
+    for (int i = a + 1; i < b; ++i) {
+      // Distance to the chord as a segment: closed loops have a == b
+      double px = x[i] - x[a], py = y[i] - y[a];
+      double u = len > 0 ? (px * dx + py * dy) / len : 0.0;
+      if (u < 0) u = 0;
+      if (u > 1) u = 1;
+      px -= u * dx;
+      py -= u * dy;
+      double d = px * px + py * py;
+      if (d > farD) {
+        farD = d;
+        far = i;
+      }
+    }
+    double d = sqrt(farD);
+    out[far] = parent >= 0 && out[parent] < d ? out[parent] : d;
+    if (far - a > 1) {
+      stack[top++] = a;
+      stack[top++] = far;
+      stack[top++] = far;
+    }
+    if (b - far > 1) {
+      stack[top++] = far;
+      stack[top++] = b;
+      stack[top++] = far;
+    }
+  }
+}
+
+void shape_lods_free(ShapeLods* lods) {
+  for (int l = 0; l < SHAPE_LOD_LEVELS; ++l) {
+    free(lods->offsets[l]);
+    free(lods->points[l]);
+  }
+  memset(lods, 0, sizeof(*lods));
+}
+
+/**
+ * shape_lods_build()
+ *
+ * Simplifies every shape at every level (see shape_importance()).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int shape_lods_build(const Timetable* tt, ShapeLods* lods) {
+  int n = tt->num_shape_points > 0 ? tt->num_shape_points : 1;
+  double* x = malloc((size_t)n * sizeof(double));
+  double* y = malloc((size_t)n * sizeof(double));
+  double* importance = malloc((size_t)n * sizeof(double));
+  int* stack = malloc((size_t)n * 3 * sizeof(int));
+  int ok = x && y && importance && stack;
+  lods->num_shapes = tt->num_shapes;
+  for (int l = 0; ok && l < SHAPE_LOD_LEVELS; ++l) {
+    lods->offsets[l] = malloc((size_t)(tt->num_shapes + 1) * sizeof(int));
+    lods->points[l] = malloc((size_t)n * sizeof(int));
+    ok = lods->offsets[l] && lods->points[l];
+  }
+
+  int count[SHAPE_LOD_LEVELS] = {0};
+  for (int s = 0; ok && s < tt->num_shapes; ++s) {
+    const Shape* sh = &tt->shapes[s];
+    const double* lat = tt->shape_lat + sh->first_point;
+    const double* lon = tt->shape_lon + sh->first_point;
+    double kx = cos(lat[0] * DEG_TO_RAD) * DEG_TO_RAD * EARTH_RADIUS_M;
+    for (int i = 0; i < sh->num_points; ++i) {
+      x[i] = (lon[i] - lon[0]) * kx;
+      y[i] = (lat[i] - lat[0]) * DEG_TO_RAD * EARTH_RADIUS_M;
+    }
+    shape_importance(x, y, sh->num_points, stack, importance);
+    for (int l = 0; l < SHAPE_LOD_LEVELS; ++l) {
+      double tol = shape_lod_tolerance_m(l);
+      lods->offsets[l][s] = count[l];
+      for (int i = 0; i < sh->num_points; ++i)
+        if (l == 0 || importance[i] > tol)
+          lods->points[l][count[l]++] = sh->first_point + i;
+    }
+  }
+  for (int l = 0; ok && l < SHAPE_LOD_LEVELS; ++l)
+    lods->offsets[l][tt->num_shapes] = count[l];
+  free(x);
+  free(y);
+  free(importance);
+  free(stack);
+  return ok;
+}
+
+/**
+ * shape_lods_save()
+ *
+ * Persists the levels next to the dataset, validated by tt->shape_hash
+ * (see open_cache_file_hash()).
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int shape_lods_save(const Timetable* tt, const ShapeLods* lods) {
+  FILE* fp = open_cache_file_hash(SHAPE_LOD_CACHE_FILE, "GECS",
+                                  SHAPE_LOD_CACHE_VERSION, tt->shape_hash, 1);
+  if (!fp) return 0;
+  int32_t counts[2] = {SHAPE_LOD_LEVELS, lods->num_shapes};
+  int ok = fwrite(counts, sizeof(counts), 1, fp) == 1;
+  for (int l = 0; ok && l < SHAPE_LOD_LEVELS; ++l) {
+    size_t numOffsets = (size_t)lods->num_shapes + 1;
+    size_t numPoints = (size_t)lods->offsets[l][lods->num_shapes];
+    ok = fwrite(lods->offsets[l], sizeof(int), numOffsets, fp) ==
+             numOffsets &&
+         fwrite(lods->points[l], sizeof(int), numPoints, fp) == numPoints;
+  }
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * shape_lods_load()
+ *
+ * Loads the levels saved by shape_lods_save(), if they match the loaded
+ * shapes.
+ *
+ * Returns:
+ *   1 if loaded, 0 if missing, stale or unreadable
+ */
+int shape_lods_load(const Timetable* tt, ShapeLods* lods) {
+  FILE* fp = open_cache_file_hash(SHAPE_LOD_CACHE_FILE, "GECS",
+                                  SHAPE_LOD_CACHE_VERSION, tt->shape_hash, 0);
+  if (!fp) return 0;
+  int32_t counts[2];
+  int ok = fread(counts, sizeof(counts), 1, fp) == 1 &&
+           counts[0] == SHAPE_LOD_LEVELS && counts[1] == tt->num_shapes;
+  lods->num_shapes = tt->num_shapes;
+  for (int l = 0; ok && l < SHAPE_LOD_LEVELS; ++l) {
+    size_t numOffsets = (size_t)tt->num_shapes + 1;
+    lods->offsets[l] = malloc(numOffsets * sizeof(int));
+    ok = lods->offsets[l] &&
+         fread(lods->offsets[l], sizeof(int), numOffsets, fp) == numOffsets;
+    int numPoints = ok ? lods->offsets[l][tt->num_shapes] : 0;
+    ok = ok && numPoints >= 0 && numPoints <= tt->num_shape_points;
+    if (ok) {
+      lods->points[l] = malloc((size_t)(numPoints ? numPoints : 1) *
+                               sizeof(int));
+      ok = lods->points[l] &&
+           fread(lods->points[l], sizeof(int), (size_t)numPoints, fp) ==
+               (size_t)numPoints;
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+/**
+ * shape_lods_load_or_build()
+ *
+ * Loads the saved levels of detail, or simplifies the shapes and saves
+ * them when no valid cache exists.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int shape_lods_load_or_build(const Timetable* tt, ShapeLods* lods,
+                             int rebuild) {
+  memset(lods, 0, sizeof(*lods));
+  if (!rebuild && shape_lods_load(tt, lods)) return 1;
+  shape_lods_free(lods);
+  if (!shape_lods_build(tt, lods)) {
+    shape_lods_free(lods);
+    return 0;
+  }
+  if (!shape_lods_save(tt, lods))
+    fprintf(stderr, "could not save %s\n", SHAPE_LOD_CACHE_FILE);
+  return 1;
+}
+
+/**
+ * shape_lod_points()
+ *
+ * Returns:
+ *   The points one shape keeps at a level, as indices into the flat shape
+ *   arrays; *count is their number
+ */
+const int* shape_lod_points(const ShapeLods* lods, int shape, int level,
+                            int* count) {
+  const int* offsets = lods->offsets[level];
+  *count = offsets[shape + 1] - offsets[shape];
+  return lods->points[level] + offsets[shape];
+}
+
+// ============================================================================
+// GEOMETRY ENCODING
+// ============================================================================
+
+/** Geometry output formats of GeomEncoder. */
+#define GEOM_POLYLINE 0  ///< Google encoded polyline, 1e-5 degrees
+#define GEOM_VARINT 1    ///< Zigzag LEB128 varint deltas, 1e-6 degrees
+
+/**
+ * GeomEncoder structure
+ * Appends points to a ByteBuffer as deltas from the previous point in
+ * fixed-point degrees, either as an encoded polyline (printable, 5 bits per
+ * character) or as varints (7 bits per byte; each coordinate pair is the
+ * zigzag-encoded latitude delta then longitude delta, starting from 0,0).
+ * Points are read straight from the caller's arrays; nothing is allocated
+ * besides the buffer's own growth.
+ */
+typedef struct {
+  ByteBuffer* out;  ///< Buffer appended to
+  int format;       ///< GEOM_POLYLINE or GEOM_VARINT
+  double scale;     ///< Fixed-point units per degree
+  long lat;         ///< Previous point, in fixed-point units
+  long lon;         ///< (0, 0 before the first point)
+  int count;        ///< Points written
+} GeomEncoder;
+
+void geom_encoder_init(GeomEncoder* e, ByteBuffer* out, int format) {
+  e->out = out;
+  e->format = format;
+  e->scale = format == GEOM_VARINT ? 1e6 : 1e5;
+  e->lat = e->lon = 0;
+  e->count = 0;
+}
+
+/** Appends one zigzag-encoded delta (room must be reserved). */
+void geom_put_delta(GeomEncoder* e, long delta) {
+  ByteBuffer* b = e->out;
+  unsigned long v = delta < 0 ? ~((unsigned long)delta << 1)
+                              : (unsigned long)delta << 1;
+  if (e->format == GEOM_VARINT) {
+    while (v >= 0x80) {
+      b->data[b->len++] = (unsigned char)(0x80 | (v & 0x7f));
+      v >>= 7;
+    }
+    b->data[b->len++] = (unsigned char)v;
+  } else {
+    while (v >= 0x20) {
+      b->data[b->len++] = (unsigned char)((0x20 | (v & 0x1f)) + 63);
+      v >>= 5;
+    }
+    b->data[b->len++] = (unsigned char)(v + 63);
+  }
+}
+
+/**
+ * geom_point()
+ *
+ * Appends a point given in degrees. A point equal to the previous one at
+ * the format's precision is skipped.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int geom_point(GeomEncoder* e, double lat, double lon) {
+  long la = lround(lat * e->scale), lo = lround(lon * e->scale);
+  if (e->count > 0 && la == e->lat && lo == e->lon) return 1;
+  // Two deltas of at most 32 bits: 7 characters or 5 bytes each
+  if (!byte_buffer_reserve(e->out, 14)) return 0;
+  geom_put_delta(e, la - e->lat);
+  geom_put_delta(e, lo - e->lon);
+  e->lat = la;
+  e->lon = lo;
+  e->count++;
+  return 1;
+}
+
+/**
+ * geom_range()
+ *
+ * Appends shape points [first, end) of the flat shape arrays.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int geom_range(GeomEncoder* e, const Timetable* tt, int first, int end) {
+  for (int i = first; i < end; ++i)
+    if (!geom_point(e, tt->shape_lat[i], tt->shape_lon[i])) return 0;
+  return 1;
+}
+
+/**
+ * geom_indices()
+ *
+ * Appends the shape points listed in `points` (e.g. a level of detail, see
+ * shape_lod_points()).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int geom_indices(GeomEncoder* e, const Timetable* tt, const int* points,
+                 int n) {
+  for (int i = 0; i < n; ++i)
+    if (!geom_point(e, tt->shape_lat[points[i]], tt->shape_lon[points[i]]))
+      return 0;
+  return 1;
+}
+
+/**
+ * parse_geom_format()
+ *
+ * Returns:
+ *   GEOM_POLYLINE for "polyline", GEOM_VARINT for "varint", -1 otherwise
+ */
+int parse_geom_format(const char* s) {
+  if (strcmp(s, "polyline") == 0) return GEOM_POLYLINE;
+  if (strcmp(s, "varint") == 0) return GEOM_VARINT;
+  return -1;
+}
+
+/**
+ * run_shape_mode()
+ *
+ * Command line:
+ *   shape <trip_id|shape_id> [zoom|-] [text|polyline|varint]
+ *
+ * Prints the shape of a trip (or a shape by id) at the level of detail
+ * matching a web map zoom level ("-" or none: full detail): as "lat,lon"
+ * lines (text, the default), as one encoded polyline line, or as raw
+ * varint bytes (see GeomEncoder).
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_shape_mode(int argc, char** argv, const TimetableOptions* opts) {
+  if (argc < 1) {
+    fprintf(stderr,
+            "usage: shape <trip_id|shape_id> [zoom|-] "
+            "[text|polyline|varint]\n");
+    return 1;
+  }
+  int format = -1;  // text
+  if (argc > 2 && strcmp(argv[2], "text") != 0) {
+    format = parse_geom_format(argv[2]);
+    if (format < 0) {
+      fprintf(stderr, "invalid format '%s'\n", argv[2]);
+      return 1;
+    }
+  }
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  int trip = id_index_get(&tt.trip_index, argv[0]);
+  int shape = trip >= 0 ? tt.trips[trip].shape
+                        : id_index_get(&tt.shape_index, argv[0]);
+  if (shape < 0) {
+    printf("No shape found for '%s'.\n", argv[0]);
+    free_timetable(&tt);
+    return 1;
+  }
+  ShapeLods lods;
+  if (!shape_lods_load_or_build(&tt, &lods, 0)) {
+    free_timetable(&tt);
+    return 1;
+  }
+  const Shape* sh = &tt.shapes[shape];
+  int level = 0;
+  if (argc > 1 && strcmp(argv[1], "-") != 0)
+    level = shape_lod_for_zoom(atof(argv[1]), tt.shape_lat[sh->first_point]);
+  int count;
+  const int* points = shape_lod_points(&lods, shape, level, &count);
+  int ok = 1;
+  if (format < 0) {
+    printf("shape %s: %d of %d points (level %d, tolerance %g m)\n",
+           sh->shape_id, count, sh->num_points, level,
+           shape_lod_tolerance_m(level));
+    for (int i = 0; i < count; ++i)
+      printf("%.6f,%.6f\n", tt.shape_lat[points[i]],
+             tt.shape_lon[points[i]]);
+  } else {
+    ByteBuffer buf = {0};
+    GeomEncoder e;
+    geom_encoder_init(&e, &buf, format);
+    ok = geom_indices(&e, &tt, points, count);
+    // Raw bytes: keep the C runtime from turning 0x0A into 0x0D 0x0A
+    if (ok && format == GEOM_VARINT) {
+      fflush(stdout);
+      _setmode(_fileno(stdout), _O_BINARY);
+    }
+    if (ok) fwrite(buf.data, 1, buf.len, stdout);
+    if (ok && format == GEOM_POLYLINE) printf("\n");
+    byte_buffer_free(&buf);
+  }
+  shape_lods_free(&lods);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// CONNECTION SCAN ALGORITHM
+// ============================================================================
+
+/** Generated connections handed to the scan per frequency run. */
+#define FREQ_RUN_CAPACITY 256
+
+/**
+ * FreqVehicle structure
+ * One instance of a frequency-based trip under way in a FreqStream.
+ */
+typedef struct {
+  int frequency;   ///< Index into Timetable.frequencies
+  int instance;    ///< k: leaves the first stop at start_time + k * headway
+  int shift;       ///< 0 on the query day, SECONDS_PER_DAY on the previous
+  int reached;     ///< Nonzero once boarded
+  int board_conn;  ///< Connection id where it was boarded
+} FreqVehicle;
+
+/** Heap entry of a FreqStream: the next connection of one vehicle. */
+typedef struct {
+  int dep_time;  ///< Departure, relative to the query day
+  int arr_time;  ///< Arrival, relative to the query day
+  int vehicle;   ///< Index into FreqStream.vehicles
+  int pos;       ///< Position of the departure stop within the trip
+} FreqEvent;
+
+/**
+ * FreqStream structure
+ * The connections of frequency-based trips, generated in scan order while
+ * a forward scan runs. A heap holds one event per vehicle under way or
+ * next to start; popping an event emits its connection and pushes the
+ * vehicle's next one, and popping an instance's first connection starts
+ * the following instance. Memory is bounded by the instances running at
+ * once, never by the number of departures.
+ */
+typedef struct {
+  FreqVehicle* vehicles;  ///< Vehicle slots
+  int capacity;           ///< Number of vehicle slots
+  int* free_slots;        ///< Unused slots
+  int num_free;           ///< Entries in free_slots
+  int* retired;           ///< Slots finished in the current run; freed once
+                          ///< the scan is past it
+  int num_retired;        ///< Entries in retired
+  FreqEvent* heap;        ///< Min-heap by departure, then arrival
+  int heap_len;           ///< Entries in heap
+  Connection* buffer;     ///< Current run (trip = the template trip)
+  int* buffer_vehicle;    ///< Per buffered connection: its vehicle
+  int* buffer_id;         ///< Per buffered connection: its connection id
+  int buffer_len;         ///< Connections in the current run
+  int overflow;           ///< Set when a vehicle found no free slot; the
+                          ///< stream then lacks its connections
+} FreqStream;
+
+int freq_stream_init(FreqStream* fs, const Timetable* tt) {
+  memset(fs, 0, sizeof(*fs));
+  if (tt->num_frequencies == 0) return 1;
+  fs->capacity = tt->max_frequency_vehicles + FREQ_RUN_CAPACITY;
+  fs->vehicles = malloc((size_t)fs->capacity * sizeof(FreqVehicle));
+  fs->free_slots = malloc((size_t)fs->capacity * sizeof(int));
+  fs->retired = malloc((size_t)fs->capacity * sizeof(int));
+  fs->heap = malloc((size_t)fs->capacity * sizeof(FreqEvent));
+  fs->buffer = malloc(FREQ_RUN_CAPACITY * sizeof(Connection));
+  fs->buffer_vehicle = malloc(FREQ_RUN_CAPACITY * sizeof(int));
+  fs->buffer_id = malloc(FREQ_RUN_CAPACITY * sizeof(int));
+  return fs->vehicles && fs->free_slots && fs->retired && fs->heap &&
+         fs->buffer && fs->buffer_vehicle && fs->buffer_id;
+}
+
+void freq_stream_free(FreqStream* fs) {
+  free(fs->vehicles);
+  free(fs->free_slots);
+  free(fs->retired);
+  free(fs->heap);
+  free(fs->buffer);
+  free(fs->buffer_vehicle);
+  free(fs->buffer_id);
+  memset(fs, 0, sizeof(*fs));
+}
+
+/** Returns: 1 if event a is scanned before b (departure, then arrival). */
+int freq_event_before(const FreqEvent* a, const FreqEvent* b) {
+  return a->dep_time < b->dep_time ||
+         (a->dep_time == b->dep_time && a->arr_time < b->arr_time);
+}
+
+/**
+ * freq_push()
+ *
+ * Schedules the connection of vehicle v leaving stop position `pos`.
+ */
+void freq_push(const Timetable* tt, FreqStream* fs, int v, int pos) {
+  const FreqVehicle* veh = &fs->vehicles[v];
+  const Frequency* f = &tt->frequencies[veh->frequency];
+  const StopTime* st =
+      &tt->stop_times[tt->trips[f->trip].first_stop_time];
+  int base = f->start_time + veh->instance * f->headway - veh->shift -
+             st[0].departure_time;
+  FreqEvent e;
+  e.dep_time = base + st[pos].departure_time;
+  e.arr_time = base + st[pos + 1].arrival_time;
+  e.vehicle = v;
+  e.pos = pos;
+  int j = fs->heap_len++;
+  while (j > 0 && freq_event_before(&e, &fs->heap[(j - 1) / 2])) {
+    fs->heap[j] = fs->heap[(j - 1) / 2];
+    j = (j - 1) / 2;
+  }
+  fs->heap[j] = e;
+}
+
+/** Removes the first event of a non-empty heap. */
+void freq_pop(FreqStream* fs) {
+  FreqEvent last = fs->heap[--fs->heap_len];
+  int len = fs->heap_len, i = 0;
+  for (int child = 1; child < len; child = 2 * i + 1) {
+    if (child + 1 < len &&
+        freq_event_before(&fs->heap[child + 1], &fs->heap[child]))
+      child++;
+    if (!freq_event_before(&fs->heap[child], &last)) break;
+    fs->heap[i] = fs->heap[child];
+    i = child;
+  }
+  fs->heap[i] = last;
+}
+
+/**
+ * freq_start_vehicle()
+ *
+ * Puts instance k of frequency row f (of the day given by shift) under
+ * way from stop position `pos`.
+ */
+void freq_start_vehicle(const Timetable* tt, FreqStream* fs, int f, int k,
+                        int shift, int pos) {
+  // The capacity is Timetable.max_frequency_vehicles plus the slots
+  // retired in one run, so running out means that bound is wrong
+  if (fs->num_free == 0) {
+    if (!fs->overflow)
+      fprintf(stderr, "frequency vehicle pool exhausted (%d slots)\n",
+              fs->capacity);
+    fs->overflow = 1;
+    return;
+  }
+  int v = fs->free_slots[--fs->num_free];
+  fs->vehicles[v].frequency = f;
+  fs->vehicles[v].instance = k;
+  fs->vehicles[v].shift = shift;
+  fs->vehicles[v].reached = 0;
+  fs->vehicles[v].board_conn = -1;
+  freq_push(tt, fs, v, pos);
+}
+
+/**
+ * freq_stream_start()
+ *
+ * Resets the stream for a scan from `time`: every instance of a running
+ * template that still has a connection departing at or after the time is
+ * put under way from its next stop, and the first instance to start at
+ * or after it is scheduled.
+ *
+ * Returns:
+ *   1 if the stream has connections to hand out
+ */
+int freq_stream_start(FreqStream* fs, const Timetable* tt,
+                      const ServiceDay* day, int time) {
+  fs->num_free = fs->capacity;
+  for (int v = 0; v < fs->capacity; ++v)
+    fs->free_slots[v] = fs->capacity - 1 - v;
+  fs->num_retired = 0;
+  fs->heap_len = 0;
+  fs->buffer_len = 0;
+  fs->overflow = 0;
+  for (int i = 0; i < tt->num_frequencies; ++i) {
+    const Frequency* f = &tt->frequencies[i];
+    const Trip* trip = &tt->trips[f->trip];
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    int lastDep = st[trip->num_stop_times - 2].departure_time -
+                  st[0].departure_time;
+    for (int shift = 0; shift <= SECONDS_PER_DAY; shift += SECONDS_PER_DAY) {
+      if (!TRIP_ACTIVE(shift ? day->overnight : day->active, f->trip))
+        continue;
+      // Time since start_time on this instance's day
+      int t = time + shift - f->start_time;
+      int first = t <= 0 ? 0 : (t + f->headway - 1) / f->headway;
+      int k = t - lastDep <= 0 ? 0 : (t - lastDep + f->headway - 1) /
+                                         f->headway;
+      for (; k < first && k < f->num_instances; ++k) {
+        int pos = 0;
+        while (k * f->headway + st[pos].departure_time -
+                   st[0].departure_time < t)
+          pos++;
+        freq_start_vehicle(tt, fs, i, k, shift, pos);
+      }
+      if (first < f->num_instances)
+        freq_start_vehicle(tt, fs, i, first, shift, 0);
+    }
+  }
+  return fs->heap_len > 0;
+}
+
+/**
+ * freq_comes_first()
+ *
+ * Returns:
+ *   1 if the stream's next connection is scanned before connection c
+ *   (times shifted back by shift), or c is NULL
+ */
+int freq_comes_first(const FreqStream* fs, const Connection* c, int shift) {
+  if (!c) return 1;
+  const FreqEvent* e = &fs->heap[0];
+  int cd = c->dep_time - shift;
+  return e->dep_time < cd ||
+         (e->dep_time == cd && e->arr_time <= c->arr_time - shift);
+}
+
+/**
+ * freq_stream_fill()
+ *
+ * Generates the next run into fs->buffer: the stream's connections that
+ * are scanned before both scheduled streams' next connections (NULL once
+ * a stream is exhausted), up to FREQ_RUN_CAPACITY.
+ */
+void freq_stream_fill(const Timetable* tt, FreqStream* fs,
+                      const Connection* day, const Connection* night) {
+  // The scan is done with the previous run, so its vehicles can be reused
+  for (int i = 0; i < fs->num_retired; ++i)
+    fs->free_slots[fs->num_free++] = fs->retired[i];
+  fs->num_retired = 0;
+  fs->buffer_len = 0;
+  while (fs->buffer_len < FREQ_RUN_CAPACITY && fs->heap_len > 0 &&
+         freq_comes_first(fs, day, 0) &&
+         freq_comes_first(fs, night, SECONDS_PER_DAY)) {
+    FreqEvent e = fs->heap[0];
+    freq_pop(fs);
+    const FreqVehicle* veh = &fs->vehicles[e.vehicle];
+    const Frequency* f = &tt->frequencies[veh->frequency];
+    const Trip* trip = &tt->trips[f->trip];
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    int n = fs->buffer_len++;
+    Connection* c = &fs->buffer[n];
+    c->dep_stop = st[e.pos].stop;
+    c->arr_stop = st[e.pos + 1].stop;
+    c->dep_time = e.dep_time;
+    c->arr_time = e.arr_time;
+    c->trip = f->trip;
+    fs->buffer_vehicle[n] = e.vehicle;
+    fs->buffer_id[n] = 2 * tt->num_connections +
+                       (veh->shift ? tt->num_frequency_connections : 0) +
+                       f->first_id +
+                       veh->instance * (trip->num_stop_times - 1) + e.pos;
+    if (e.pos == 0 && veh->instance + 1 < f->num_instances)
+      freq_start_vehicle(tt, fs, veh->frequency, veh->instance + 1,
+                         veh->shift, 0);
+    if (e.pos + 2 < trip->num_stop_times)
+      freq_push(tt, fs, e.vehicle, e.pos + 1);
+    else
+      fs->retired[fs->num_retired++] = e.vehicle;
+  }
+}
+
+/**
+ * CsaScratch structure
+ * Per-query working memory for the connection scan. One instance per thread;
+ * it is reused across queries so routing does not allocate.
+ */
+typedef struct {
+  int* arrival;                ///< Earliest known arrival time per stop
+  int* departure;              ///< Latest viable departure per stop (reverse)
+  unsigned char* trip_reached; ///< Per trip instance (see CsaCursor):
+                               ///< nonzero once it has been boarded
+  int* trip_conn;              ///< Per trip instance: boarding (forward) or
+                               ///< alighting (reverse) connection id
+  int* enter_conn;             ///< Per stop: connection id where the
+                               ///< vehicle leg behind ride_label was boarded
+  int* exit_conn;              ///< Per stop: connection id where that leg
+                               ///< was left
+  int* walk_stop;              ///< Per stop: other end of the footpath that
+                               ///< set the label, -1 if set by a vehicle
+  int* ride_label;             ///< Per stop: best time reached by a vehicle
+                               ///< (footpaths are relaxed from these, since
+                               ///< footpaths are a single hop and not
+                               ///< transitively closed)
+  double time_limit;           ///< now_seconds() time at which a scan gives
+                               ///< up, 0 for none
+  int partial;                 ///< Set when the last scan hit the time
+                               ///< limit (or freq overflowed); its labels
+                               ///< are then upper bounds
+  FreqStream freq;             ///< Frequency-based connections of forward
+                               ///< scans
+} CsaScratch;
+
+int csa_scratch_init(CsaScratch* s, const Timetable* tt) {
+  s->arrival = malloc((size_t)tt->num_stops * sizeof(int));
+  s->departure = malloc((size_t)tt->num_stops * sizeof(int));
+  s->trip_reached = malloc((size_t)tt->num_trips * 2);
+  s->trip_conn = malloc((size_t)tt->num_trips * 2 * sizeof(int));
+  s->enter_conn = malloc((size_t)tt->num_stops * sizeof(int));
+  s->exit_conn = malloc((size_t)tt->num_stops * sizeof(int));
+  s->walk_stop = malloc((size_t)tt->num_stops * sizeof(int));
+  s->ride_label = malloc((size_t)tt->num_stops * sizeof(int));
+  s->time_limit = 0;
+  s->partial = 0;
+  int ok = freq_stream_init(&s->freq, tt);
+  return ok && s->arrival && s->departure && s->trip_reached &&
+         s->trip_conn && s->enter_conn && s->exit_conn && s->walk_stop &&
+         s->ride_label;
+}
+
+void csa_scratch_free(CsaScratch* s) {
+  free(s->arrival);
+  free(s->departure);
+  free(s->trip_reached);
+  free(s->trip_conn);
+  free(s->enter_conn);
+  free(s->exit_conn);
+  free(s->walk_stop);
+  free(s->ride_label);
+  freq_stream_free(&s->freq);
+  memset(s, 0, sizeof(*s));
+}
+
+/**
+ * csa_first_connection()
+ *
+ * Binary search for the first connection departing at or after `time`.
+ */
+int csa_first_connection(const Timetable* tt, int time) {
+  int lo = 0, hi = tt->num_connections;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tt->connections[mid].dep_time < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * csa_last_arrival()
+ *
+ * Binary search in the arrival-sorted connections for the first connection
+ * arriving strictly after `time`.
+ */
+int csa_last_arrival(const Timetable* tt, int time) {
+  int lo = 0, hi = tt->num_connections;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tt->connections_by_arrival[mid].arr_time <= time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * CsaCursor structure
+ * Walks the connections a query day sees, in scan order: the day's own
+ * connections merged with the previous day's connections departing past
+ * 24:00:00, shifted back one day. Both streams are read from the same
+ * sorted array, so the previous day needs no copy of the schedule.
+ *
+ * Connection ids: i < num_connections is conns[i] on the query day;
+ * num_connections + i is conns[i] on the previous day. Trip instances are
+ * numbered the same way over num_trips. Forward cursors can merge in a
+ * third stream, the generated connections of frequency-based trips
+ * (FreqStream); their ids follow at 2 * num_connections, the query day's
+ * num_frequency_connections first, then the previous day's.
+ */
+typedef struct {
+  const Timetable* tt;
+  const ServiceDay* day;
+  const Connection* conns;  ///< tt->connections, or connections_by_arrival
+                            ///< for a reverse cursor
+  int reverse;              ///< Nonzero for descending arrival order
+  int next;                 ///< Next index of the query day's stream
+  int next_night;           ///< Next index of the previous day's stream
+  int night_stop;           ///< Reverse: the previous day's stream ends
+                            ///< below this index
+  FreqStream* freq;         ///< Frequency-based connections, or NULL
+} CsaCursor;
+
+/**
+ * CsaRun structure
+ * A stretch of one stream that comes next in scan order: indices begin,
+ * begin + step, ... up to (excluding) end of `conns`.
+ */
+typedef struct {
+  int begin;               ///< First index
+  int end;                 ///< One past (forward) or before (reverse) the
+                           ///< last index
+  int step;                ///< 1 forward, -1 reverse
+  int shift;               ///< Seconds to subtract from the times
+  int instance_offset;     ///< Add to the trip for its trip instance
+  int id_offset;           ///< Add to the index for the connection id
+  const uint32_t* active;  ///< Trips of this stream that run
+  int frequencies;         ///< Nonzero for a run of generated connections:
+                           ///< the cursor's FreqStream buffer, scanned by
+                           ///< csa_scan_frequencies() instead
+} CsaRun;
+
+/**
+ * csa_cursor_init()
+ *
+ * Positions a cursor at the first connection departing at or after `time`
+ * (forward) or the last one arriving at or before `time` (reverse).
+ */
+void csa_cursor_init(CsaCursor* cur, const Timetable* tt,
+                     const ServiceDay* day, int reverse, int time) {
+  cur->tt = tt;
+  cur->day = day;
+  cur->reverse = reverse;
+  cur->freq = NULL;
+  if (reverse) {
+    cur->conns = tt->connections_by_arrival;
+    cur->next = csa_last_arrival(tt, time) - 1;
+    cur->next_night = csa_last_arrival(tt, time + SECONDS_PER_DAY) - 1;
+    cur->night_stop = csa_last_arrival(tt, SECONDS_PER_DAY - 1);
+  } else {
+    cur->conns = tt->connections;
+    cur->next = csa_first_connection(tt, time);
+    cur->next_night = csa_first_connection(tt, time + SECONDS_PER_DAY);
+    cur->night_stop = tt->num_connections;
+  }
+}
+
+/**
+ * csa_cursor_add_frequencies()
+ *
+ * Merges the frequency-based trips into a forward cursor positioned at
+ * `time`, generating their connections in fs. Does nothing when the feed
+ * has none.
+ */
+void csa_cursor_add_frequencies(CsaCursor* cur, FreqStream* fs, int time) {
+  if (cur->tt->num_frequencies > 0 &&
+      freq_stream_start(fs, cur->tt, cur->day, time))
+    cur->freq = fs;
+}
+
+/**
+ * csa_comes_first()
+ *
+ * Returns:
+ *   1 if connection a (times shifted back by shiftA) is scanned before b
+ *   (shifted by shiftB): by departure then arrival forward, by arrival
+ *   then departure in reverse
+ */
+int csa_comes_first(const Connection* a, int shiftA, const Connection* b,
+                    int shiftB, int reverse) {
+  int ad = a->dep_time - shiftA, aa = a->arr_time - shiftA;
+  int bd = b->dep_time - shiftB, ba = b->arr_time - shiftB;
+  if (reverse) return aa > ba || (aa == ba && ad >= bd);
+  return ad < bd || (ad == bd && aa <= ba);
+}
+
+/**
+ * csa_run_end()
+ *
+ * Binary search for the end of a run of one stream: the first index from
+ * `begin` towards `end` (in scan order) whose connection, times shifted
+ * back by `shift`, is no longer scanned before `other` (shifted by
+ * otherShift; NULL for none) or before the next connection of fs (NULL
+ * for none). Ties with `other` stay in the run if keepTies is set. Both
+ * streams are sorted in scan order, so the test flips only once.
+ */
+int csa_run_end(const CsaCursor* cur, int begin, int end, int shift,
+                const Connection* other, int otherShift, int keepTies,
+                const FreqStream* fs) {
+  int step = cur->reverse ? -1 : 1;
+  int lo = 1, hi = (end - begin) * step;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const Connection* c = &cur->conns[begin + mid * step];
+    int before = 1;
+    if (other)
+      before = keepTies ? csa_comes_first(c, shift, other, otherShift,
+                                          cur->reverse)
+                        : !csa_comes_first(other, otherShift, c, shift,
+                                           cur->reverse);
+    if (before && fs) before = !freq_comes_first(fs, c, shift);
+    if (before)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return begin + lo * step;
+}
+
+/**
+ * csa_cursor_next_run()
+ *
+ * Hands out the next run of one stream. Once the previous day's stream is
+ * exhausted (always, for queries after its last past-midnight departure)
+ * and the feed has no frequency-based trips, the run is the whole rest of
+ * the query day, so the scan loop stays a plain pass over the sorted
+ * array.
+ *
+ * Producing a run is bounded work: a binary search for its end
+ * (csa_run_end()) or at most FREQ_RUN_CAPACITY generated connections.
+ * Scans check their time limit before each run and every
+ * TIME_LIMIT_CHECK_INTERVAL connections within one, so the limit holds
+ * however the streams interleave.
+ *
+ * Returns:
+ *   1 if a run was produced, 0 at the end of both streams
+ */
+int csa_cursor_next_run(CsaCursor* cur, CsaRun* run) {
+  int n = cur->tt->num_connections;
+  int step = cur->reverse ? -1 : 1;
+  int dayEnd = cur->reverse ? -1 : n;
+  int nightEnd = cur->reverse ? cur->night_stop - 1 : n;
+  int dayLeft = cur->next != dayEnd;
+  int nightLeft = cur->next_night != nightEnd;
+  const Connection* conns = cur->conns;
+  FreqStream* fs = cur->freq && cur->freq->heap_len > 0 ? cur->freq : NULL;
+  if (fs && freq_comes_first(fs, dayLeft ? &conns[cur->next] : NULL, 0) &&
+      freq_comes_first(fs, nightLeft ? &conns[cur->next_night] : NULL,
+                       SECONDS_PER_DAY)) {
+    freq_stream_fill(cur->tt, fs, dayLeft ? &conns[cur->next] : NULL,
+                     nightLeft ? &conns[cur->next_night] : NULL);
+    run->begin = 0;
+    run->end = fs->buffer_len;
+    run->step = 1;
+    run->shift = 0;
+    run->instance_offset = 0;
+    run->id_offset = 0;
+    run->active = NULL;
+    run->frequencies = 1;
+    return 1;
+  }
+  if (!dayLeft && !nightLeft) return 0;
+
+  int night = !dayLeft || (nightLeft && !csa_comes_first(
+                                            &conns[cur->next], 0,
+                                            &conns[cur->next_night],
+                                            SECONDS_PER_DAY, cur->reverse));
+  run->step = step;
+  run->frequencies = 0;
+  if (night) {
+    run->begin = cur->next_night;
+    run->end = csa_run_end(cur, cur->next_night, nightEnd, SECONDS_PER_DAY,
+                           dayLeft ? &conns[cur->next] : NULL, 0, 0, fs);
+    cur->next_night = run->end;
+    run->shift = SECONDS_PER_DAY;
+    run->instance_offset = cur->tt->num_trips;
+    run->id_offset = n;
+    run->active = cur->day->overnight;
+  } else {
+    run->begin = cur->next;
+    run->end = dayEnd;
+    if (nightLeft || fs)
+      run->end = csa_run_end(cur, cur->next, dayEnd, 0,
+                             nightLeft ? &conns[cur->next_night] : NULL,
+                             SECONDS_PER_DAY, 1, fs);
+    cur->next = run->end;
+    run->shift = 0;
+    run->instance_offset = 0;
+    run->id_offset = 0;
+    run->active = cur->day->active;
+  }
+  return 1;
+}
+
+/**
+ * frequency_connection()
+ *
+ * Rebuilds a generated connection from its id (see CsaCursor), with times
+ * relative to the query day.
+ */
+Connection frequency_connection(const Timetable* tt, int id) {
+  id -= 2 * tt->num_connections;
+  int shift = 0;
+  if (id >= tt->num_frequency_connections) {
+    id -= tt->num_frequency_connections;
+    shift = SECONDS_PER_DAY;
+  }
+  int lo = 0, hi = tt->num_frequencies - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (tt->frequencies[mid].first_id <= id)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  const Frequency* f = &tt->frequencies[lo];
+  const Trip* trip = &tt->trips[f->trip];
+  const StopTime* st = &tt->stop_times[trip->first_stop_time];
+  int k = (id - f->first_id) / (trip->num_stop_times - 1);
+  int pos = (id - f->first_id) % (trip->num_stop_times - 1);
+  int base = f->start_time + k * f->headway - shift - st[0].departure_time;
+  Connection c;
+  c.dep_stop = st[pos].stop;
+  c.arr_stop = st[pos + 1].stop;
+  c.dep_time = base + st[pos].departure_time;
+  c.arr_time = base + st[pos + 1].arrival_time;
+  c.trip = f->trip;
+  return c;
+}
+
+/**
+ * csa_view_connection()
+ *
+ * Resolves a connection id (see CsaCursor) over `conns` to the connection
+ * with times relative to the query day.
+ */
+Connection csa_view_connection(const Timetable* tt, const Connection* conns,
+                               int id) {
+  if (id < tt->num_connections) return conns[id];
+  if (id >= 2 * tt->num_connections) return frequency_connection(tt, id);
+  Connection c = conns[id - tt->num_connections];
+  c.dep_time -= SECONDS_PER_DAY;
+  c.arr_time -= SECONDS_PER_DAY;
+  return c;
+}
+
+/**
+ * relax_footpaths()
+ *
+ * After `stop` is reached at `time`, improves the arrival labels of stops
+ * within walking distance. Transfers are a single walking hop.
+ *
+ * Parameters:
+ *   arrival  - Per-stop earliest arrival labels
+ *   walkStop - Per-stop walking predecessor to update, or NULL
+ */
+void relax_footpaths(const Timetable* tt, int* arrival, int* walkStop,
+                     int stop, int time) {
+  const Footpath* f = tt->footpaths + tt->footpath_offsets[stop];
+  const Footpath* end = tt->footpaths + tt->footpath_offsets[stop + 1];
+  for (; f < end; ++f) {
+    int t = time + f->walk_time;
+    if (t < arrival[f->to_stop]) {
+      arrival[f->to_stop] = t;
+      if (walkStop) walkStop[f->to_stop] = stop;
+    }
+  }
+}
+
+/**
+ * relax_footpaths_reverse()
+ *
+ * Backward counterpart of relax_footpaths(): after the latest departure
+ * from `stop` becomes `time`, nearby stops may leave up to a walk earlier.
+ * Footpaths are symmetric, so the same CSR slice is used.
+ */
+void relax_footpaths_reverse(const Timetable* tt, int* departure,
+                             int* walkStop, int stop, int time) {
+  const Footpath* f = tt->footpaths + tt->footpath_offsets[stop];
+  const Footpath* end = tt->footpaths + tt->footpath_offsets[stop + 1];
+  for (; f < end; ++f) {
+    int t = time - f->walk_time;
+    if (t > departure[f->to_stop]) {
+      departure[f->to_stop] = t;
+      walkStop[f->to_stop] = stop;
+    }
+  }
+}
+
+/**
+ * footpath_time()
+ *
+ * Returns:
+ *   Walking time in seconds from one stop to another, or -1 if there is no
+ *   footpath between them
+ */
+int footpath_time(const Timetable* tt, int from, int to) {
+  for (int i = tt->footpath_offsets[from]; i < tt->footpath_offsets[from + 1];
+       ++i)
+    if (tt->footpaths[i].to_stop == to) return tt->footpaths[i].walk_time;
+  return -1;
+}
+
+/**
+ * csa_scan_frequencies()
+ *
+ * Scans the current run of generated connections (s->freq) like the loop
+ * of csa_earliest_arrival(), keeping the boarding state per vehicle
+ * instead of per trip instance.
+ *
+ * Parameters:
+ *   tt     - Loaded timetable
+ *   s      - Scratch of the running scan
+ *   target - Destination stop, or -1
+ *   bound  - Lower bounds as in csa_earliest_arrival(), or NULL
+ *
+ * Returns:
+ *   0 once a connection departs no earlier than the target's label (the
+ *   scan is over), 1 otherwise
+ */
+int csa_scan_frequencies(const Timetable* tt, CsaScratch* s, int target,
+                         const int* bound) {
+  const FreqStream* fs = &s->freq;
+  int noTarget = TIME_INFINITY;
+  int* arrival = s->arrival;
+  const int* best = target >= 0 ? &arrival[target] : &noTarget;
+  int* ride = s->ride_label;
+  for (int b = 0; b < fs->buffer_len; ++b) {
+    const Connection* c = &fs->buffer[b];
+    if (c->dep_time >= *best) return 0;
+    FreqVehicle* v = &fs->vehicles[fs->buffer_vehicle[b]];
+    if (!v->reached && arrival[c->dep_stop] > c->dep_time) continue;
+    if (!v->reached) {
+      v->reached = 1;
+      v->board_conn = fs->buffer_id[b];
+    }
+    if (bound && c->arr_time >= *best - bound[c->arr_stop]) continue;
+    if (c->arr_time < ride[c->arr_stop]) {
+      ride[c->arr_stop] = c->arr_time;
+      s->enter_conn[c->arr_stop] = v->board_conn;
+      s->exit_conn[c->arr_stop] = fs->buffer_id[b];
+      if (c->arr_time < arrival[c->arr_stop]) {
+        arrival[c->arr_stop] = c->arr_time;
+        s->walk_stop[c->arr_stop] = -1;
+      }
+      relax_footpaths(tt, arrival, s->walk_stop, c->arr_stop, c->arr_time);
+    }
+  }
+  return 1;
+}
+
+/**
+ * csa_one_to_all()
+ *
+ * Earliest-arrival connection scan from one origin stop. On return
+ * s->arrival[stop] holds the earliest arrival time at every stop, or
+ * TIME_INFINITY if the stop cannot be reached.
+ *
+ * The scan checks s->time_limit every TIME_LIMIT_CHECK_INTERVAL
+ * connections. Past it, the scan stops with s->partial set, and the labels
+ * are arrivals found so far (upper bounds).
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   s        - Scratch labels owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   day      - Trips the query may ride (timetable_service_day())
+ */
+void csa_one_to_all(const Timetable* tt, CsaScratch* s, int origin,
+                    int dep_time, const ServiceDay* day) {
+  int* arrival = s->arrival;
+  int* ride = s->ride_label;
+  unsigned char* reached = s->trip_reached;
+  for (int i = 0; i < tt->num_stops; ++i) arrival[i] = ride[i] = TIME_INFINITY;
+  memset(reached, 0, (size_t)tt->num_trips * 2);
+  s->partial = 0;
+  arrival[origin] = dep_time;
+  relax_footpaths(tt, arrival, NULL, origin, dep_time);
+
+  CsaCursor cur;
+  CsaRun run;
+  csa_cursor_init(&cur, tt, day, 0, dep_time);
+  csa_cursor_add_frequencies(&cur, &s->freq, dep_time);
+  while (csa_cursor_next_run(&cur, &run)) {
+    if (run.frequencies) {
+      // Every overflow is followed by a run of the stream it happened in
+      if (s->freq.overflow || time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        return;
+      }
+      csa_scan_frequencies(tt, s, -1, NULL);
+      continue;
+    }
+    // Locals, so the stores below cannot be assumed to alias the run
+    const uint32_t* active = run.active;
+    int shift = run.shift, instOffset = run.instance_offset;
+    const Connection* c = tt->connections + run.begin;
+    const Connection* end = tt->connections + run.end;
+    while (c < end) {
+      if (time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        return;
+      }
+      const Connection* chunkEnd = end - c > TIME_LIMIT_CHECK_INTERVAL
+                                       ? c + TIME_LIMIT_CHECK_INTERVAL
+                                       : end;
+      for (; c < chunkEnd; ++c) {
+        if (!TRIP_ACTIVE(active, c->trip)) continue;
+        int inst = c->trip + instOffset;
+        int arr = c->arr_time - shift;
+        if (reached[inst] || arrival[c->dep_stop] <= c->dep_time - shift) {
+          reached[inst] = 1;
+          if (arr < ride[c->arr_stop]) {
+            ride[c->arr_stop] = arr;
+            if (arr < arrival[c->arr_stop]) arrival[c->arr_stop] = arr;
+            relax_footpaths(tt, arrival, NULL, c->arr_stop, arr);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * csa_earliest_arrival()
+ *
+ * Forward connection scan like csa_one_to_all(), additionally recording for
+ * every improved stop the connections where its final leg was boarded and
+ * left, so csa_extract_journey() can rebuild the route.
+ *
+ * With a target the scan stops at the first connection departing no
+ * earlier than the target's label. Lower bounds add goal-directed pruning:
+ * arriving at stop v at time a is ignored when a + bound[v] cannot beat
+ * arrival[target]. Labels of other stops are then incomplete; the
+ * target's is exact. Past s->time_limit the scan stops as in
+ * csa_one_to_all(); the target's label is then the best journey found so
+ * far.
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   s        - Scratch labels owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   day      - Trips the query may ride (timetable_service_day())
+ *   target   - Destination stop, or -1 to scan to the end of the day
+ *   bound    - Per stop: lower bound on the travel time to target
+ *              (landmark_bounds()), or NULL for no pruning
+ */
+void csa_earliest_arrival(const Timetable* tt, CsaScratch* s, int origin,
+                          int dep_time, const ServiceDay* day, int target,
+                          const int* bound) {
+  int noTarget = TIME_INFINITY;
+  int* arrival = s->arrival;
+  const int* best = target >= 0 ? &arrival[target] : &noTarget;
+  int* ride = s->ride_label;
+  unsigned char* reached = s->trip_reached;
+  for (int i = 0; i < tt->num_stops; ++i) arrival[i] = ride[i] = TIME_INFINITY;
+  memset(reached, 0, (size_t)tt->num_trips * 2);
+  s->partial = 0;
+  arrival[origin] = dep_time;
+  s->walk_stop[origin] = -1;
+  relax_footpaths(tt, arrival, s->walk_stop, origin, dep_time);
+
+  CsaCursor cur;
+  CsaRun run;
+  csa_cursor_init(&cur, tt, day, 0, dep_time);
+  csa_cursor_add_frequencies(&cur, &s->freq, dep_time);
+  while (csa_cursor_next_run(&cur, &run)) {
+    if (run.frequencies) {
+      // Every overflow is followed by a run of the stream it happened in
+      if (s->freq.overflow || time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        return;
+      }
+      if (!csa_scan_frequencies(tt, s, target, bound)) return;
+      continue;
+    }
+    const uint32_t* active = run.active;
+    int shift = run.shift, instOffset = run.instance_offset;
+    int idOffset = run.id_offset;
+    int i = run.begin;
+    while (i < run.end) {
+      if (time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        return;
+      }
+      int chunkEnd = run.end - i > TIME_LIMIT_CHECK_INTERVAL
+                         ? i + TIME_LIMIT_CHECK_INTERVAL
+                         : run.end;
+      for (; i < chunkEnd; ++i) {
+        const Connection* c = &tt->connections[i];
+        // Every later connection departs too late to improve the target
+        if (c->dep_time - shift >= *best) return;
+        if (!TRIP_ACTIVE(active, c->trip)) continue;
+        int inst = c->trip + instOffset;
+        int arr = c->arr_time - shift;
+        if (reached[inst] || arrival[c->dep_stop] <= c->dep_time - shift) {
+          if (!reached[inst]) {
+            reached[inst] = 1;
+            s->trip_conn[inst] = i + idOffset;
+            // Staying seated from the block's previous trip is no transfer
+            int prev = tt->trips[c->trip].block_prev;
+            if (prev >= 0 && reached[prev + instOffset])
+              s->trip_conn[inst] = s->trip_conn[prev + instOffset];
+          }
+          if (bound && arr >= *best - bound[c->arr_stop]) continue;
+          if (arr < ride[c->arr_stop]) {
+            ride[c->arr_stop] = arr;
+            s->enter_conn[c->arr_stop] = s->trip_conn[inst];
+            s->exit_conn[c->arr_stop] = i + idOffset;
+            if (arr < arrival[c->arr_stop]) {
+              arrival[c->arr_stop] = arr;
+              s->walk_stop[c->arr_stop] = -1;
+            }
+            relax_footpaths(tt, arrival, s->walk_stop, c->arr_stop, arr);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * csa_latest_departure()
+ *
+ * Reverse connection scan over the arrival-sorted connections: computes,
+ * for every stop, the latest departure that still reaches `target` by
+ * `deadline`. On return s->departure[stop] holds that time, or -1 if the
+ * target cannot be reached in time from the stop.
+ *
+ * With an origin the scan is cut short and pruned like
+ * csa_earliest_arrival(), mirrored: it stops at the first connection
+ * arriving no later than departure[origin], and departing stop v at time d
+ * is ignored when d - bound[v] cannot beat departure[origin]. The time
+ * limit works as in csa_earliest_arrival().
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   s        - Scratch labels owned by the calling thread
+ *   target   - Index of the destination stop
+ *   deadline - Latest acceptable arrival time in seconds
+ *   day      - Trips the query may ride (timetable_service_day())
+ *   origin   - Origin stop, or -1 to scan to the start of the day
+ *   bound    - Per stop: lower bound on the travel time from origin
+ *              (landmark_bounds()), or NULL for no pruning
+ */
+void csa_latest_departure(const Timetable* tt, CsaScratch* s, int target,
+                          int deadline, const ServiceDay* day, int origin,
+                          const int* bound) {
+  int noOrigin = -1;
+  int* departure = s->departure;
+  const int* best = origin >= 0 ? &departure[origin] : &noOrigin;
+  int* ride = s->ride_label;
+  unsigned char* reached = s->trip_reached;
+  for (int i = 0; i < tt->num_stops; ++i) departure[i] = ride[i] = -1;
+  memset(reached, 0, (size_t)tt->num_trips * 2);
+  s->partial = 0;
+  departure[target] = deadline;
+  s->walk_stop[target] = -1;
+  relax_footpaths_reverse(tt, departure, s->walk_stop, target, deadline);
+
+  CsaCursor cur;
+  CsaRun run;
+  csa_cursor_init(&cur, tt, day, 1, deadline);
+  while (csa_cursor_next_run(&cur, &run)) {
+    const uint32_t* active = run.active;
+    int shift = run.shift, instOffset = run.instance_offset;
+    int idOffset = run.id_offset;
+    int i = run.begin;
+    while (i > run.end) {
+      if (time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        return;
+      }
+      int chunkEnd = i - run.end > TIME_LIMIT_CHECK_INTERVAL
+                         ? i - TIME_LIMIT_CHECK_INTERVAL
+                         : run.end;
+      for (; i > chunkEnd; --i) {
+        const Connection* c = &tt->connections_by_arrival[i];
+        // Every earlier connection arrives too early to improve the origin
+        if (c->arr_time - shift <= *best) return;
+        int dep = c->dep_time - shift;
+        // Previous-day trips can only be boarded after midnight
+        if (dep < 0 || !TRIP_ACTIVE(active, c->trip)) continue;
+        int inst = c->trip + instOffset;
+        if (reached[inst] || c->arr_time - shift <= departure[c->arr_stop]) {
+          if (!reached[inst]) {
+            reached[inst] = 1;
+            s->trip_conn[inst] = i + idOffset;
+            // Staying seated into the block's next trip is no transfer
+            int next = tt->trips[c->trip].block_next;
+            if (next >= 0 && reached[next + instOffset])
+              s->trip_conn[inst] = s->trip_conn[next + instOffset];
+          }
+          if (bound && dep - bound[c->dep_stop] <= *best) continue;
+          if (dep > ride[c->dep_stop]) {
+            ride[c->dep_stop] = dep;
+            s->enter_conn[c->dep_stop] = i + idOffset;
+            s->exit_conn[c->dep_stop] = s->trip_conn[inst];
+            if (dep > departure[c->dep_stop]) {
+              departure[c->dep_stop] = dep;
+              s->walk_stop[c->dep_stop] = -1;
+            }
+            relax_footpaths_reverse(tt, departure, s->walk_stop, c->dep_stop,
+                                    dep);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * csa_extract_journey()
+ *
+ * Rebuilds the journey to `target` after csa_earliest_arrival().
+ *
+ * Returns:
+ *   1 if the target was reached (journey filled in), 0 otherwise
+ */
+int csa_extract_journey(const Timetable* tt, const CsaScratch* s, int origin,
+                        int target, Journey* j) {
+  j->num_legs = 0;
+  if (s->arrival[target] == TIME_INFINITY) return 0;
+  int stop = target;
+  int walked = 0;
+  while (stop != origin && j->num_legs < MAX_JOURNEY_LEGS) {
+    // A walk always starts where a vehicle leg ended (or at the origin)
+    if (!walked && s->walk_stop[stop] >= 0) {
+      JourneyLeg* leg = &j->legs[j->num_legs++];
+      leg->trip = -1;
+      leg->last_trip = -1;
+      leg->from_stop = s->walk_stop[stop];
+      leg->to_stop = stop;
+      leg->arr_time = s->arrival[stop];
+      leg->dep_time = leg->arr_time - footpath_time(tt, leg->from_stop, stop);
+      stop = leg->from_stop;
+      walked = 1;
+      continue;
+    }
+    walked = 0;
+    Connection board =
+        csa_view_connection(tt, tt->connections, s->enter_conn[stop]);
+    Connection alight =
+        csa_view_connection(tt, tt->connections, s->exit_conn[stop]);
+    JourneyLeg* leg = &j->legs[j->num_legs++];
+    leg->trip = board.trip;
+    leg->last_trip = alight.trip;
+    leg->from_stop = board.dep_stop;
+    leg->to_stop = alight.arr_stop;
+    leg->dep_time = board.dep_time;
+    leg->arr_time = alight.arr_time;
+    stop = board.dep_stop;
+  }
+  // Legs were collected from the destination backwards
+  for (int a = 0, b = j->num_legs - 1; a < b; ++a, --b) {
+    JourneyLeg t = j->legs[a];
+    j->legs[a] = j->legs[b];
+    j->legs[b] = t;
+  }
+  return 1;
+}
+
+/**
+ * csa_extract_reverse_journey()
+ *
+ * Rebuilds the journey from `origin` after csa_latest_departure().
+ *
+ * Returns:
+ *   1 if the target is reachable by the deadline (journey filled in),
+ *   0 otherwise
+ */
+int csa_extract_reverse_journey(const Timetable* tt, const CsaScratch* s,
+                                int origin, int target, Journey* j) {
+  j->num_legs = 0;
+  if (s->departure[origin] < 0) return 0;
+  int stop = origin;
+  int walked = 0;
+  while (stop != target && j->num_legs < MAX_JOURNEY_LEGS) {
+    // A walk always ends where a vehicle leg starts (or at the target)
+    if (!walked && s->walk_stop[stop] >= 0) {
+      JourneyLeg* leg = &j->legs[j->num_legs++];
+      leg->trip = -1;
+      leg->last_trip = -1;
+      leg->from_stop = stop;
+      leg->to_stop = s->walk_stop[stop];
+      leg->dep_time = s->departure[stop];
+      leg->arr_time = leg->dep_time + footpath_time(tt, stop, leg->to_stop);
+      stop = leg->to_stop;
+      walked = 1;
+      continue;
+    }
+    walked = 0;
+    Connection board = csa_view_connection(tt, tt->connections_by_arrival,
+                                           s->enter_conn[stop]);
+    Connection alight = csa_view_connection(tt, tt->connections_by_arrival,
+                                            s->exit_conn[stop]);
+    JourneyLeg* leg = &j->legs[j->num_legs++];
+    leg->trip = board.trip;
+    leg->last_trip = alight.trip;
+    leg->from_stop = board.dep_stop;
+    leg->to_stop = alight.arr_stop;
+    leg->dep_time = board.dep_time;
+    leg->arr_time = alight.arr_time;
+    stop = alight.arr_stop;
+  }
+  return 1;
+}
+
+// ============================================================================
+// THREAD POOL
+// ============================================================================
+
+/**
+ * ParallelTask
+ * Work item callback for parallel_for(). `worker` is in [0, numThreads) and
+ * identifies the calling thread, so tasks can index per-thread scratch.
+ */
+typedef void (*ParallelTask)(void* ctx, int worker, int item);
+
+/**
+ * WorkQueue structure
+ * A worker's remaining range of item indices. The owner takes items from
+ * the front; idle workers steal the back half.
+ */
+typedef struct {
+  CRITICAL_SECTION lock;  ///< Guards begin/end
+  int begin;              ///< Next item the owner will take
+  int end;                ///< One past the last queued item
+} WorkQueue;
+
+/**
+ * ThreadPool structure
+ * Shared state of one parallel_for() call.
+ */
+typedef struct {
+  WorkQueue* queues;  ///< One queue per worker
+  int num_workers;    ///< Number of worker threads
+  ParallelTask task;  ///< Callback run for each item
+  void* ctx;          ///< Callback context
+} ThreadPool;
+
+/** Thread start argument: the pool and the worker's index in it. */
+typedef struct {
+  ThreadPool* pool;
+  int worker;
+} WorkerArg;
+
+/**
+ * default_thread_count()
+ *
+ * Returns:
+ *   Number of logical processors (at least 1)
+ */
+int default_thread_count(void) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
+/**
+ * work_queue_pop()
+ *
+ * Takes the next item from the front of a queue.
+ *
+ * Returns:
+ *   1 if an item was taken (stored in *item), 0 if the queue is empty
+ */
+int work_queue_pop(WorkQueue* q, int* item) {
+  int ok = 0;
+  EnterCriticalSection(&q->lock);
+  if (q->begin < q->end) {
+    *item = q->begin++;
+    ok = 1;
+  }
+  LeaveCriticalSection(&q->lock);
+  return ok;
+}
+
+/**
+ * work_queue_steal()
+ *
+ * Moves the back half of the first non-empty victim queue into the thief's
+ * (empty) queue. No new work is ever added, so a full pass that finds
+ * nothing means the thief can retire.
+ *
+ * Returns:
+ *   1 if work was stolen, 0 if every other queue is empty
+ */
+int work_queue_steal(ThreadPool* pool, int thief) {
+  for (int k = 1; k < pool->num_workers; ++k) {
+    WorkQueue* victim = &pool->queues[(thief + k) % pool->num_workers];
+    int begin = 0, end = 0;
+    EnterCriticalSection(&victim->lock);
+    int remaining = victim->end - victim->begin;
+    if (remaining > 0) {
+      end = victim->end;
+      begin = end - (remaining + 1) / 2;
+      victim->end = begin;
+    }
+    LeaveCriticalSection(&victim->lock);
+    if (end > begin) {
+      WorkQueue* own = &pool->queues[thief];
+      EnterCriticalSection(&own->lock);
+      own->begin = begin;
+      own->end = end;
+      LeaveCriticalSection(&own->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+DWORD WINAPI parallel_worker(LPVOID arg) {
+  WorkerArg* wa = arg;
+  ThreadPool* pool = wa->pool;
+  WorkQueue* own = &pool->queues[wa->worker];
+  int item;
+  for (;;) {
+    while (work_queue_pop(own, &item)) pool->task(pool->ctx, wa->worker, item);
+    if (!work_queue_steal(pool, wa->worker)) break;
+  }
+  return 0;
+}
+
+/**
+ * parallel_for()
+ *
+ * Runs task(ctx, worker, i) for every i in [0, numItems) on numThreads
+ * work-stealing threads. Items are initially split into equal contiguous
+ * ranges, one per worker; uneven item costs are balanced by stealing.
+ *
+ * Returns:
+ *   1 on success, 0 if threads could not be created
+ */
+int parallel_for(int numItems, int numThreads, ParallelTask task, void* ctx) {
+  if (numThreads > numItems) numThreads = numItems;
+  if (numThreads <= 1) {
+    for (int i = 0; i < numItems; ++i) task(ctx, 0, i);
+    return 1;
+  }
+
+  ThreadPool pool;
+  pool.num_workers = numThreads;
+  pool.task = task;
+  pool.ctx = ctx;
+  pool.queues = malloc((size_t)numThreads * sizeof(WorkQueue));
+  WorkerArg* args = malloc((size_t)numThreads * sizeof(WorkerArg));
+  HANDLE* threads = malloc((size_t)numThreads * sizeof(HANDLE));
+  if (!pool.queues || !args || !threads) {
+    free(pool.queues);
+    free(args);
+    free(threads);
+    return 0;
+  }
+  for (int w = 0; w < numThreads; ++w) {
+    InitializeCriticalSection(&pool.queues[w].lock);
+    pool.queues[w].begin = (int)((long long)numItems * w / numThreads);
+    pool.queues[w].end = (int)((long long)numItems * (w + 1) / numThreads);
+    args[w].pool = &pool;
+    args[w].worker = w;
+  }
+
+  int ok = 1;
+  int started = 0;
+  for (; started < numThreads; ++started) {
+    threads[started] =
+        CreateThread(NULL, 0, parallel_worker, &args[started], 0, NULL);
+    if (!threads[started]) break;
+  }
+  if (started < numThreads) {
+    // Workers that did start steal the orphaned ranges
+    ok = started > 0;
+    if (!ok) fprintf(stderr, "could not create worker threads\n");
+  }
+  for (int w = 0; w < started; ++w) {
+    WaitForSingleObject(threads[w], INFINITE);
+    CloseHandle(threads[w]);
+  }
+  for (int w = 0; w < numThreads; ++w)
+    DeleteCriticalSection(&pool.queues[w].lock);
+  free(pool.queues);
+  free(args);
+  free(threads);
+  return ok;
+}
+
+// ============================================================================
+// VECTOR TILES
+// ============================================================================
+
+/** Tile coordinate range of one tile side (Mapbox Vector Tile extent). */
+#define TILE_EXTENT 4096
+/**
+ * Tile coordinates drawn beyond each edge, so lines and stop symbols
+ * crossing into a neighbouring tile are not cut off at the seam.
+ */
+#define TILE_BUFFER 64
+
+/** Protocol buffer wire types used by the tile encoding. */
+#define PB_VARINT 0
+#define PB_BYTES 2
+
+/** MVT geometry commands and feature types. */
+#define MVT_MOVE_TO 1
+#define MVT_LINE_TO 2
+#define MVT_POINT 1
+#define MVT_LINESTRING 2
+
+/**
+ * pb_varint()
+ *
+ * Appends a protocol buffer base-128 varint.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int pb_varint(ByteBuffer* b, unsigned long long v) {
+  if (!byte_buffer_reserve(b, 10)) return 0;
+  while (v >= 0x80) {
+    b->data[b->len++] = (unsigned char)(0x80 | (v & 0x7f));
+    v >>= 7;
+  }
+  b->data[b->len++] = (unsigned char)v;
+  return 1;
+}
+
+/** Number of bytes pb_varint() writes for v. */
+size_t pb_varint_size(unsigned long long v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/** Appends a field key; returns 1 on success, 0 on allocation failure. */
+int pb_key(ByteBuffer* b, int field, int wireType) {
+  return pb_varint(b, (unsigned long long)(field << 3 | wireType));
+}
+
+/** Appends a varint field; returns 1 on success, 0 on allocation failure. */
+int pb_uint(ByteBuffer* b, int field, unsigned long long v) {
+  return pb_key(b, field, PB_VARINT) && pb_varint(b, v);
+}
+
+/**
+ * pb_bytes()
+ *
+ * Appends a length-delimited field: a string, an embedded message or a
+ * packed repeated field already encoded in `data`.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int pb_bytes(ByteBuffer* b, int field, const void* data, size_t len) {
+  if (!pb_key(b, field, PB_BYTES) || !pb_varint(b, len) ||
+      !byte_buffer_reserve(b, len))
+    return 0;
+  if (len) memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return 1;
+}
+
+/** Zigzag encoding of a signed tile coordinate delta. */
+unsigned mvt_zigzag(int v) {
+  return v < 0 ? ~((unsigned)v << 1) : (unsigned)v << 1;
+}
+
+/**
+ * mercator_x() / mercator_y()
+ *
+ * Web Mercator position of a longitude / latitude, in [0, 1) across the
+ * world (y grows southwards), as used to number map tiles.
+ */
+double mercator_x(double lon) { return (lon + 180.0) / 360.0; }
+
+double mercator_y(double lat) {
+  double s = sin(lat * DEG_TO_RAD);
+  return 0.5 - log((1.0 + s) / (1.0 - s)) / (4.0 * 3.14159265358979323846);
+}
+
+/**
+ * TileWorker structure
+ * Per-thread encoding buffers, reused from one tile to the next.
+ */
+typedef struct {
+  ByteBuffer tile;     ///< Encoded tile
+  ByteBuffer layer;    ///< Layer being encoded
+  ByteBuffer feature;  ///< Feature being encoded
+  ByteBuffer packed;   ///< Packed tags or geometry of that feature
+  ByteBuffer values;   ///< The layer's encoded Value messages
+  int* part;           ///< Tile coordinates (x, y pairs) of a line part
+  int part_len;        ///< Points in part
+  int part_cap;        ///< Capacity of part, in ints
+  int cursor_x;        ///< Geometry cursor (last point encoded)
+  int cursor_y;
+  long bytes;          ///< Tile bytes written by this worker
+  int tiles;           ///< Tiles written by this worker
+} TileWorker;
+
+/** Shared state of the parallel tile generation. */
+typedef struct {
+  const Timetable* tt;
+  const ShapeLods* lods;
+  const char* dir;           ///< Output directory
+  int min_zoom;              ///< First zoom level
+  int max_zoom;              ///< Last zoom level
+  int x0[32];                ///< Per zoom: tile range covering the data
+  int x1[32];
+  int y0[32];
+  int y1[32];
+  int first_item[33];        ///< Per zoom from min_zoom: its first work
+                             ///< item, then the total
+  double* stop_x;            ///< Mercator x of every stop
+  double* stop_y;            ///< Mercator y of every stop
+  double* point_x;           ///< Mercator x of every shape point
+  double* point_y;           ///< Mercator y of every shape point
+  double* shape_box;         ///< Per shape: min x, min y, max x, max y
+  const char** shape_route;  ///< Per shape: route_short_name of its first
+                             ///< trip ("" if none)
+  TileWorker* workers;
+  int failed;                ///< Set on allocation or I/O failure
+} TileJob;
+
+/**
+ * tile_flush_part()
+ *
+ * Encodes the buffered line part as MoveTo + LineTo commands (dropped if
+ * it has fewer than two points) and empties the buffer.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_flush_part(TileWorker* w) {
+  int n = w->part_len;
+  w->part_len = 0;
+  if (n < 2) return 1;
+  const int* p = w->part;
+  int ok = pb_varint(&w->packed, MVT_MOVE_TO | 1 << 3);
+  for (int i = 0; ok && i < n; ++i) {
+    if (i == 1) ok = pb_varint(&w->packed, MVT_LINE_TO | (n - 1) << 3);
+    ok = ok && pb_varint(&w->packed, mvt_zigzag(p[2 * i] - w->cursor_x)) &&
+         pb_varint(&w->packed, mvt_zigzag(p[2 * i + 1] - w->cursor_y));
+    w->cursor_x = p[2 * i];
+    w->cursor_y = p[2 * i + 1];
+  }
+  return ok;
+}
+
+/**
+ * tile_part_point()
+ *
+ * Adds a point, in tile coordinates, to the buffered line part unless it
+ * rounds to the previous one.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_part_point(TileWorker* w, double x, double y) {
+  int ix = (int)lround(x), iy = (int)lround(y);
+  int n = w->part_len;
+  if (n > 0 && w->part[2 * n - 2] == ix && w->part[2 * n - 1] == iy)
+    return 1;
+  if (!grow_array((void**)&w->part, &w->part_cap, 2 * n + 2, sizeof(int)))
+    return 0;
+  w->part[2 * n] = ix;
+  w->part[2 * n + 1] = iy;
+  w->part_len++;
+  return 1;
+}
+
+/**
+ * tile_clip_segment()
+ *
+ * Liang-Barsky clipping of the segment (x0, y0)-(x1, y1) to the square
+ * [lo, hi] x [lo, hi]; the endpoints are moved onto the square's edges.
+ *
+ * Returns:
+ *   1 if some of the segment lies in the square, 0 otherwise
+ */
+int tile_clip_segment(double* x0, double* y0, double* x1, double* y1,
+                      double lo, double hi) {
+  double dx = *x1 - *x0, dy = *y1 - *y0;
+  double p[4] = {-dx, dx, -dy, dy};
+  double q[4] = {*x0 - lo, hi - *x0, *y0 - lo, hi - *y0};
+  double t0 = 0.0, t1 = 1.0;
+  for (int k = 0; k < 4; ++k) {
+    if (p[k] == 0.0) {
+      if (q[k] < 0.0) return 0;
+      continue;
+    }
+    double t = q[k] / p[k];
+    if (p[k] < 0.0) {
+      if (t > t1) return 0;
+      if (t > t0) t0 = t;
+    } else {
+      if (t < t0) return 0;
+      if (t < t1) t1 = t;
+    }
+  }
+  double ax = *x0, ay = *y0;
+  *x0 = ax + t0 * dx;
+  *y0 = ay + t0 * dy;
+  *x1 = ax + t1 * dx;
+  *y1 = ay + t1 * dy;
+  return 1;
+}
+
+/**
+ * tile_feature()
+ *
+ * Appends the feature being built (its id, two string properties whose
+ * values become the layer's next two values, type and the geometry in
+ * w->packed) to the layer.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_feature(TileWorker* w, int id, int type, int numValues,
+                 const char* a, const char* b) {
+  ByteBuffer* f = &w->feature;
+  byte_buffer_reset(f);
+  // The geometry goes first so that w->packed can then hold the tags:
+  // key 0 -> value numValues, key 1 -> value numValues + 1
+  int ok = pb_uint(f, 1, (unsigned long long)id) &&
+           pb_bytes(f, 4, w->packed.data, w->packed.len);
+  byte_buffer_reset(&w->packed);
+  ok = ok && pb_varint(&w->packed, 0) &&
+       pb_varint(&w->packed, (unsigned long long)numValues) &&
+       pb_varint(&w->packed, 1) &&
+       pb_varint(&w->packed, (unsigned long long)numValues + 1) &&
+       pb_bytes(f, 2, w->packed.data, w->packed.len) &&
+       pb_uint(f, 3, (unsigned long long)type);
+  // Layer field 4: Value messages holding a string in their field 1
+  const char* strings[2] = {a, b};
+  for (int i = 0; ok && i < 2; ++i) {
+    size_t len = strlen(strings[i]);
+    ok = pb_key(&w->values, 4, PB_BYTES) &&
+         pb_varint(&w->values, 1 + pb_varint_size(len) + len) &&
+         pb_bytes(&w->values, 1, strings[i], len);
+  }
+  return ok && pb_bytes(&w->layer, 2, f->data, f->len);
+}
+
+/**
+ * tile_layer()
+ *
+ * Completes the layer in w->layer (features already appended) with its
+ * name, keys, values and extent, and appends it to the tile if it has
+ * any features.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_layer(TileWorker* w, const char* name, const char* key0,
+               const char* key1, int numFeatures) {
+  if (numFeatures == 0) return 1;
+  ByteBuffer* l = &w->layer;
+  int ok = pb_uint(l, 15, 2) && pb_bytes(l, 1, name, strlen(name)) &&
+           pb_bytes(l, 3, key0, strlen(key0)) &&
+           pb_bytes(l, 3, key1, strlen(key1)) &&
+           byte_buffer_reserve(l, w->values.len);
+  if (ok) {
+    memcpy(l->data + l->len, w->values.data, w->values.len);
+    l->len += w->values.len;
+  }
+  return ok && pb_uint(l, 5, TILE_EXTENT) &&
+         pb_bytes(&w->tile, 3, l->data, l->len);
+}
+
+/**
+ * tile_encode()
+ *
+ * Encodes tile (z, x, y) into w->tile: a "stops" layer of points (stop_id,
+ * name) and a "shapes" layer of lines (shape_id, route) simplified for the
+ * zoom level (shape_lod_for_zoom()) and clipped to the tile plus
+ * TILE_BUFFER.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_encode(const TileJob* job, TileWorker* w, int z, int x, int y) {
+  const Timetable* tt = job->tt;
+  double scale = (double)(1 << z);
+  double lo = -TILE_BUFFER, hi = TILE_EXTENT + TILE_BUFFER;
+  // Mercator bounds of the buffered tile, to skip what cannot touch it
+  double pad = (double)TILE_BUFFER / TILE_EXTENT;
+  double minX = (x - pad) / scale, maxX = (x + 1 + pad) / scale;
+  double minY = (y - pad) / scale, maxY = (y + 1 + pad) / scale;
+  int ok = 1;
+  byte_buffer_reset(&w->tile);
+
+  byte_buffer_reset(&w->layer);
+  byte_buffer_reset(&w->values);
+  int features = 0;
+  for (int s = 0; ok && s < tt->num_stops; ++s) {
+    double sx = job->stop_x[s], sy = job->stop_y[s];
+    if (sx < minX || sx > maxX || sy < minY || sy > maxY) continue;
+    int px = (int)lround((sx * scale - x) * TILE_EXTENT);
+    int py = (int)lround((sy * scale - y) * TILE_EXTENT);
+    byte_buffer_reset(&w->packed);
+    ok = pb_varint(&w->packed, MVT_MOVE_TO | 1 << 3) &&
+         pb_varint(&w->packed, mvt_zigzag(px)) &&
+         pb_varint(&w->packed, mvt_zigzag(py)) &&
+         tile_feature(w, s + 1, MVT_POINT, 2 * features,
+                      tt->stops[s].stop_id, tt->stops[s].stop_name);
+    features++;
+  }
+  ok = ok && tile_layer(w, "stops", "stop_id", "name", features);
+
+  byte_buffer_reset(&w->layer);
+  byte_buffer_reset(&w->values);
+  features = 0;
+  double centerLat =
+      atan(sinh(3.14159265358979323846 * (1.0 - 2.0 * (y + 0.5) / scale))) /
+      DEG_TO_RAD;
+  int level = shape_lod_for_zoom(z, centerLat);
+  for (int s = 0; ok && s < tt->num_shapes; ++s) {
+    const double* box = job->shape_box + 4 * s;
+    if (box[0] > maxX || box[2] < minX || box[1] > maxY || box[3] < minY)
+      continue;
+    int count;
+    const int* pts = shape_lod_points(job->lods, s, level, &count);
+    byte_buffer_reset(&w->packed);
+    w->part_len = 0;
+    w->cursor_x = w->cursor_y = 0;
+    double bx = 0.0, by = 0.0;
+    for (int i = 0; ok && i < count; ++i) {
+      double ax = bx, ay = by;
+      bx = (job->point_x[pts[i]] * scale - x) * TILE_EXTENT;
+      by = (job->point_y[pts[i]] * scale - y) * TILE_EXTENT;
+      if (i == 0) continue;
+      double x0 = ax, y0 = ay, x1 = bx, y1 = by;
+      if (!tile_clip_segment(&x0, &y0, &x1, &y1, lo, hi)) {
+        ok = tile_flush_part(w);
+        continue;
+      }
+      // A segment entering the box starts a new part, one leaving it ends
+      // the current one
+      if (x0 != ax || y0 != ay) ok = tile_flush_part(w);
+      ok = ok && tile_part_point(w, x0, y0) && tile_part_point(w, x1, y1);
+      if (ok && (x1 != bx || y1 != by)) ok = tile_flush_part(w);
+    }
+    ok = ok && tile_flush_part(w);
+    if (ok && w->packed.len > 0) {
+      ok = tile_feature(w, s + 1, MVT_LINESTRING, 2 * features,
+                        tt->shapes[s].shape_id, job->shape_route[s]);
+      features++;
+    }
+  }
+  return ok && tile_layer(w, "shapes", "shape_id", "route", features);
+}
+
+/**
+ * tile_task()
+ *
+ * Parallel task: encodes one tile and writes it to <dir>/z/x/y.mvt,
+ * unless it is empty.
+ */
+void tile_task(void* ctx, int worker, int item) {
+  TileJob* job = ctx;
+  TileWorker* w = &job->workers[worker];
+  int z = job->min_zoom;
+  while (item >= job->first_item[z - job->min_zoom + 1]) z++;
+  int i = item - job->first_item[z - job->min_zoom];
+  int width = job->x1[z] - job->x0[z] + 1;
+  int x = job->x0[z] + i % width, y = job->y0[z] + i / width;
+  if (!tile_encode(job, w, z, x, y)) {
+    job->failed = 1;
+    return;
+  }
+  if (w->tile.len == 0) return;
+
+  char path[1200];
+  // Directories may already exist (or be created by another worker)
+  snprintf(path, sizeof(path), "%s/%d", job->dir, z);
+  _mkdir(path);
+  snprintf(path, sizeof(path), "%s/%d/%d", job->dir, z, x);
+  _mkdir(path);
+  snprintf(path, sizeof(path), "%s/%d/%d/%d.mvt", job->dir, z, x, y);
+  FILE* fp = fopen(path, "wb");
+  if (!fp) {
+    fprintf(stderr, "opening '%s': %s\n", path, strerror(errno));
+    job->failed = 1;
+    return;
+  }
+  if (fwrite(w->tile.data, 1, w->tile.len, fp) != w->tile.len) job->failed = 1;
+  if (fclose(fp) != 0) job->failed = 1;
+  w->bytes += (long)w->tile.len;
+  w->tiles++;
+}
+
+/**
+ * tile_job_prepare()
+ *
+ * Projects stops and shape points once, computes shape bounding boxes and
+ * routes, and lays out the tiles covering the data at each zoom level.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tile_job_prepare(TileJob* job) {
+  const Timetable* tt = job->tt;
+  size_t numStops = (size_t)(tt->num_stops > 0 ? tt->num_stops : 1);
+  size_t numPoints =
+      (size_t)(tt->num_shape_points > 0 ? tt->num_shape_points : 1);
+  size_t numShapes = (size_t)(tt->num_shapes > 0 ? tt->num_shapes : 1);
+  job->stop_x = malloc(numStops * sizeof(double));
+  job->stop_y = malloc(numStops * sizeof(double));
+  job->point_x = malloc(numPoints * sizeof(double));
+  job->point_y = malloc(numPoints * sizeof(double));
+  job->shape_box = malloc(4 * numShapes * sizeof(double));
+  job->shape_route = malloc(numShapes * sizeof(const char*));
+  if (!job->stop_x || !job->stop_y || !job->point_x || !job->point_y ||
+      !job->shape_box || !job->shape_route)
+    return 0;
+
+  double box[4] = {1.0, 1.0, 0.0, 0.0};
+  for (int s = 0; s < tt->num_stops; ++s) {
+    double x = job->stop_x[s] = mercator_x(tt->stops[s].stop_lon);
+    double y = job->stop_y[s] = mercator_y(tt->stops[s].stop_lat);
+    if (x < box[0]) box[0] = x;
+    if (y < box[1]) box[1] = y;
+    if (x > box[2]) box[2] = x;
+    if (y > box[3]) box[3] = y;
+  }
+  for (int i = 0; i < tt->num_shape_points; ++i) {
+    job->point_x[i] = mercator_x(tt->shape_lon[i]);
+    job->point_y[i] = mercator_y(tt->shape_lat[i]);
+  }
+  for (int s = 0; s < tt->num_shapes; ++s) {
+    const Shape* sh = &tt->shapes[s];
+    double* b = job->shape_box + 4 * s;
+    b[0] = b[1] = 1.0;
+    b[2] = b[3] = 0.0;
+    for (int i = sh->first_point; i < sh->first_point + sh->num_points;
+         ++i) {
+      if (job->point_x[i] < b[0]) b[0] = job->point_x[i];
+      if (job->point_y[i] < b[1]) b[1] = job->point_y[i];
+      if (job->point_x[i] > b[2]) b[2] = job->point_x[i];
+      if (job->point_y[i] > b[3]) b[3] = job->point_y[i];
+    }
+    for (int k = 0; k < 4; ++k)
+      if (sh->num_points > 0 && (k < 2 ? b[k] < box[k] : b[k] > box[k]))
+        box[k] = b[k];
+    job->shape_route[s] = "";
+  }
+  for (int t = tt->num_trips - 1; t >= 0; --t) {
+    const Trip* trip = &tt->trips[t];
+    if (trip->shape >= 0 && trip->route >= 0)
+      job->shape_route[trip->shape] =
+          tt->routes[trip->route].route_short_name;
+  }
+
+  job->first_item[0] = 0;
+  for (int z = job->min_zoom; z <= job->max_zoom; ++z) {
+    int n = 1 << z, count = 0;
+    if (box[0] <= box[2]) {
+      job->x0[z] = (int)(box[0] * n);
+      job->y0[z] = (int)(box[1] * n);
+      job->x1[z] = (int)(box[2] * n);
+      job->y1[z] = (int)(box[3] * n);
+      if (job->x1[z] >= n) job->x1[z] = n - 1;
+      if (job->y1[z] >= n) job->y1[z] = n - 1;
+      count = (job->x1[z] - job->x0[z] + 1) * (job->y1[z] - job->y0[z] + 1);
+    }
+    job->first_item[z - job->min_zoom + 1] =
+        job->first_item[z - job->min_zoom] + count;
+  }
+  return 1;
+}
+
+void tile_job_free(TileJob* job) {
+  free(job->stop_x);
+  free(job->stop_y);
+  free(job->point_x);
+  free(job->point_y);
+  free(job->shape_box);
+  free(job->shape_route);
+}
+
+/**
+ * run_tiles_mode()
+ *
+ * Command line: tiles [minzoom] [maxzoom] [threads] [dir]
+ * Writes Mapbox Vector Tiles of the stops and shapes covering the data
+ * for every zoom level in the range (default 10-16) to dir/z/x/y.mvt
+ * (default tiles), encoding tiles on `threads` threads (default: all
+ * logical processors). Empty tiles are not written.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_tiles_mode(int argc, char** argv, const TimetableOptions* opts) {
+  int minZoom = argc > 0 ? atoi(argv[0]) : 10;
+  int maxZoom = argc > 1 ? atoi(argv[1]) : 16;
+  int threads = argc > 2 ? atoi(argv[2]) : default_thread_count();
+  const char* dir = argc > 3 ? argv[3] : "tiles";
+  // Tile numbers must fit an int at the highest zoom
+  if (minZoom < 0 || maxZoom > 24 || minZoom > maxZoom) {
+    fprintf(stderr, "invalid zoom range %d-%d (0-24)\n", minZoom, maxZoom);
+    return 1;
+  }
+  if (threads < 1) threads = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  ShapeLods lods;
+  if (!shape_lods_load_or_build(&tt, &lods, 0)) {
+    free_timetable(&tt);
+    return 1;
+  }
+  TileJob job;
+  memset(&job, 0, sizeof(job));
+  job.tt = &tt;
+  job.lods = &lods;
+  job.dir = dir;
+  job.min_zoom = minZoom;
+  job.max_zoom = maxZoom;
+  job.workers = calloc((size_t)threads, sizeof(TileWorker));
+  int ok = job.workers && tile_job_prepare(&job);
+  if (ok && _mkdir(dir) != 0 && errno != EEXIST) {
+    fprintf(stderr, "creating '%s': %s\n", dir, strerror(errno));
+    ok = 0;
+  }
+  double t0 = now_seconds();
+  int items = job.first_item[maxZoom - minZoom + 1];
+  ok = ok && parallel_for(items, threads, tile_task, &job) && !job.failed;
+  double elapsed = now_seconds() - t0;
+  if (ok) {
+    long bytes = 0, tiles = 0;
+    for (int k = 0; k < threads; ++k) {
+      bytes += job.workers[k].bytes;
+      tiles += job.workers[k].tiles;
+    }
+    printf("tiles: %ld tiles (%ld bytes) for zoom %d-%d on %d threads in "
+           "%.3f s, written to %s\n",
+           tiles, bytes, minZoom, maxZoom, threads, elapsed, dir);
+  }
+  if (job.workers) {
+    for (int k = 0; k < threads; ++k) {
+      TileWorker* w = &job.workers[k];
+      byte_buffer_free(&w->tile);
+      byte_buffer_free(&w->layer);
+      byte_buffer_free(&w->feature);
+      byte_buffer_free(&w->packed);
+      byte_buffer_free(&w->values);
+      free(w->part);
+    }
+  }
+  free(job.workers);
+  tile_job_free(&job);
+  shape_lods_free(&lods);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// SEGMENT STATISTICS
+// ============================================================================
+
+/** Hours of the day running times are broken down by. */
+#define SEGMENT_HOURS 24
+
+/**
+ * Running-time histogram bins: SEGMENT_FINE_BINS of SEGMENT_FINE_SECONDS,
+ * then bins of SEGMENT_COARSE_SECONDS; the last bin also counts every
+ * longer time.
+ */
+#define SEGMENT_BINS 64
+#define SEGMENT_FINE_BINS 48
+#define SEGMENT_FINE_SECONDS 5
+#define SEGMENT_COARSE_SECONDS 60
+
+/** Ordered pair of stops served one after the other by some trip. */
+typedef struct {
+  int from;  ///< Index of the stop left
+  int to;    ///< Index of the next stop
+} Segment;
+
+/** Distribution of the scheduled running times over one segment. */
+typedef struct {
+  int count;   ///< Number of runs
+  int min;     ///< Shortest running time in seconds
+  int median;  ///< Median running time (to the histogram's resolution)
+  int p90;     ///< 90th percentile of the running times
+} SegmentTimes;
+
+/**
+ * SegmentStats structure
+ * Scheduled running times between consecutive stops, aggregated over every
+ * trip (and every instance of a frequency-based trip) per stop pair and
+ * per hour of the departure.
+ */
+typedef struct {
+  int num_segments;        ///< Number of distinct stop pairs
+  Segment* segments;       ///< Stop pairs, sorted by from then to
+  int* offsets;            ///< Per stop: first segment leaving it
+  int* stop_time_segment;  ///< Per stop time: segment to the trip's next
+                           ///< stop, or -1 at its last stop
+  SegmentTimes* times;     ///< [segment * (SEGMENT_HOURS + 1) + hour]; hour
+                           ///< SEGMENT_HOURS covers the whole day
+} SegmentStats;
+
+int compare_segments(const void* a, const void* b) {
+  const Segment* x = a;
+  const Segment* y = b;
+  if (x->from != y->from) return x->from < y->from ? -1 : 1;
+  return (x->to > y->to) - (x->to < y->to);
+}
+
+/**
+ * segment_find()
+ *
+ * Returns:
+ *   Index of the segment from stop `from` to stop `to`, or -1 if no trip
+ *   runs directly between them
+ */
+int segment_find(const SegmentStats* ss, int from, int to) {
+  int lo = ss->offsets[from], hi = ss->offsets[from + 1];
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ss->segments[mid].to < to) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < ss->offsets[from + 1] && ss->segments[lo].to == to ? lo : -1;
+}
+
+/**
+ * segment_times()
+ *
+ * Returns:
+ *   Running times over a segment for departures in one hour of the day
+ *   (0-23), or over the whole day for SEGMENT_HOURS
+ */
+const SegmentTimes* segment_times(const SegmentStats* ss, int segment,
+                                  int hour) {
+  return &ss->times[(size_t)segment * (SEGMENT_HOURS + 1) + hour];
+}
+
+/**
+ * segment_time_bin()
+ *
+ * Returns:
+ *   Histogram bin of a running time in seconds
+ */
+int segment_time_bin(int seconds) {
+  int fine = SEGMENT_FINE_BINS * SEGMENT_FINE_SECONDS;
+  if (seconds < fine) return seconds > 0 ? seconds / SEGMENT_FINE_SECONDS : 0;
+  int b = SEGMENT_FINE_BINS + (seconds - fine) / SEGMENT_COARSE_SECONDS;
+  return b < SEGMENT_BINS - 1 ? b : SEGMENT_BINS - 1;
+}
+
+/**
+ * segment_bin_time()
+ *
+ * Returns:
+ *   Running time in seconds at the middle of a histogram bin
+ */
+int segment_bin_time(int bin) {
+  if (bin < SEGMENT_FINE_BINS)
+    return bin * SEGMENT_FINE_SECONDS + SEGMENT_FINE_SECONDS / 2;
+  return SEGMENT_FINE_BINS * SEGMENT_FINE_SECONDS +
+         (bin - SEGMENT_FINE_BINS) * SEGMENT_COARSE_SECONDS +
+         SEGMENT_COARSE_SECONDS / 2;
+}
+
+/**
+ * segment_stats_index()
+ *
+ * Collects the distinct stop pairs of all trips and assigns every stop
+ * time its segment.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int segment_stats_index(const Timetable* tt, SegmentStats* ss) {
+  int n = tt->num_stop_times > 0 ? tt->num_stop_times : 1;
+  ss->segments = malloc((size_t)n * sizeof(Segment));
+  ss->offsets = calloc((size_t)tt->num_stops + 1, sizeof(int));
+  ss->stop_time_segment = malloc((size_t)n * sizeof(int));
+  if (!ss->segments || !ss->offsets || !ss->stop_time_segment) return 0;
+  int k = 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    for (int i = trip->first_stop_time;
+         i + 1 < trip->first_stop_time + trip->num_stop_times; ++i) {
+      ss->segments[k].from = tt->stop_times[i].stop;
+      ss->segments[k++].to = tt->stop_times[i + 1].stop;
+    }
+  }
+  qsort(ss->segments, (size_t)k, sizeof(Segment), compare_segments);
+  int kept = 0;
+  for (int i = 0; i < k; ++i)
+    if (kept == 0 || compare_segments(&ss->segments[kept - 1],
+                                      &ss->segments[i]) != 0)
+      ss->segments[kept++] = ss->segments[i];
+  ss->num_segments = kept;
+  for (int i = 0; i < kept; ++i) ss->offsets[ss->segments[i].from + 1]++;
+  for (int v = 0; v < tt->num_stops; ++v)
+    ss->offsets[v + 1] += ss->offsets[v];
+
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    int last = trip->first_stop_time + trip->num_stop_times - 1;
+    for (int i = trip->first_stop_time; i <= last; ++i)
+      ss->stop_time_segment[i] =
+          i < last ? segment_find(ss, tt->stop_times[i].stop,
+                                  tt->stop_times[i + 1].stop)
+                   : -1;
+  }
+  return 1;
+}
+
+/**
+ * SegmentWorker structure
+ * Per-thread histograms: each worker counts the trips it handles into its
+ * own cells, so no locking is needed until they are merged.
+ */
+typedef struct {
+  int* bins;  ///< [(segment * SEGMENT_HOURS + hour) * SEGMENT_BINS + bin]
+  int* min;   ///< Per segment and hour: shortest time seen
+  int* max;   ///< Per segment and hour: longest time seen
+} SegmentWorker;
+
+/** Shared state of the parallel segment statistics. */
+typedef struct {
+  const Timetable* tt;
+  SegmentStats* ss;
+  SegmentWorker* workers;
+  int num_workers;
+} SegmentJob;
+
+/**
+ * segment_count_trip()
+ *
+ * Counts one run of a trip into a worker's histograms, its departures
+ * shifted by `shift` seconds (non-zero for instances of frequency-based
+ * trips).
+ */
+void segment_count_trip(const Timetable* tt, const SegmentStats* ss,
+                        SegmentWorker* w, int t, int shift) {
+  const Trip* trip = &tt->trips[t];
+  const StopTime* st = tt->stop_times;
+  for (int i = trip->first_stop_time;
+       i + 1 < trip->first_stop_time + trip->num_stop_times; ++i) {
+    int run = st[i + 1].arrival_time - st[i].departure_time;
+    int dep = st[i].departure_time + shift;
+    int hour = (dep % SECONDS_PER_DAY + SECONDS_PER_DAY) % SECONDS_PER_DAY /
+               3600;
+    size_t cell = (size_t)ss->stop_time_segment[i] * SEGMENT_HOURS + hour;
+    w->bins[cell * SEGMENT_BINS + segment_time_bin(run)]++;
+    if (run < w->min[cell]) w->min[cell] = run;
+    if (run > w->max[cell]) w->max[cell] = run;
+  }
+}
+
+/**
+ * segment_trip_task()
+ *
+ * Parallel task: counts every run of trip t into the calling worker's
+ * histograms.
+ */
+void segment_trip_task(void* ctx, int worker, int t) {
+  SegmentJob* job = ctx;
+  const Timetable* tt = job->tt;
+  const Trip* trip = &tt->trips[t];
+  SegmentWorker* w = &job->workers[worker];
+  if (trip->frequency < 0) {
+    segment_count_trip(tt, job->ss, w, t, 0);
+    return;
+  }
+  int first = tt->stop_times[trip->first_stop_time].departure_time;
+  for (int f = trip->frequency;
+       f < tt->num_frequencies && tt->frequencies[f].trip == t; ++f) {
+    const Frequency* fr = &tt->frequencies[f];
+    for (int k = 0; k < fr->num_instances; ++k)
+      segment_count_trip(tt, job->ss, w, t,
+                         fr->start_time + k * fr->headway - first);
+  }
+}
+
+/**
+ * segment_summarize()
+ *
+ * Reads count, median and 90th percentile off a histogram; min and max
+ * are exact and bound the quantiles, which are otherwise only as precise
+ * as the bins.
+ */
+void segment_summarize(const int* bins, int min, int max, SegmentTimes* out) {
+  int count = 0;
+  for (int b = 0; b < SEGMENT_BINS; ++b) count += bins[b];
+  out->count = count;
+  out->min = count ? min : 0;
+  out->median = out->p90 = out->min;
+  if (count == 0) return;
+  int medianRank = (count + 1) / 2, p90Rank = (9 * count + 9) / 10;
+  int seen = 0;
+  for (int b = 0; b < SEGMENT_BINS; ++b) {
+    int before = seen;
+    seen += bins[b];
+    // The last bin is open-ended: its longest time is the best guess
+    int t = b < SEGMENT_BINS - 1 ? segment_bin_time(b) : max;
+    if (t < min) t = min;
+    if (t > max) t = max;
+    if (before < medianRank && seen >= medianRank) out->median = t;
+    if (before < p90Rank && seen >= p90Rank) {
+      out->p90 = t;
+      break;
+    }
+  }
+}
+
+/**
+ * segment_merge_task()
+ *
+ * Parallel task: adds up the workers' histograms of one segment and
+ * summarizes each hour and the whole day.
+ */
+void segment_merge_task(void* ctx, int worker, int segment) {
+  (void)worker;
+  SegmentJob* job = ctx;
+  SegmentTimes* times =
+      job->ss->times + (size_t)segment * (SEGMENT_HOURS + 1);
+  int day[SEGMENT_BINS] = {0};
+  int dayMin = TIME_INFINITY, dayMax = -1;
+  for (int h = 0; h < SEGMENT_HOURS; ++h) {
+    size_t cell = (size_t)segment * SEGMENT_HOURS + h;
+    int bins[SEGMENT_BINS] = {0};
+    int min = TIME_INFINITY, max = -1;
+    for (int k = 0; k < job->num_workers; ++k) {
+      const SegmentWorker* w = &job->workers[k];
+      const int* wb = w->bins + cell * SEGMENT_BINS;
+      for (int b = 0; b < SEGMENT_BINS; ++b) bins[b] += wb[b];
+      if (w->min[cell] < min) min = w->min[cell];
+      if (w->max[cell] > max) max = w->max[cell];
+    }
+    for (int b = 0; b < SEGMENT_BINS; ++b) day[b] += bins[b];
+    if (min < dayMin) dayMin = min;
+    if (max > dayMax) dayMax = max;
+    segment_summarize(bins, min, max, &times[h]);
+  }
+  segment_summarize(day, dayMin, dayMax, &times[SEGMENT_HOURS]);
+}
+
+void segment_stats_free(SegmentStats* ss) {
+  free(ss->segments);
+  free(ss->offsets);
+  free(ss->stop_time_segment);
+  free(ss->times);
+  memset(ss, 0, sizeof(*ss));
+}
+
+/**
+ * segment_stats_build()
+ *
+ * Indexes the segments, then counts the trips' running times into
+ * thread-local histograms on numThreads threads and merges them, one
+ * segment per work item.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int segment_stats_build(const Timetable* tt, SegmentStats* ss,
+                        int numThreads) {
+  memset(ss, 0, sizeof(*ss));
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > tt->num_trips && tt->num_trips > 0)
+    numThreads = tt->num_trips;
+  int ok = segment_stats_index(tt, ss);
+  size_t cells = (size_t)(ss->num_segments > 0 ? ss->num_segments : 1) *
+                 SEGMENT_HOURS;
+  if (ok) {
+    ss->times = malloc(cells / SEGMENT_HOURS * (SEGMENT_HOURS + 1) *
+                       sizeof(SegmentTimes));
+    ok = ss->times != NULL;
+  }
+  SegmentJob job;
+  job.tt = tt;
+  job.ss = ss;
+  job.num_workers = numThreads;
+  job.workers = calloc((size_t)numThreads, sizeof(SegmentWorker));
+  ok = ok && job.workers;
+  for (int k = 0; ok && k < numThreads; ++k) {
+    SegmentWorker* w = &job.workers[k];
+    w->bins = calloc(cells * SEGMENT_BINS, sizeof(int));
+    w->min = malloc(cells * sizeof(int));
+    w->max = malloc(cells * sizeof(int));
+    ok = w->bins && w->min && w->max;
+    for (size_t c = 0; ok && c < cells; ++c) {
+      w->min[c] = TIME_INFINITY;
+      w->max[c] = -1;
+    }
+  }
+  ok = ok && parallel_for(tt->num_trips, numThreads, segment_trip_task, &job) &&
+       parallel_for(ss->num_segments, numThreads, segment_merge_task, &job);
+  if (job.workers) {
+    for (int k = 0; k < numThreads; ++k) {
+      free(job.workers[k].bins);
+      free(job.workers[k].min);
+      free(job.workers[k].max);
+    }
+  }
+  free(job.workers);
+  if (!ok) segment_stats_free(ss);
+  return ok;
+}
+
+/**
+ * write_segments_csv()
+ *
+ * One row per segment and hour with departures, then one for the whole
+ * day (hour "all"). Times are in seconds.
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int write_segments_csv(const char* path, const Timetable* tt,
+                       const SegmentStats* ss) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "opening '%s': %s\n", path, strerror(errno));
+    return 0;
+  }
+  fprintf(fp, "from_stop_id,to_stop_id,hour,count,min,median,p90\n");
+  for (int s = 0; s < ss->num_segments; ++s) {
+    const char* from = tt->stops[ss->segments[s].from].stop_id;
+    const char* to = tt->stops[ss->segments[s].to].stop_id;
+    for (int h = 0; h <= SEGMENT_HOURS; ++h) {
+      const SegmentTimes* st = segment_times(ss, s, h);
+      if (st->count == 0) continue;
+      if (h < SEGMENT_HOURS) fprintf(fp, "%s,%s,%d,", from, to, h);
+      else fprintf(fp, "%s,%s,all,", from, to);
+      fprintf(fp, "%d,%d,%d,%d\n", st->count, st->min, st->median, st->p90);
+    }
+  }
+  int ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * run_segments_mode()
+ *
+ * Command line: segments [threads] [out.csv]
+ * Defaults: all logical processors, segments.csv.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_segments_mode(int argc, char** argv, const TimetableOptions* opts) {
+  int threads = argc > 0 ? atoi(argv[0]) : default_thread_count();
+  const char* csvPath = argc > 1 ? argv[1] : "segments.csv";
+  if (threads < 1) threads = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  SegmentStats ss;
+  double t0 = now_seconds();
+  int ok = segment_stats_build(&tt, &ss, threads);
+  double elapsed = now_seconds() - t0;
+  if (ok) {
+    long runs = 0, spread = 0;
+    for (int s = 0; s < ss.num_segments; ++s) {
+      const SegmentTimes* st = segment_times(&ss, s, SEGMENT_HOURS);
+      runs += st->count;
+      if (st->p90 > st->min) spread++;
+    }
+    printf("segments: %d stop pairs, %ld runs on %d threads in %.3f ms\n",
+           ss.num_segments, runs, threads, elapsed * 1000.0);
+    printf("%ld stop pairs run slower than their minimum at the 90th "
+           "percentile\n",
+           spread);
+    ok = write_segments_csv(csvPath, &tt, &ss);
+    if (ok) printf("wrote %s\n", csvPath);
+  }
+  segment_stats_free(&ss);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// LANDMARK LOWER BOUNDS
+// ============================================================================
+
+/** Number of landmark stops used for ALT lower bounds. */
+#define NUM_LANDMARKS 8
+
+/** Cache file holding the landmark distances. */
+#define LANDMARK_CACHE_FILE "landmarks.bin"
+#define LANDMARK_CACHE_VERSION 1
+
+/**
+ * Landmarks structure
+ * ALT lower bounds (A*, landmarks, triangle inequality). The timetable is
+ * reduced to a time-independent stop graph whose edges are the fastest
+ * ride between consecutive stops and the footpaths; shortest travel times
+ * from and to a few landmark stops then bound every stop-to-stop travel
+ * time from below, since |d(L,t) - d(L,v)| and |d(v,L) - d(t,L)| can never
+ * exceed d(v,t).
+ */
+typedef struct {
+  int num_landmarks;  ///< Number of landmarks
+  int* landmarks;     ///< Stop index of each landmark
+  int* dist_from;     ///< [k * num_stops + v]: shortest time landmark k -> v
+  int* dist_to;       ///< [k * num_stops + v]: shortest time v -> landmark k
+                      ///< (TIME_INFINITY where unreachable)
+} Landmarks;
+
+/** Edge of the time-independent stop graph. */
+typedef struct {
+  int from;  ///< Index of the tail stop
+  int to;    ///< Index of the head stop
+  int time;  ///< Minimum travel time in seconds
+} LbEdge;
+
+int compare_lb_edges(const void* a, const void* b) {
+  const LbEdge* x = a;
+  const LbEdge* y = b;
+  if (x->from != y->from) return x->from < y->from ? -1 : 1;
+  if (x->to != y->to) return x->to < y->to ? -1 : 1;
+  return (x->time > y->time) - (x->time < y->time);
+}
+
+/**
+ * LbGraph structure
+ * The time-independent stop graph in CSR form, forwards and backwards.
+ */
+typedef struct {
+  int* offsets;          ///< Per stop: start of its outgoing edges
+  LbEdge* edges;         ///< Edges grouped by tail stop
+  int* reverse_offsets;  ///< Per stop: start of its incoming edges
+  LbEdge* reverse;       ///< Edges with from/to swapped, grouped by head
+  int num_edges;         ///< Edges in each direction
+} LbGraph;
+
+/**
+ * lb_graph_csr()
+ *
+ * Sorts edges by tail, keeps the fastest of parallel edges and builds the
+ * offsets array.
+ *
+ * Returns:
+ *   Number of edges kept, -1 on allocation failure
+ */
+int lb_graph_csr(int numStops, LbEdge* edges, int n, int** offsets) {
+  qsort(edges, (size_t)n, sizeof(LbEdge), compare_lb_edges);
+  int kept = 0;
+  for (int i = 0; i < n; ++i)
+    if (kept == 0 || edges[kept - 1].from != edges[i].from ||
+        edges[kept - 1].to != edges[i].to)
+      edges[kept++] = edges[i];
+  *offsets = calloc((size_t)numStops + 1, sizeof(int));
+  if (!*offsets) return -1;
+  for (int i = 0; i < kept; ++i) (*offsets)[edges[i].from + 1]++;
+  for (int v = 0; v < numStops; ++v) (*offsets)[v + 1] += (*offsets)[v];
+  return kept;
+}
+
+/**
+ * lb_graph_build()
+ *
+ * Derives the time-independent stop graph from the segments' minimum
+ * running times (which cover frequency-based trips too) and the
+ * footpaths. Walking several footpaths in a row is allowed here, which
+ * only loosens the bounds.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int lb_graph_build(const Timetable* tt, const SegmentStats* ss, LbGraph* g) {
+  memset(g, 0, sizeof(*g));
+  int n = ss->num_segments + tt->footpath_offsets[tt->num_stops];
+  g->edges = malloc((size_t)(n > 0 ? n : 1) * sizeof(LbEdge));
+  g->reverse = malloc((size_t)(n > 0 ? n : 1) * sizeof(LbEdge));
+  if (!g->edges || !g->reverse) return 0;
+  int k = 0;
+  for (int i = 0; i < ss->num_segments; ++i) {
+    g->edges[k].from = ss->segments[i].from;
+    g->edges[k].to = ss->segments[i].to;
+    g->edges[k++].time = segment_times(ss, i, SEGMENT_HOURS)->min;
+  }
+  for (int v = 0; v < tt->num_stops; ++v) {
+    for (int f = tt->footpath_offsets[v]; f < tt->footpath_offsets[v + 1];
+         ++f) {
+      g->edges[k].from = v;
+      g->edges[k].to = tt->footpaths[f].to_stop;
+      g->edges[k++].time = tt->footpaths[f].walk_time;
+    }
+  }
+  g->num_edges = lb_graph_csr(tt->num_stops, g->edges, k, &g->offsets);
+  if (g->num_edges < 0) return 0;
+  for (int i = 0; i < g->num_edges; ++i) {
+    g->reverse[i].from = g->edges[i].to;
+    g->reverse[i].to = g->edges[i].from;
+    g->reverse[i].time = g->edges[i].time;
+  }
+  return lb_graph_csr(tt->num_stops, g->reverse, g->num_edges,
+                      &g->reverse_offsets) >= 0;
+}
+
+void lb_graph_free(LbGraph* g) {
+  free(g->offsets);
+  free(g->edges);
+  free(g->reverse_offsets);
+  free(g->reverse);
+  memset(g, 0, sizeof(*g));
+}
+
+/** Binary heap entry for lb_search(). */
+typedef struct {
+  int time;  ///< Tentative distance
+  int stop;  ///< Index of the stop
+} LbHeapItem;
+
+/**
+ * lb_search()
+ *
+ * Dijkstra core of lb_dijkstra() and csa_bidirectional(): settles stops in
+ * order of their time from `source` over one direction of the stop graph,
+ * with a lazy-deletion binary heap, until the heap is empty or its
+ * smallest entry reaches `radius`. Every stop whose time is below the
+ * radius is then exact in dist; larger entries are only tentative.
+ *
+ * Parameters:
+ *   offsets - CSR offsets of the direction to search
+ *   edges   - CSR edges of that direction
+ *   heap    - Working space of num_edges + 1 entries
+ *   source  - Index of the source stop
+ *   radius  - Time at which to stop, TIME_INFINITY for the whole graph
+ *   dist    - In: TIME_INFINITY for every stop; out: times from source
+ *
+ * Returns:
+ *   Number of stops settled
+ */
+int lb_search(const int* offsets, const LbEdge* edges, LbHeapItem* heap,
+              int source, int radius, int* dist) {
+  int settled = 0;
+  dist[source] = 0;
+  int len = 0;
+  heap[len].time = 0;
+  heap[len++].stop = source;
+  while (len > 0 && heap[0].time < radius) {
+    LbHeapItem top = heap[0];
+    LbHeapItem last = heap[--len];
+    int i = 0;
+    for (int child = 1; child < len; child = 2 * i + 1) {
+      if (child + 1 < len && heap[child + 1].time < heap[child].time) child++;
+      if (heap[child].time >= last.time) break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    heap[i] = last;
+    if (top.time > dist[top.stop]) continue;
+    settled++;
+
+    for (int e = offsets[top.stop]; e < offsets[top.stop + 1]; ++e) {
+      int v = edges[e].to;
+      int t = top.time + edges[e].time;
+      if (t >= dist[v]) continue;
+      dist[v] = t;
+      int j = len++;
+      while (j > 0 && heap[(j - 1) / 2].time > t) {
+        heap[j] = heap[(j - 1) / 2];
+        j = (j - 1) / 2;
+      }
+      heap[j].time = t;
+      heap[j].stop = v;
+    }
+  }
+  return settled;
+}
+
+/**
+ * lb_dijkstra()
+ *
+ * Shortest travel times from `source` over one direction of the stop
+ * graph (lb_search() over the whole graph).
+ *
+ * Parameters:
+ *   numStops - Number of stops
+ *   offsets  - CSR offsets of the direction to search
+ *   edges    - CSR edges of that direction
+ *   numEdges - Number of edges
+ *   source   - Index of the source stop
+ *   dist     - Output, numStops entries (TIME_INFINITY where unreachable)
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int lb_dijkstra(int numStops, const int* offsets, const LbEdge* edges,
+                int numEdges, int source, int* dist) {
+  // Every push follows an edge relaxation, so numEdges + 1 entries suffice
+  LbHeapItem* heap = malloc((size_t)(numEdges + 1) * sizeof(LbHeapItem));
+  if (!heap) return 0;
+  for (int v = 0; v < numStops; ++v) dist[v] = TIME_INFINITY;
+  lb_search(offsets, edges, heap, source, TIME_INFINITY, dist);
+  free(heap);
+  return 1;
+}
+
+/**
+ * select_landmarks()
+ *
+ * Farthest-point selection on stop coordinates: starts with the stop
+ * farthest from the centroid, then repeatedly adds the stop farthest from
+ * all landmarks chosen so far, which spreads landmarks around the edge of
+ * the network where they give the tightest bounds.
+ *
+ * Returns:
+ *   Number of landmarks written to out (at most max)
+ */
+int select_landmarks(const Timetable* tt, int max, int* out) {
+  int n = tt->num_stops;
+  if (n == 0) return 0;
+  double* nearest = malloc((size_t)n * sizeof(double));
+  double* dist = malloc((size_t)n * sizeof(double));
+  GeoPoints pts;
+  if (!geo_points_init(&pts, n) || !nearest || !dist) {
+    free(nearest);
+    free(dist);
+    geo_points_free(&pts);
+    return 0;
+  }
+  double lat = 0, lon = 0;
+  for (int v = 0; v < n; ++v) {
+    geo_points_set(&pts, v, tt->stops[v].stop_lat, tt->stops[v].stop_lon);
+    lat += tt->stops[v].stop_lat;
+    lon += tt->stops[v].stop_lon;
+  }
+  geo_distances_m(lat / n, lon / n, &pts, 0, n, nearest);
+
+  int count = 0;
+  while (count < max && count < n) {
+    int far = 0;
+    for (int v = 1; v < n; ++v)
+      if (nearest[v] > nearest[far]) far = v;
+    out[count++] = far;
+    geo_distances_m(tt->stops[far].stop_lat, tt->stops[far].stop_lon, &pts,
+                    0, n, dist);
+    for (int v = 0; v < n; ++v)
+      if (count == 1 || dist[v] < nearest[v]) nearest[v] = dist[v];
+  }
+  free(nearest);
+  free(dist);
+  geo_points_free(&pts);
+  return count;
+}
+
+/** Shared state of the parallel landmark preprocessing. */
+typedef struct {
+  const Timetable* tt;
+  const LbGraph* graph;
+  Landmarks* lm;
+  int failed;  ///< Set if a search ran out of memory
+} LandmarkJob;
+
+/**
+ * landmark_task()
+ *
+ * Parallel task: item k < num_landmarks searches forwards from landmark k,
+ * item num_landmarks + k backwards to it.
+ */
+void landmark_task(void* ctx, int worker, int item) {
+  (void)worker;
+  LandmarkJob* job = ctx;
+  const LbGraph* g = job->graph;
+  int n = job->tt->num_stops;
+  int k = item % job->lm->num_landmarks;
+  int forward = item < job->lm->num_landmarks;
+  int* dist = (forward ? job->lm->dist_from : job->lm->dist_to) + (size_t)k * n;
+  if (!lb_dijkstra(n, forward ? g->offsets : g->reverse_offsets,
+                   forward ? g->edges : g->reverse, g->num_edges,
+                   job->lm->landmarks[k], dist))
+    job->failed = 1;
+}
+
+/**
+ * landmarks_build()
+ *
+ * Selects landmarks and runs the 2 x NUM_LANDMARKS shortest-path searches
+ * on numThreads threads.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int landmarks_build(const Timetable* tt, Landmarks* lm, int numThreads) {
+  size_t cells =
+      (size_t)NUM_LANDMARKS * (tt->num_stops > 0 ? tt->num_stops : 1);
+  lm->landmarks = malloc(NUM_LANDMARKS * sizeof(int));
+  lm->dist_from = malloc(cells * sizeof(int));
+  lm->dist_to = malloc(cells * sizeof(int));
+  if (!lm->landmarks || !lm->dist_from || !lm->dist_to) return 0;
+  lm->num_landmarks = select_landmarks(tt, NUM_LANDMARKS, lm->landmarks);
+
+  LbGraph g;
+  SegmentStats ss;
+  int ok = segment_stats_build(tt, &ss, numThreads);
+  ok = lb_graph_build(tt, &ss, &g) && ok;
+  segment_stats_free(&ss);
+  if (ok) {
+    LandmarkJob job;
+    job.tt = tt;
+    job.graph = &g;
+    job.lm = lm;
+    job.failed = 0;
+    ok = parallel_for(2 * lm->num_landmarks, numThreads, landmark_task, &job) &&
+         !job.failed;
+  }
+  lb_graph_free(&g);
+  return ok;
+}
+
+/**
+ * landmarks_save()
+ *
+ * Persists the landmark distances next to the dataset (see
+ * open_cache_file()).
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int landmarks_save(const Timetable* tt, const Landmarks* lm) {
+  FILE* fp = open_cache_file(tt, LANDMARK_CACHE_FILE, "GECL",
+                             LANDMARK_CACHE_VERSION, 1);
+  if (!fp) return 0;
+  size_t cells = (size_t)lm->num_landmarks * tt->num_stops;
+  int32_t counts[2] = {lm->num_landmarks, tt->num_stops};
+  int ok = fwrite(counts, sizeof(counts), 1, fp) == 1 &&
+           fwrite(lm->landmarks, sizeof(int), (size_t)lm->num_landmarks,
+                  fp) == (size_t)lm->num_landmarks &&
+           fwrite(lm->dist_from, sizeof(int), cells, fp) == cells &&
+           fwrite(lm->dist_to, sizeof(int), cells, fp) == cells;
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * landmarks_load()
+ *
+ * Loads the distances saved by landmarks_save(), if they match the loaded
+ * timetable.
+ *
+ * Returns:
+ *   1 if loaded, 0 if missing, stale or unreadable
+ */
+int landmarks_load(const Timetable* tt, Landmarks* lm) {
+  FILE* fp = open_cache_file(tt, LANDMARK_CACHE_FILE, "GECL",
+                             LANDMARK_CACHE_VERSION, 0);
+  if (!fp) return 0;
+  int32_t counts[2];
+  int ok = fread(counts, sizeof(counts), 1, fp) == 1 && counts[0] >= 0 &&
+           counts[0] <= NUM_LANDMARKS && counts[1] == tt->num_stops;
+  if (ok) {
+    size_t cells = (size_t)counts[0] * tt->num_stops;
+    lm->num_landmarks = counts[0];
+    lm->landmarks = malloc(NUM_LANDMARKS * sizeof(int));
+    lm->dist_from = malloc((cells > 0 ? cells : 1) * sizeof(int));
+    lm->dist_to = malloc((cells > 0 ? cells : 1) * sizeof(int));
+    ok = lm->landmarks && lm->dist_from && lm->dist_to &&
+         fread(lm->landmarks, sizeof(int), (size_t)counts[0], fp) ==
+             (size_t)counts[0] &&
+         fread(lm->dist_from, sizeof(int), cells, fp) == cells &&
+         fread(lm->dist_to, sizeof(int), cells, fp) == cells;
+  }
+  fclose(fp);
+  return ok;
+}
+
+void landmarks_free(Landmarks* lm) {
+  free(lm->landmarks);
+  free(lm->dist_from);
+  free(lm->dist_to);
+  memset(lm, 0, sizeof(*lm));
+}
+
+/**
+ * landmarks_load_or_build()
+ *
+ * Loads the saved landmark distances, or computes (in parallel) and saves
+ * them when no valid cache exists.
+ *
+ * Parameters:
+ *   tt         - Loaded timetable
+ *   lm         - Landmarks to fill
+ *   numThreads - Threads for preprocessing
+ *   rebuild    - Nonzero to ignore any saved distances
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int landmarks_load_or_build(const Timetable* tt, Landmarks* lm, int numThreads,
+                            int rebuild) {
+  memset(lm, 0, sizeof(*lm));
+  if (!rebuild && landmarks_load(tt, lm)) return 1;
+  landmarks_free(lm);
+
+  double t0 = now_seconds();
+  if (!landmarks_build(tt, lm, numThreads)) return 0;
+  printf("landmarks: %d landmarks preprocessed in %.3f s on %d threads\n",
+         lm->num_landmarks, now_seconds() - t0, numThreads);
+  if (!landmarks_save(tt, lm))
+    fprintf(stderr, "could not save %s\n", LANDMARK_CACHE_FILE);
+  return 1;
+}
+
+/**
+ * landmark_bounds()
+ *
+ * Fills the per-stop bound array used to prune one query:
+ *   max over landmarks L of d(L,to) - d(L,from) and d(from,L) - d(to,L),
+ * both of which the triangle inequality keeps below d(from,to). Distances
+ * are TIME_INFINITY where unreachable, so the differences cannot overflow
+ * and need no special cases: a stop that provably cannot reach the other
+ * end gets a bound close to TIME_INFINITY, which prunes it outright.
+ *
+ * Parameters:
+ *   tt     - Loaded timetable
+ *   lm     - Landmarks
+ *   stop   - The query's fixed end
+ *   toStop - Nonzero: out[v] bounds the time from v to `stop` (forward
+ *            queries); zero: from `stop` to v (reverse queries)
+ *   out    - Output, num_stops entries
+ */
+void landmark_bounds(const Timetable* tt, const Landmarks* lm, int stop,
+                     int toStop, int* out) {
+  int n = tt->num_stops;
+  for (int v = 0; v < n; ++v) out[v] = 0;
+  // Landmark-major loops over contiguous rows, so they vectorize
+  for (int k = 0; k < lm->num_landmarks; ++k) {
+    const int* df = lm->dist_from + (size_t)k * n;
+    const int* dt = lm->dist_to + (size_t)k * n;
+    int fs = df[stop], ts = dt[stop];
+    for (int v = 0; v < n; ++v) {
+      int a = toStop ? fs - df[v] : df[v] - fs;
+      int b = toStop ? dt[v] - ts : ts - dt[v];
+      int m = a > b ? a : b;
+      if (m > out[v]) out[v] = m;
+    }
+  }
+}
+
+// ============================================================================
+// BIDIRECTIONAL SEARCH
+// ============================================================================
+
+/**
+ * BidiScratch structure
+ * Per-thread working memory of csa_bidirectional(): the forward scan's
+ * labels plus the backward search over the time-independent stop graph.
+ */
+typedef struct {
+  CsaScratch csa;        ///< Labels of the forward scan
+  const LbGraph* graph;  ///< Stop graph searched backwards (shared)
+  int* bound;            ///< Per stop: lower bound on the time to target
+  LbHeapItem* heap;      ///< Heap of the backward search
+  int settled;           ///< Stops settled by the last backward search
+} BidiScratch;
+
+int bidi_scratch_init(BidiScratch* s, const Timetable* tt,
+                      const LbGraph* g) {
+  int ok = csa_scratch_init(&s->csa, tt);
+  s->graph = g;
+  s->bound = malloc((size_t)(tt->num_stops > 0 ? tt->num_stops : 1) *
+                    sizeof(int));
+  s->heap = malloc((size_t)(g->num_edges + 1) * sizeof(LbHeapItem));
+  s->settled = 0;
+  return ok && s->bound && s->heap;
+}
+
+void bidi_scratch_free(BidiScratch* s) {
+  csa_scratch_free(&s->csa);
+  free(s->bound);
+  free(s->heap);
+}
+
+/**
+ * bidi_backward()
+ *
+ * Backward half of csa_bidirectional(): shortest times to `target` on the
+ * stop graph, for stops closer than `radius`. Every other stop gets the
+ * radius itself, which is still a lower bound on its time.
+ */
+void bidi_backward(const Timetable* tt, BidiScratch* s, int target,
+                   int radius) {
+  const LbGraph* g = s->graph;
+  int* bound = s->bound;
+  for (int v = 0; v < tt->num_stops; ++v) bound[v] = TIME_INFINITY;
+  s->settled = lb_search(g->reverse_offsets, g->reverse, s->heap, target,
+                         radius, bound);
+  for (int v = 0; v < tt->num_stops; ++v)
+    if (bound[v] > radius) bound[v] = radius;
+}
+
+/**
+ * csa_bidirectional()
+ *
+ * Point-to-point earliest-arrival query that meets in the middle. The
+ * forward connection scan runs as in csa_earliest_arrival() until it
+ * first reaches the target. Every connection scanned after that departs
+ * no earlier than the one that got there, so only stops less than the
+ * remaining time (target label minus that departure) from the target can
+ * still matter. A backward Dijkstra from the target over the
+ * time-independent stop graph (lb_graph_build()) settles exactly those,
+ * and the rest of the scan drops arrivals that cannot beat the target's
+ * label even at the lower-bound times; stops the backward search never
+ * reached are dropped outright.
+ *
+ * Unlike landmark bounds (landmark_bounds()) nothing is precomputed, and
+ * the backward search only covers the part of the network the answer can
+ * use. Journeys are extracted from s->csa with csa_extract_journey(); the
+ * time limit works as in csa_earliest_arrival().
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   s        - Scratch owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   day      - Trips the query may ride (timetable_service_day())
+ *   target   - Index of the destination stop
+ *
+ * Returns:
+ *   Earliest arrival at the target, TIME_INFINITY if unreachable
+ */
+int csa_bidirectional(const Timetable* tt, BidiScratch* s, int origin,
+                      int dep_time, const ServiceDay* day, int target) {
+  CsaScratch* cs = &s->csa;
+  int* arrival = cs->arrival;
+  int* ride = cs->ride_label;
+  unsigned char* reached = cs->trip_reached;
+  const int* bound = NULL;
+  for (int i = 0; i < tt->num_stops; ++i) arrival[i] = ride[i] = TIME_INFINITY;
+  memset(reached, 0, (size_t)tt->num_trips * 2);
+  cs->partial = 0;
+  s->settled = 0;
+  arrival[origin] = dep_time;
+  cs->walk_stop[origin] = -1;
+  relax_footpaths(tt, arrival, cs->walk_stop, origin, dep_time);
+  if (arrival[target] != TIME_INFINITY) {
+    bidi_backward(tt, s, target, arrival[target] - dep_time);
+    bound = s->bound;
+  }
+
+  CsaCursor cur;
+  CsaRun run;
+  csa_cursor_init(&cur, tt, day, 0, dep_time);
+  csa_cursor_add_frequencies(&cur, &cs->freq, dep_time);
+  while (csa_cursor_next_run(&cur, &run)) {
+    if (run.frequencies) {
+      // Every overflow is followed by a run of the stream it happened in
+      if (cs->freq.overflow || time_limit_reached(cs->time_limit)) {
+        cs->partial = 1;
+        return arrival[target];
+      }
+      if (!csa_scan_frequencies(tt, cs, target, bound)) return arrival[target];
+      // Every later connection departs no earlier than this run's first
+      if (!bound && arrival[target] != TIME_INFINITY) {
+        bidi_backward(tt, s, target,
+                      arrival[target] - cs->freq.buffer[0].dep_time);
+        bound = s->bound;
+      }
+      continue;
+    }
+    const uint32_t* active = run.active;
+    int shift = run.shift, instOffset = run.instance_offset;
+    int idOffset = run.id_offset;
+    int i = run.begin;
+    while (i < run.end) {
+      if (time_limit_reached(cs->time_limit)) {
+        cs->partial = 1;
+        return arrival[target];
+      }
+      int chunkEnd = run.end - i > TIME_LIMIT_CHECK_INTERVAL
+                         ? i + TIME_LIMIT_CHECK_INTERVAL
+                         : run.end;
+      for (; i < chunkEnd; ++i) {
+        const Connection* c = &tt->connections[i];
+        if (c->dep_time - shift >= arrival[target]) return arrival[target];
+        if (!TRIP_ACTIVE(active, c->trip)) continue;
+        int inst = c->trip + instOffset;
+        int arr = c->arr_time - shift;
+        if (reached[inst] || arrival[c->dep_stop] <= c->dep_time - shift) {
+          if (!reached[inst]) {
+            reached[inst] = 1;
+            cs->trip_conn[inst] = i + idOffset;
+            int prev = tt->trips[c->trip].block_prev;
+            if (prev >= 0 && reached[prev + instOffset])
+              cs->trip_conn[inst] = cs->trip_conn[prev + instOffset];
+          }
+          if (bound && arr >= arrival[target] - bound[c->arr_stop]) continue;
+          if (arr < ride[c->arr_stop]) {
+            ride[c->arr_stop] = arr;
+            cs->enter_conn[c->arr_stop] = cs->trip_conn[inst];
+            cs->exit_conn[c->arr_stop] = i + idOffset;
+            if (arr < arrival[c->arr_stop]) {
+              arrival[c->arr_stop] = arr;
+              cs->walk_stop[c->arr_stop] = -1;
+            }
+            relax_footpaths(tt, arrival, cs->walk_stop, c->arr_stop, arr);
+            // The searches meet. Later connections depart no earlier than
+            // this one, so only stops closer to the target than the time
+            // left from here can still improve it
+            if (!bound && arrival[target] != TIME_INFINITY) {
+              bidi_backward(tt, s, target,
+                            arrival[target] - (c->dep_time - shift));
+              bound = s->bound;
+            }
+          }
+        }
+      }
+    }
+  }
+  return arrival[target];
+}
+
+// ============================================================================
+// TRAVEL-TIME MATRIX
+// ============================================================================
+
+/**
+ * Matrix cell value for "destination not reachable". Travel times do not
+ * fit below it from about 18 hours (0xFFFF seconds) on; those count as
+ * unreachable too rather than being clamped to a plausible value.
+ */
+#define MATRIX_UNREACHABLE 0xFFFF
+
+/**
+ * MatrixJob structure
+ * Shared, read-mostly state for computing a stop x stop travel-time matrix.
+ * Each worker writes only its own rows of `cells`.
+ */
+typedef struct {
+  const Timetable* tt;   ///< Loaded timetable
+  CsaScratch* scratch;   ///< One scratch per worker
+  int departure_time;    ///< Departure time for every origin, in seconds
+  ServiceDay day;        ///< Trips the queries may ride
+  uint16_t* cells;       ///< num_stops x num_stops, row-major by origin
+} MatrixJob;
+
+void matrix_row_task(void* ctx, int worker, int origin) {
+  MatrixJob* job = ctx;
+  const Timetable* tt = job->tt;
+  CsaScratch* s = &job->scratch[worker];
+  csa_one_to_all(tt, s, origin, job->departure_time, &job->day);
+
+  uint16_t* row = job->cells + (size_t)origin * tt->num_stops;
+  for (int d = 0; d < tt->num_stops; ++d) {
+    int a = s->arrival[d];
+    int travel = a - job->departure_time;
+    row[d] = a == TIME_INFINITY || travel >= MATRIX_UNREACHABLE
+                 ? MATRIX_UNREACHABLE
+                 : (uint16_t)travel;
+  }
+}
+
+/**
+ * compute_travel_time_matrix()
+ *
+ * Fills `cells` (preallocated, num_stops^2 entries) with travel times in
+ * seconds from every stop to every stop, departing at `departure_time` and
+ * riding only the trips of `day`. Origins are sharded across a
+ * work-stealing thread pool.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int compute_travel_time_matrix(const Timetable* tt, int departure_time,
+                               const ServiceDay* day, int numThreads,
+                               uint16_t* cells) {
+  MatrixJob job;
+  job.tt = tt;
+  job.departure_time = departure_time;
+  job.day = *day;
+  job.cells = cells;
+  job.scratch = calloc((size_t)numThreads, sizeof(CsaScratch));
+  if (!job.scratch) return 0;
+
+  int ok = 1;
+  for (int w = 0; w < numThreads && ok; ++w)
+    ok = csa_scratch_init(&job.scratch[w], tt);
+  if (ok) ok = parallel_for(tt->num_stops, numThreads, matrix_row_task, &job);
+
+  for (int w = 0; w < numThreads; ++w) csa_scratch_free(&job.scratch[w]);
+  free(job.scratch);
+  return ok;
+}
+
+/**
+ * write_matrix_binary()
+ *
+ * Writes the matrix in a compact little-endian binary layout:
+ *   "GECM" magic, uint32 version (1), uint32 num_stops,
+ *   int32 departure_time, then num_stops NUL-terminated stop_ids (row and
+ *   column order), then num_stops^2 uint16 travel times in seconds
+ *   (0xFFFF = unreachable, or 0xFFFF seconds or more away).
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int write_matrix_binary(const char* path, const Timetable* tt,
+                        int departure_time, const uint16_t* cells) {
+  FILE* fp = fopen(path, "wb");
+  if (!fp) {
+    fprintf(stderr, "opening '%s': %s\n", path, strerror(errno));
+    return 0;
+  }
+  uint32_t header[2] = {1, (uint32_t)tt->num_stops};
+  int32_t dep = departure_time;
+  fwrite("GECM", 1, 4, fp);
+  fwrite(header, sizeof(header), 1, fp);
+  fwrite(&dep, sizeof(dep), 1, fp);
+  for (int i = 0; i < tt->num_stops; ++i)
+    fwrite(tt->stops[i].stop_id, 1, strlen(tt->stops[i].stop_id) + 1, fp);
+  size_t n = (size_t)tt->num_stops * tt->num_stops;
+  size_t written = fwrite(cells, sizeof(uint16_t), n, fp);
+  int ok = (written == n) && !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * write_matrix_csv()
+ *
+ * Writes the matrix as CSV: a header row of destination stop_ids, then one
+ * row per origin with travel times in seconds (empty = unreachable, or
+ * 0xFFFF seconds or more away).
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int write_matrix_csv(const char* path, const Timetable* tt,
+                     const uint16_t* cells) {
+  FILE* fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "opening '%s': %s\n", path, strerror(errno));
+    return 0;
+  }
+  fprintf(fp, "origin");
+  for (int d = 0; d < tt->num_stops; ++d)
+    fprintf(fp, ",%s", tt->stops[d].stop_id);
+  fputc('\n', fp);
+  for (int o = 0; o < tt->num_stops; ++o) {
+    const uint16_t* row = cells + (size_t)o * tt->num_stops;
+    fputs(tt->stops[o].stop_id, fp);
+    for (int d = 0; d < tt->num_stops; ++d) {
+      if (row[d] == MATRIX_UNREACHABLE)
+        fputc(',', fp);
+      else
+        fprintf(fp, ",%u", (unsigned)row[d]);
+    }
+    fputc('\n', fp);
+  }
+  int ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * run_matrix_mode()
+ *
+ * Command line: matrix [HH:MM:SS] [threads] [out.bin] [out.csv]
+ * Defaults: 08:00:00, all logical processors, matrix.bin, matrix.csv.
+ * Destinations 0xFFFF seconds (about 18 hours) or more away are written
+ * as unreachable.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_matrix_mode(int argc, char** argv, const TimetableOptions* opts) {
+  int departure = parse_gtfs_time(argc > 0 ? argv[0] : "08:00:00");
+  int threads = argc > 1 ? atoi(argv[1]) : default_thread_count();
+  const char* binPath = argc > 2 ? argv[2] : "matrix.bin";
+  const char* csvPath = argc > 3 ? argv[3] : "matrix.csv";
+  if (departure < 0) {
+    fprintf(stderr, "invalid departure time '%s'\n", argv[0]);
+    return 1;
+  }
+  if (threads < 1) threads = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+
+  size_t n = (size_t)tt.num_stops * tt.num_stops;
+  uint16_t* cells = malloc(n * sizeof(uint16_t));
+  if (!cells) {
+    free_timetable(&tt);
+    return 1;
+  }
+
+  double t0 = now_seconds();
+  ServiceDay day;
+  int ok = timetable_query_day(&tt, opts, &day) &&
+           compute_travel_time_matrix(&tt, departure, &day, threads, cells);
+  double elapsed = now_seconds() - t0;
+  service_day_free(&day);
+  if (ok) {
+    printf("matrix: %d x %d stops on %d threads in %.3f s (%.0f origins/s)\n",
+           tt.num_stops, tt.num_stops, threads, elapsed,
+           elapsed > 0 ? tt.num_stops / elapsed : 0.0);
+    ok = write_matrix_binary(binPath, &tt, departure, cells) &&
+         write_matrix_csv(csvPath, &tt, cells);
+    if (ok) printf("wrote %s and %s\n", binPath, csvPath);
+  }
+
+  free(cells);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// ROUTE QUERIES
+// ============================================================================
+
+/**
+ * find_stop_index()
+ *
+ * Resolves user input to a stop: exact stop_id first, then exact name,
+ * then name substring (names compared case-insensitively).
+ *
+ * Returns:
+ *   Index of the stop, or -1 if nothing matches
+ */
+int find_stop_index(const Timetable* tt, const char* query) {
+  int idx = id_index_get(&tt->stop_index, query);
+  if (idx >= 0) return idx;
+
+  char qlower[512];
+  char nameLower[512];
+  str_to_lower_copy(query, qlower, sizeof(qlower));
+  int partial = -1;
+  for (int i = 0; i < tt->num_stops; ++i) {
+    str_to_lower_copy(tt->stops[i].stop_name, nameLower, sizeof(nameLower));
+    if (strcmp(nameLower, qlower) == 0) return i;
+    if (partial < 0 && strstr(nameLower, qlower) != NULL) partial = i;
+  }
+  return partial;
+}
+
+/**
+ * journey_merge_seated()
+ *
+ * Joins consecutive vehicle legs where the second trip continues the first
+ * one's block at the same stop, so staying seated is not shown as a
+ * transfer.
+ */
+void journey_merge_seated(const Timetable* tt, Journey* j) {
+  int out = 0;
+  for (int i = 0; i < j->num_legs; ++i) {
+    JourneyLeg* prev = out > 0 ? &j->legs[out - 1] : NULL;
+    const JourneyLeg* leg = &j->legs[i];
+    if (prev && prev->trip >= 0 && leg->trip >= 0 &&
+        tt->trips[prev->last_trip].block_next == leg->trip &&
+        prev->to_stop == leg->from_stop) {
+      prev->last_trip = leg->last_trip;
+      prev->to_stop = leg->to_stop;
+      prev->arr_time = leg->arr_time;
+      continue;
+    }
+    j->legs[out++] = *leg;
+  }
+  j->num_legs = out;
+}
+
+/**
+ * LegRides structure
+ * Iterator over the stop-time ranges of a vehicle leg: one per trip ridden,
+ * several when the rider stays seated through a block (see
+ * leg_rides_init()).
+ */
+typedef struct {
+  int trip;   ///< Trip of the next range, -1 when done
+  int from;   ///< First stop time of the next range
+  int shift;  ///< Leg times minus stop times: the overnight day or, for
+              ///< frequency-based trips, the instance's start
+} LegRides;
+
+/**
+ * leg_rides_init()
+ *
+ * Finds the leg's boarding stop time, matched by stop and time so that
+ * loops visiting a stop twice start from the right visit.
+ *
+ * Returns:
+ *   1 if found, 0 otherwise (a walking leg, or no such stop time)
+ */
+int leg_rides_init(const Timetable* tt, const JourneyLeg* leg, LegRides* it) {
+  it->trip = -1;
+  if (leg->trip < 0) return 0;
+  const Trip* t = &tt->trips[leg->trip];
+  const StopTime* st = &tt->stop_times[t->first_stop_time];
+  for (int k = 0; k < t->num_stop_times; ++k) {
+    int off = leg->dep_time - st[k].departure_time;
+    if (st[k].stop == leg->from_stop &&
+        (off == 0 || off == -SECONDS_PER_DAY || t->frequency >= 0)) {
+      it->trip = leg->trip;
+      it->from = t->first_stop_time + k;
+      it->shift = off;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * leg_rides_next()
+ *
+ * Returns:
+ *   1 with the next range [*from, *to] of stop times (indices into
+ *   tt->stop_times, one trip), 0 when the leg is done
+ */
+int leg_rides_next(const Timetable* tt, const JourneyLeg* leg, LegRides* it,
+                   int* from, int* to) {
+  if (it->trip < 0) return 0;
+  const Trip* tr = &tt->trips[it->trip];
+  int last = tr->first_stop_time + tr->num_stop_times - 1;
+  *from = it->from;
+  if (it->trip == leg->last_trip) {
+    int end = -1;
+    for (int i = it->from + 1; i <= last && end < 0; ++i)
+      if (tt->stop_times[i].stop == leg->to_stop &&
+          tt->stop_times[i].arrival_time + it->shift == leg->arr_time)
+        end = i;
+    for (int i = it->from + 1; i <= last && end < 0; ++i)
+      if (tt->stop_times[i].stop == leg->to_stop) end = i;
+    it->trip = -1;
+    if (end < 0) return 0;
+    *to = end;
+    return 1;
+  }
+  *to = last;
+  it->trip = tr->block_next;
+  if (it->trip >= 0) it->from = tt->trips[it->trip].first_stop_time;
+  return 1;
+}
+
+/**
+ * journey_leg_length_m()
+ *
+ * Distance covered by one leg: walks in a straight line, rides along the
+ * shapes of every trip ridden, read from the stops' anchors (see
+ * build_shape_anchors()).
+ *
+ * Returns:
+ *   Length in metres
+ */
+double journey_leg_length_m(const Timetable* tt, const JourneyLeg* leg) {
+  const Stop* a = &tt->stops[leg->from_stop];
+  const Stop* b = &tt->stops[leg->to_stop];
+  if (leg->trip < 0)
+    return haversine_m(a->stop_lat, a->stop_lon, b->stop_lat, b->stop_lon);
+  LegRides it;
+  int from, to;
+  double total = 0.0;
+  leg_rides_init(tt, leg, &it);
+  while (leg_rides_next(tt, leg, &it, &from, &to))
+    total += tt->shape_anchors[to].dist_m - tt->shape_anchors[from].dist_m;
+  return total;
+}
+
+/**
+ * journey_geometry()
+ *
+ * Appends the path of a journey to an encoder: rides follow their trips'
+ * shapes between the stops' anchors (stop to stop without a shape), walks
+ * go straight from stop to stop.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int journey_geometry(const Timetable* tt, const Journey* j, GeomEncoder* e) {
+  for (int i = 0; i < j->num_legs; ++i) {
+    const JourneyLeg* leg = &j->legs[i];
+    const Stop* a = &tt->stops[leg->from_stop];
+    const Stop* b = &tt->stops[leg->to_stop];
+    LegRides it;
+    int from, to, first, end;
+    if (!leg_rides_init(tt, leg, &it)) {
+      if (!geom_point(e, a->stop_lat, a->stop_lon) ||
+          !geom_point(e, b->stop_lat, b->stop_lon))
+        return 0;
+      continue;
+    }
+    while (leg_rides_next(tt, leg, &it, &from, &to)) {
+      const ShapeAnchor* anchors = tt->shape_anchors;
+      if (ride_shape(tt, from, to, &first, &end)) {
+        if (!geom_point(e, anchors[from].lat, anchors[from].lon) ||
+            !geom_range(e, tt, first, end) ||
+            !geom_point(e, anchors[to].lat, anchors[to].lon))
+          return 0;
+      } else {
+        // Without a shape the anchors are the stops themselves
+        for (int k = from; k <= to; ++k)
+          if (!geom_point(e, anchors[k].lat, anchors[k].lon)) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * print_journey()
+ *
+ * Prints one line per leg: times, stops and the trip ridden, then the
+ * distance travelled and the time spent riding (from the stop times),
+ * walking and waiting between legs.
+ */
+void print_journey(const Timetable* tt, const Journey* j) {
+  double ride = 0.0, walk = 0.0;
+  int rideTime = 0, walkTime = 0, waitTime = 0;
+  char dep[16], arr[16];
+  for (int i = 0; i < j->num_legs; ++i) {
+    const JourneyLeg* leg = &j->legs[i];
+    format_gtfs_time(leg->dep_time, dep, sizeof(dep));
+    format_gtfs_time(leg->arr_time, arr, sizeof(arr));
+    printf("  %s  %s (%s)\n", dep, tt->stops[leg->from_stop].stop_name,
+           tt->stops[leg->from_stop].stop_id);
+    if (leg->trip < 0) {
+      printf("            walk %d min\n",
+             (leg->arr_time - leg->dep_time + 59) / 60);
+    } else {
+      const Trip* trip = &tt->trips[leg->trip];
+      printf("            trip %s to %s\n", trip->trip_id,
+             trip->trip_headsign);
+      // Later trips of the block the rider stays seated through
+      for (int t = leg->trip; t >= 0 && t != leg->last_trip;) {
+        t = tt->trips[t].block_next;
+        if (t >= 0)
+          printf("            stay on as trip %s to %s\n",
+                 tt->trips[t].trip_id, tt->trips[t].trip_headsign);
+      }
+    }
+    printf("  %s  %s (%s)\n", arr, tt->stops[leg->to_stop].stop_name,
+           tt->stops[leg->to_stop].stop_id);
+    if (leg->trip < 0) {
+      walk += journey_leg_length_m(tt, leg);
+      walkTime += leg->arr_time - leg->dep_time;
+    } else {
+      ride += journey_leg_length_m(tt, leg);
+      rideTime += leg->arr_time - leg->dep_time;
+    }
+    if (i > 0) waitTime += leg->dep_time - j->legs[i - 1].arr_time;
+  }
+  if (j->num_legs > 0) {
+    printf("  distance: %.1f km (%.1f km walking)\n",
+           (ride + walk) / 1000.0, walk / 1000.0);
+    printf("  time: %.1f min (%.1f riding, %.1f walking, %.1f waiting)\n",
+           (rideTime + walkTime + waitTime) / 60.0, rideTime / 60.0,
+           walkTime / 60.0, waitTime / 60.0);
+  }
+}
+
+/**
+ * run_route_mode()
+ *
+ * Command lines:
+ *   route <from> <to> [HH:MM:SS]     earliest arrival departing at the time
+ *   arriveby <from> <to> <HH:MM:SS>  latest departure arriving by the time
+ * Stops may be given by stop_id or name.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_route_mode(int argc, char** argv, int arriveBy,
+                   const TimetableOptions* opts) {
+  if (argc < 2 || (arriveBy && argc < 3)) {
+    fprintf(stderr, "usage: %s <from> <to> %s\n",
+            arriveBy ? "arriveby" : "route",
+            arriveBy ? "<HH:MM:SS>" : "[HH:MM:SS]");
+    return 1;
+  }
+  int time = parse_gtfs_time(argc > 2 ? argv[2] : "08:00:00");
+  if (time < 0) {
+    fprintf(stderr, "invalid time '%s'\n", argv[2]);
+    return 1;
+  }
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  int origin = find_stop_index(&tt, argv[0]);
+  int target = find_stop_index(&tt, argv[1]);
+  if (origin < 0 || target < 0) {
+    printf("No matching stop found for '%s'.\n",
+           origin < 0 ? argv[0] : argv[1]);
+    free_timetable(&tt);
+    return 1;
+  }
+
+  CsaScratch s;
+  ServiceDay day;
+  if (!csa_scratch_init(&s, &tt) || !timetable_query_day(&tt, opts, &day)) {
+    csa_scratch_free(&s);
+    free_timetable(&tt);
+    return 1;
+  }
+  Journey j;
+  double t0 = now_seconds();
+  int found;
+  s.time_limit = query_time_limit(opts);
+  // Landmark bounds do not pay off for the scan (see run_alt_bench_mode())
+  if (arriveBy) {
+    csa_latest_departure(&tt, &s, target, time, &day, origin, NULL);
+    found = csa_extract_reverse_journey(&tt, &s, origin, target, &j);
+  } else {
+    csa_earliest_arrival(&tt, &s, origin, time, &day, target, NULL);
+    found = csa_extract_journey(&tt, &s, origin, target, &j);
+  }
+  double elapsed = now_seconds() - t0;
+
+  printf("From: %s (%s)\nTo:   %s (%s)\n", tt.stops[origin].stop_name,
+         tt.stops[origin].stop_id, tt.stops[target].stop_name,
+         tt.stops[target].stop_id);
+  if (found) {
+    print_journey(&tt, &j);
+    // Path for a web map, as an encoded polyline
+    ByteBuffer buf = {0};
+    GeomEncoder e;
+    geom_encoder_init(&e, &buf, GEOM_POLYLINE);
+    if (j.num_legs > 0 && journey_geometry(&tt, &j, &e))
+      printf("  geometry: %.*s\n", (int)buf.len, (const char*)buf.data);
+    byte_buffer_free(&buf);
+  } else {
+    char buf[16];
+    format_gtfs_time(time, buf, sizeof(buf));
+    printf("No journey found %s %s.\n", arriveBy ? "arriving by" : "after",
+           buf);
+  }
+  if (s.partial) printf("partial result: time limit reached\n");
+  printf("query time: %.3f ms\n", elapsed * 1000.0);
+
+  service_day_free(&day);
+  csa_scratch_free(&s);
+  free_timetable(&tt);
+  return found ? 0 : 1;
+}
+
+// ============================================================================
+// ALTERNATIVE JOURNEYS
+// ============================================================================
+
+/** Default number of alternatives returned by run_alternatives_mode(). */
+#define DEFAULT_ALTERNATIVES 3
+/** Default per-query memory budget of the alternatives search, in KiB. */
+#define DEFAULT_ALTERNATIVES_KIB 256
+/** Upper bound on candidate journeys examined by one alternatives query. */
+#define MAX_ALTERNATIVE_CANDIDATES 64
+
+/**
+ * KbCandidate structure
+ * A journey found with a set of routes banned, waiting to be reported.
+ */
+typedef struct {
+  Journey journey;  ///< Earliest-arrival journey avoiding the banned routes
+  int arrival;      ///< Arrival time at the target
+  int rides;        ///< Number of vehicle legs
+  int* bans;        ///< Banned routes, ascending
+  int num_bans;     ///< Number of banned routes
+  int expanded;     ///< Nonzero once reported or discarded
+} KbCandidate;
+
+/**
+ * KBestScratch structure
+ * Per-thread working memory of csa_alternatives(): the scan labels plus an
+ * arena holding everything one query allocates. The arena size is the
+ * query's memory budget.
+ */
+typedef struct {
+  CsaScratch csa;     ///< Labels of the connection scans
+  Arena arena;        ///< Candidates, ban lists and trip bitsets
+  int exhausted;      ///< Set when the last query ran out of budget
+  double time_limit;  ///< now_seconds() time at which a query gives up,
+                      ///< 0 for none
+  int partial;        ///< Set when the last query hit the time limit
+} KBestScratch;
+
+int kbest_scratch_init(KBestScratch* s, const Timetable* tt, size_t budget) {
+  int ok = csa_scratch_init(&s->csa, tt);
+  ok = arena_init(&s->arena, budget) && ok;
+  s->exhausted = 0;
+  s->time_limit = 0.0;
+  s->partial = 0;
+  return ok;
+}
+
+void kbest_scratch_free(KBestScratch* s) {
+  csa_scratch_free(&s->csa);
+  arena_free(&s->arena);
+}
+
+/**
+ * journey_same_routes()
+ *
+ * Returns:
+ *   1 if both journeys ride the same sequence of routes
+ */
+int journey_same_routes(const Timetable* tt, const Journey* a,
+                        const Journey* b) {
+  int i = 0, k = 0;
+  for (;;) {
+    while (i < a->num_legs && a->legs[i].trip < 0) ++i;
+    while (k < b->num_legs && b->legs[k].trip < 0) ++k;
+    if (i == a->num_legs || k == b->num_legs)
+      return i == a->num_legs && k == b->num_legs;
+    if (tt->trips[a->legs[i].trip].route != tt->trips[b->legs[k].trip].route)
+      return 0;
+    ++i;
+    ++k;
+  }
+}
+
+/**
+ * kbest_better()
+ *
+ * Returns:
+ *   1 if candidate a ranks before b: earlier arrival, then fewer vehicle
+ *   legs
+ */
+int kbest_better(const KbCandidate* a, const KbCandidate* b) {
+  return a->arrival < b->arrival ||
+         (a->arrival == b->arrival && a->rides < b->rides);
+}
+
+/**
+ * kbest_search()
+ *
+ * Runs one earliest-arrival scan with the given routes banned and stores
+ * the result as a new candidate.
+ *
+ * Returns:
+ *   The candidate, or NULL if the target is unreachable or the arena is
+ *   used up (s->exhausted is then set)
+ */
+KbCandidate* kbest_search(const Timetable* tt, KBestScratch* s, int origin,
+                          int dep_time, int target, const ServiceDay* day,
+                          const int* bans, int numBans) {
+  size_t words = (size_t)(tt->trip_mask_words > 0 ? tt->trip_mask_words : 1);
+  size_t mark = s->arena.used;
+  KbCandidate* c = arena_alloc(&s->arena, sizeof(KbCandidate));
+  int* banCopy = arena_alloc(&s->arena, (size_t)(numBans + 1) * sizeof(int));
+  // Trip bitsets are only needed during the scan; given back below
+  uint32_t* mask = arena_alloc(&s->arena, 2 * words * sizeof(uint32_t));
+  if (!c || !banCopy || !mask) {
+    s->arena.used = mark;
+    s->exhausted = 1;
+    return NULL;
+  }
+  memcpy(mask, day->active, words * sizeof(uint32_t));
+  memcpy(mask + words, day->overnight, words * sizeof(uint32_t));
+  for (int t = 0; t < tt->num_trips; ++t) {
+    for (int b = 0; b < numBans; ++b) {
+      if (tt->trips[t].route != bans[b]) continue;
+      mask[t >> 5] &= ~(1u << (t & 31));
+      mask[words + (t >> 5)] &= ~(1u << (t & 31));
+    }
+  }
+  ServiceDay banned = *day;
+  banned.active = mask;
+  banned.overnight = mask + words;
+  csa_earliest_arrival(tt, &s->csa, origin, dep_time, &banned, target, NULL);
+  int found = csa_extract_journey(tt, &s->csa, origin, target, &c->journey);
+  s->arena.used = (size_t)((unsigned char*)mask - s->arena.base);
+  if (!found) {
+    s->arena.used = mark;
+    return NULL;
+  }
+  memcpy(banCopy, bans, (size_t)numBans * sizeof(int));
+  c->bans = banCopy;
+  c->num_bans = numBans;
+  c->arrival = s->csa.arrival[target];
+  c->rides = 0;
+  for (int i = 0; i < c->journey.num_legs; ++i)
+    c->rides += c->journey.legs[i].trip >= 0;
+  c->expanded = 0;
+  return c;
+}
+
+/**
+ * csa_alternatives()
+ *
+ * Up to k journeys riding distinct route sequences, best first (earliest
+ * arrival, then fewest vehicle legs). Alternatives are found by banning
+ * routes: every reported journey spawns one search per route it rides,
+ * with that route added to its own banned set (in the manner of Yen's
+ * k-shortest-paths algorithm, on routes instead of edges).
+ *
+ * All memory comes from s->arena, which is reset per query. When it runs
+ * out the search stops with the alternatives found so far and sets
+ * s->exhausted. Likewise, once s->time_limit passes no further searches
+ * are started and s->partial is set; a scan cut short by the limit still
+ * yields a valid (possibly later) journey, which is kept.
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   s        - Scratch owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   target   - Index of the destination stop
+ *   day      - Trips the query may ride (timetable_service_day())
+ *   k        - Number of alternatives wanted (at most
+ *              MAX_ALTERNATIVE_CANDIDATES)
+ *   out      - Output: k journeys
+ *
+ * Returns:
+ *   Number of journeys written to out
+ */
+int csa_alternatives(const Timetable* tt, KBestScratch* s, int origin,
+                     int dep_time, int target, const ServiceDay* day, int k,
+                     Journey* out) {
+  arena_reset(&s->arena);
+  s->exhausted = 0;
+  s->partial = 0;
+  s->csa.time_limit = s->time_limit;
+  KbCandidate* cand[MAX_ALTERNATIVE_CANDIDATES];
+  KbCandidate* reported[MAX_ALTERNATIVE_CANDIDATES];
+  int numCand = 0, found = 0;
+  if (k > MAX_ALTERNATIVE_CANDIDATES) k = MAX_ALTERNATIVE_CANDIDATES;
+  KbCandidate* first =
+      kbest_search(tt, s, origin, dep_time, target, day, NULL, 0);
+  if (first) cand[numCand++] = first;
+  s->partial = s->csa.partial;
+
+  while (found < k) {
+    KbCandidate* best = NULL;
+    for (int i = 0; i < numCand; ++i)
+      if (!cand[i]->expanded && (!best || kbest_better(cand[i], best)))
+        best = cand[i];
+    if (!best) break;
+    best->expanded = 1;
+    int duplicate = 0;
+    for (int i = 0; i < found && !duplicate; ++i)
+      duplicate = journey_same_routes(tt, &reported[i]->journey,
+                                      &best->journey);
+    if (duplicate) continue;
+    reported[found++] = best;
+    if (found == k) break;
+
+    // One search per ridden route, banned on top of this journey's bans
+    for (int i = 0; i < best->journey.num_legs && !s->exhausted; ++i) {
+      if (time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        break;
+      }
+      int trip = best->journey.legs[i].trip;
+      int route = trip >= 0 ? tt->trips[trip].route : -1;
+      if (route < 0 || numCand == MAX_ALTERNATIVE_CANDIDATES) continue;
+      int bans[MAX_JOURNEY_LEGS + 1];
+      int n = 0, placed = 0, repeat = 0;
+      for (int b = 0; b < best->num_bans && n < MAX_JOURNEY_LEGS; ++b) {
+        repeat |= best->bans[b] == route;
+        if (!placed && best->bans[b] > route) {
+          bans[n++] = route;
+          placed = 1;
+        }
+        bans[n++] = best->bans[b];
+      }
+      if (!placed) bans[n++] = route;
+      if (repeat) continue;
+      KbCandidate* c =
+          kbest_search(tt, s, origin, dep_time, target, day, bans, n);
+      if (c) cand[numCand++] = c;
+      s->partial |= s->csa.partial;
+    }
+  }
+
+  // A later search may tie an earlier report with fewer vehicle legs
+  for (int i = 0; i < found; ++i) {
+    int m = i;
+    for (int r = i + 1; r < found; ++r)
+      if (kbest_better(reported[r], reported[m])) m = r;
+    KbCandidate* t = reported[m];
+    reported[m] = reported[i];
+    reported[i] = t;
+    out[i] = t->journey;
+  }
+  return found;
+}
+
+/**
+ * run_alternatives_mode()
+ *
+ * Command line:
+ *   alternatives <from> <to> [HH:MM:SS] [k] [budget KiB]
+ * Prints up to k journeys riding distinct route sequences.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_alternatives_mode(int argc, char** argv,
+                          const TimetableOptions* opts) {
+  if (argc < 2) {
+    fprintf(stderr,
+            "usage: alternatives <from> <to> [HH:MM:SS] [k] [budget KiB]\n");
+    return 1;
+  }
+  int time = parse_gtfs_time(argc > 2 ? argv[2] : "08:00:00");
+  int k = argc > 3 ? atoi(argv[3]) : DEFAULT_ALTERNATIVES;
+  int kib = argc > 4 ? atoi(argv[4]) : DEFAULT_ALTERNATIVES_KIB;
+  if (time < 0) {
+    fprintf(stderr, "invalid time '%s'\n", argv[2]);
+    return 1;
+  }
+  if (k < 1) k = 1;
+  if (kib < 1) kib = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  int origin = find_stop_index(&tt, argv[0]);
+  int target = find_stop_index(&tt, argv[1]);
+  if (origin < 0 || target < 0) {
+    printf("No matching stop found for '%s'.\n",
+           origin < 0 ? argv[0] : argv[1]);
+    free_timetable(&tt);
+    return 1;
+  }
+
+  KBestScratch s;
+  ServiceDay day;
+  Journey* alts = malloc((size_t)k * sizeof(Journey));
+  int ok = kbest_scratch_init(&s, &tt, (size_t)kib * 1024) && alts &&
+           timetable_query_day(&tt, opts, &day);
+  int found = 0;
+  if (ok) {
+    double t0 = now_seconds();
+    s.time_limit = query_time_limit(opts);
+    found = csa_alternatives(&tt, &s, origin, time, target, &day, k, alts);
+    double elapsed = now_seconds() - t0;
+    printf("From: %s (%s)\nTo:   %s (%s)\n", tt.stops[origin].stop_name,
+           tt.stops[origin].stop_id, tt.stops[target].stop_name,
+           tt.stops[target].stop_id);
+    for (int i = 0; i < found; ++i) {
+      printf("Alternative %d:\n", i + 1);
+      print_journey(&tt, &alts[i]);
+    }
+    if (found == 0) printf("No journey found.\n");
+    if (s.partial) printf("partial result: time limit reached\n");
+    printf("query time: %.3f ms, %ld of %d KiB used%s\n", elapsed * 1000.0,
+           (long)(s.arena.used / 1024), kib,
+           s.exhausted ? " (budget reached)" : "");
+    service_day_free(&day);
+  }
+  kbest_scratch_free(&s);
+  free(alts);
+  free_timetable(&tt);
+  return found > 0 ? 0 : 1;
+}
+
+// ============================================================================
+// DEPARTURE BOARDS
+// ============================================================================
+
+/** Upper bound on departures returned by one board query. */
+#define MAX_BOARD_DEPARTURES 100
+
+/**
+ * departure_lower_bound()
+ *
+ * Binary search in a stop's sorted departures.
+ *
+ * Returns:
+ *   Index of the first departure from `stop` at or after `time`
+ */
+int departure_lower_bound(const Timetable* tt, int stop, int time) {
+  int lo = tt->departure_offsets[stop];
+  int hi = tt->departure_offsets[stop + 1];
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tt->departures[mid].time < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * next_departures()
+ *
+ * Copies the next departures from a stop at or after `time`. The stop's
+ * sorted slice is read twice, as the query day and as the previous day
+ * shifted back 24 hours (so a 01:30 query also lists yesterday's 25:30
+ * departures), and the two runs are merged keeping only running trips.
+ * Departures of frequency-based trips are then generated from the
+ * stop's slice of frequency calls and inserted in order.
+ *
+ * Parameters:
+ *   tt   - Loaded timetable
+ *   stop - Index of the stop
+ *   time - Earliest departure time in seconds
+ *   day  - Trips that may be listed (timetable_service_day())
+ *   max  - Capacity of out
+ *   out  - Output array (times relative to the query day)
+ *
+ * Returns:
+ *   Number of departures copied into out
+ */
+int next_departures(const Timetable* tt, int stop, int time,
+                    const ServiceDay* day, int max, Departure* out) {
+  const Departure* deps = tt->departures;
+  int end = tt->departure_offsets[stop + 1];
+  int i = departure_lower_bound(tt, stop, time);
+  int k = departure_lower_bound(tt, stop, time + SECONDS_PER_DAY);
+  int n = 0;
+  while (n < max && (i < end || k < end)) {
+    int night = k < end && (i >= end || deps[k].time - SECONDS_PER_DAY <
+                                            deps[i].time);
+    if (night) {
+      if (TRIP_ACTIVE(day->overnight, deps[k].trip)) {
+        out[n] = deps[k];
+        out[n++].time -= SECONDS_PER_DAY;
+      }
+      k++;
+    } else {
+      if (TRIP_ACTIVE(day->active, deps[i].trip)) out[n++] = deps[i];
+      i++;
+    }
+  }
+
+  // Frequency-based trips are not in the slice: insert their next
+  // departures, generated from the rows calling here
+  for (int c = tt->frequency_call_offsets[stop];
+       c < tt->frequency_call_offsets[stop + 1]; ++c) {
+    const Frequency* fr = &tt->frequencies[tt->frequency_calls[c].frequency];
+    int offset = tt->frequency_calls[c].offset;
+    for (int shift = 0; shift <= SECONDS_PER_DAY; shift += SECONDS_PER_DAY) {
+      if (!TRIP_ACTIVE(shift ? day->overnight : day->active, fr->trip))
+        continue;
+      int t = time + shift - fr->start_time - offset;
+      int k = t <= 0 ? 0 : (t + fr->headway - 1) / fr->headway;
+      for (; k < fr->num_instances; ++k) {
+        int dep = fr->start_time + k * fr->headway + offset - shift;
+        if (n == max && (max == 0 || dep >= out[n - 1].time)) break;
+        int j = n < max ? n++ : n - 1;
+        while (j > 0 && out[j - 1].time > dep) {
+          out[j] = out[j - 1];
+          j--;
+        }
+        out[j].time = dep;
+        out[j].trip = fr->trip;
+      }
+    }
+  }
+  return n;
+}
+
+/**
+ * print_departures()
+ *
+ * Prints one tab-separated line per departure:
+ *   HH:MM:SS <TAB> route_short_name <TAB> trip_headsign
+ */
+void print_departures(const Timetable* tt, const Departure* deps, int n) {
+  char buf[16];
+  for (int i = 0; i < n; ++i) {
+    const Trip* trip = &tt->trips[deps[i].trip];
+    format_gtfs_time(deps[i].time, buf, sizeof(buf));
+    printf("%s\t%s\t%s\n", buf,
+           trip->route >= 0 ? tt->routes[trip->route].route_short_name : "",
+           trip->trip_headsign);
+  }
+}
+
+/**
+ * serve_departure_boards()
+ *
+ * Answers board queries read from stdin until EOF, one per line:
+ *   <stop_id> <HH:MM:SS> [N]
+ * Each answer is the print_departures() lines followed by an empty line, so
+ * a long-lived parent process can pipeline requests into one instance.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int serve_departure_boards(const Timetable* tt, const ServiceDay* day) {
+  char line[512];
+  char stopId[256];
+  char timeText[32];
+  Departure deps[MAX_BOARD_DEPARTURES];
+  long served = 0;
+  double t0 = now_seconds();
+  while (read_line(line, sizeof(line))) {
+    int count = 10;
+    int fields = sscanf(line, "%255s %31s %d", stopId, timeText, &count);
+    int stop = fields >= 1 ? id_index_get(&tt->stop_index, stopId) : -1;
+    int time = fields >= 2 ? parse_gtfs_time(timeText) : -1;
+    if (stop < 0 || time < 0) {
+      printf("error\t%s\n\n", line);
+    } else {
+      if (count < 1) count = 1;
+      if (count > MAX_BOARD_DEPARTURES) count = MAX_BOARD_DEPARTURES;
+      print_departures(tt, deps,
+                       next_departures(tt, stop, time, day, count, deps));
+      putchar('\n');
+    }
+    fflush(stdout);
+    served++;
+  }
+  double elapsed = now_seconds() - t0;
+  fprintf(stderr, "served %ld board queries in %.3f s\n", served, elapsed);
+  return 0;
+}
+
+/**
+ * run_board_mode()
+ *
+ * Command lines:
+ *   board <stop> [HH:MM:SS] [N]   next N (default 10) departures
+ *   board -                       serve queries from stdin (see
+ *                                 serve_departure_boards())
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_board_mode(int argc, char** argv, const TimetableOptions* opts) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: board <stop> [HH:MM:SS] [N] | board -\n");
+    return 1;
+  }
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  ServiceDay day;
+  if (!timetable_query_day(&tt, opts, &day)) {
+    free_timetable(&tt);
+    return 1;
+  }
+  if (strcmp(argv[0], "-") == 0) {
+    int rc = serve_departure_boards(&tt, &day);
+    service_day_free(&day);
+    free_timetable(&tt);
+    return rc;
+  }
+
+  int stop = find_stop_index(&tt, argv[0]);
+  int time = parse_gtfs_time(argc > 1 ? argv[1] : "08:00:00");
+  int count = argc > 2 ? atoi(argv[2]) : 10;
+  if (count < 1) count = 1;
+  if (count > MAX_BOARD_DEPARTURES) count = MAX_BOARD_DEPARTURES;
+  if (stop < 0 || time < 0) {
+    if (stop < 0)
+      printf("No matching stop found for '%s'.\n", argv[0]);
+    else
+      fprintf(stderr, "invalid time '%s'\n", argv[1]);
+    service_day_free(&day);
+    free_timetable(&tt);
+    return 1;
+  }
+
+  Departure deps[MAX_BOARD_DEPARTURES];
+  printf("Departures from %s (%s):\n", tt.stops[stop].stop_name,
+         tt.stops[stop].stop_id);
+  print_departures(&tt, deps,
+                   next_departures(&tt, stop, time, &day, count, deps));
+  service_day_free(&day);
+  free_timetable(&tt);
+  return 0;
+}
+
+// ============================================================================
+// INTERVAL INDEX
+// ============================================================================
+
+/** Closed time interval [start, end] labelled with an id (e.g. a trip). */
+typedef struct {
+  int start;  ///< First instant covered
+  int end;    ///< Last instant covered
+  int id;     ///< Caller's label
+} Interval;
+
+/**
+ * IntervalNode structure
+ * Node of a centered interval tree: holds the intervals containing its
+ * center; those entirely before it are in the left subtree, those entirely
+ * after it in the right one.
+ */
+typedef struct {
+  int center;  ///< Instant every interval of the node contains
+  int left;    ///< Node of the intervals ending before center, or -1
+  int right;   ///< Node of the intervals starting after center, or -1
+  int first;   ///< Start of the node's intervals in by_start / by_end
+  int count;   ///< Number of intervals held by the node
+} IntervalNode;
+
+/**
+ * IntervalIndex structure
+ * Intervals indexed for "which contain time t" (stabbing) and "which
+ * overlap [from, to]" (window) queries in O(log n + k) without allocating.
+ * A stab descends the centered interval tree, scanning at each node only
+ * the intervals that reach t: sorted by start when t is before the center,
+ * by end when after. A window adds the intervals starting inside it, read
+ * from all intervals sorted by start.
+ */
+typedef struct {
+  int num_intervals;    ///< Number of intervals
+  Interval* sorted;     ///< All intervals, by start
+  IntervalNode* nodes;  ///< Tree nodes (at most one per interval)
+  int num_nodes;        ///< Number of nodes
+  int root;             ///< Root node, or -1 if empty
+  Interval* by_start;   ///< Per node: its intervals by increasing start
+  Interval* by_end;     ///< Per node: its intervals by decreasing end
+} IntervalIndex;
+
+int compare_intervals_by_start(const void* a, const void* b) {
+  const Interval* x = a;
+  const Interval* y = b;
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+int compare_intervals_by_end_desc(const void* a, const void* b) {
+  const Interval* x = a;
+  const Interval* y = b;
+  if (x->end != y->end) return x->end > y->end ? -1 : 1;
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+int compare_ints(const void* a, const void* b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * interval_node_build()
+ *
+ * Builds the subtree of items[0, n), centered on the median of their
+ * endpoints so that each side gets at most half of them; reorders items.
+ *
+ * Parameters:
+ *   scratch   - Working space of n intervals
+ *   endpoints - Working space of 2n ints
+ *
+ * Returns:
+ *   Index of the subtree's root, or -1 if n == 0
+ */
+int interval_node_build(IntervalIndex* ix, Interval* items, int n,
+                        Interval* scratch, int* endpoints) {
+  if (n == 0) return -1;
+  for (int i = 0; i < n; ++i) {
+    endpoints[2 * i] = items[i].start;
+    endpoints[2 * i + 1] = items[i].end;
+  }
+  qsort(endpoints, (size_t)2 * n, sizeof(int), compare_ints);
+  int center = endpoints[n];
+
+  // Left intervals move to the front of items; the node's own fill scratch
+  // from the front and right ones from the back, then follow the left ones
+  int numLeft = 0, numHere = 0;
+  for (int i = 0; i < n; ++i)
+    if (items[i].end < center) items[numLeft++] = items[i];
+    else if (items[i].start <= center) scratch[numHere++] = items[i];
+    else scratch[n - 1 - (i - numLeft - numHere)] = items[i];
+  int numRight = n - numLeft - numHere;
+  for (int i = 0; i < numRight; ++i) items[numLeft + i] = scratch[n - 1 - i];
+
+  int node = ix->num_nodes++;
+  IntervalNode* nd = &ix->nodes[node];
+  nd->center = center;
+  nd->count = numHere;
+  // Nodes are numbered in build order, so each one's intervals follow the
+  // previous node's
+  nd->first = node > 0 ? ix->nodes[node - 1].first + ix->nodes[node - 1].count
+                       : 0;
+  memcpy(ix->by_start + nd->first, scratch, (size_t)numHere * sizeof(Interval));
+  memcpy(ix->by_end + nd->first, scratch, (size_t)numHere * sizeof(Interval));
+  qsort(ix->by_start + nd->first, (size_t)numHere, sizeof(Interval),
+        compare_intervals_by_start);
+  qsort(ix->by_end + nd->first, (size_t)numHere, sizeof(Interval),
+        compare_intervals_by_end_desc);
+
+  int left = interval_node_build(ix, items, numLeft, scratch, endpoints);
+  int right = interval_node_build(ix, items + numLeft, numRight, scratch,
+                                  endpoints);
+  ix->nodes[node].left = left;
+  ix->nodes[node].right = right;
+  return node;
+}
+
+void interval_index_free(IntervalIndex* ix) {
+  free(ix->sorted);
+  free(ix->nodes);
+  free(ix->by_start);
+  free(ix->by_end);
+  memset(ix, 0, sizeof(*ix));
+  ix->root = -1;
+}
+
+/**
+ * interval_index_build()
+ *
+ * Indexes n intervals (copied; intervals with end < start are dropped).
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int interval_index_build(IntervalIndex* ix, const Interval* intervals,
+                         int n) {
+  memset(ix, 0, sizeof(*ix));
+  ix->root = -1;
+  size_t cap = (size_t)(n > 0 ? n : 1);
+  Interval* items = malloc(cap * sizeof(Interval));
+  Interval* scratch = malloc(cap * sizeof(Interval));
+  int* endpoints = malloc(2 * cap * sizeof(int));
+  ix->sorted = malloc(cap * sizeof(Interval));
+  ix->nodes = malloc(cap * sizeof(IntervalNode));
+  ix->by_start = malloc(cap * sizeof(Interval));
+  ix->by_end = malloc(cap * sizeof(Interval));
+  int ok = items && scratch && endpoints && ix->sorted && ix->nodes &&
+           ix->by_start && ix->by_end;
+  if (ok) {
+    for (int i = 0; i < n; ++i)
+      if (intervals[i].end >= intervals[i].start)
+        items[ix->num_intervals++] = intervals[i];
+    memcpy(ix->sorted, items, (size_t)ix->num_intervals * sizeof(Interval));
+    qsort(ix->sorted, (size_t)ix->num_intervals, sizeof(Interval),
+          compare_intervals_by_start);
+    ix->root = interval_node_build(ix, items, ix->num_intervals, scratch,
+                                   endpoints);
+  }
+  free(items);
+  free(scratch);
+  free(endpoints);
+  if (!ok) interval_index_free(ix);
+  return ok;
+}
+
+/**
+ * IntervalQuery structure
+ * Iterator over the intervals overlapping [from, to] (see
+ * interval_query_init()).
+ */
+typedef struct {
+  int from;  ///< Window start (the stabbed instant)
+  int to;    ///< Window end
+  int node;  ///< Tree node being scanned, or -1 once the stab is done
+  int pos;   ///< Next position within the node, then within sorted
+} IntervalQuery;
+
+/**
+ * interval_query_init()
+ *
+ * Starts a query for the intervals overlapping [from, to]; from == to asks
+ * for those containing one instant.
+ */
+void interval_query_init(const IntervalIndex* ix, int from, int to,
+                         IntervalQuery* q) {
+  q->from = from;
+  q->to = to;
+  q->node = ix->root;
+  q->pos = 0;
+  if (q->node >= 0) return;
+  // Empty tree: go straight to the window part
+  q->pos = ix->num_intervals;
+}
+
+/**
+ * interval_query_next()
+ *
+ * Returns:
+ *   1 with the next overlapping interval's id in *id, 0 when done. Each
+ *   interval is reported once, in no particular order
+ */
+int interval_query_next(const IntervalIndex* ix, IntervalQuery* q, int* id) {
+  int t = q->from;
+  while (q->node >= 0) {
+    const IntervalNode* nd = &ix->nodes[q->node];
+    if (q->pos < nd->count) {
+      // Before the center every interval of the node ends after t, so
+      // only its start matters (and after the center only its end)
+      const Interval* iv = (t <= nd->center ? ix->by_start : ix->by_end) +
+                           nd->first + q->pos;
+      if (t < nd->center ? iv->start <= t
+                         : t == nd->center || iv->end >= t) {
+        q->pos++;
+        *id = iv->id;
+        return 1;
+      }
+    }
+    q->node = t < nd->center ? nd->left
+              : t > nd->center ? nd->right
+                               : -1;
+    q->pos = 0;
+    if (q->node < 0) {
+      // The stab is done: the window part starts after the intervals
+      // starting at or before t
+      int lo = 0, hi = ix->num_intervals;
+      while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ix->sorted[mid].start <= t) lo = mid + 1;
+        else hi = mid;
+      }
+      q->pos = lo;
+    }
+  }
+  if (q->pos < ix->num_intervals && ix->sorted[q->pos].start <= q->to) {
+    *id = ix->sorted[q->pos++].id;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * trip_intervals_build()
+ *
+ * Indexes every scheduled trip by its first departure and last arrival
+ * (ids are trip indices). Frequency-based trips are left out: their
+ * instances are generated from the templates.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int trip_intervals_build(const Timetable* tt, IntervalIndex* ix) {
+  Interval* spans = malloc((size_t)(tt->num_trips > 0 ? tt->num_trips : 1) *
+                           sizeof(Interval));
+  if (!spans) {
+    memset(ix, 0, sizeof(*ix));
+    ix->root = -1;
+    return 0;
+  }
+  int n = 0;
+  for (int t = 0; t < tt->num_trips; ++t) {
+    const Trip* trip = &tt->trips[t];
+    if (trip->frequency >= 0 || trip->num_stop_times == 0) continue;
+    spans[n].start = tt->stop_times[trip->first_stop_time].departure_time;
+    spans[n].end = tt->stop_times[trip->first_stop_time +
+                                  trip->num_stop_times - 1].arrival_time;
+    spans[n++].id = t;
+  }
+  int ok = interval_index_build(ix, spans, n);
+  free(spans);
+  return ok;
+}
+
+/**
+ * run_trips_mode()
+ *
+ * Command line: trips <HH:MM:SS> [HH:MM:SS]
+ * Lists the scheduled trips running at a time, or at some point between
+ * two times, with their first departure and last arrival (frequency-based
+ * trips are not listed).
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_trips_mode(int argc, char** argv, const TimetableOptions* opts) {
+  if (argc < 1) {
+    fprintf(stderr, "usage: trips <HH:MM:SS> [HH:MM:SS]\n");
+    return 1;
+  }
+  int from = parse_gtfs_time(argv[0]);
+  int to = argc > 1 ? parse_gtfs_time(argv[1]) : from;
+  if (from < 0 || to < from) {
+    fprintf(stderr, "invalid time window\n");
+    return 1;
+  }
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  IntervalIndex trips;
+  ServiceDay day;
+  int ok = trip_intervals_build(&tt, &trips);
+  ok = ok && timetable_query_day(&tt, opts, &day);
+  if (ok) {
+    int count = 0;
+    double t0 = now_seconds();
+    for (int shift = 0; shift <= SECONDS_PER_DAY; shift += SECONDS_PER_DAY) {
+      const uint32_t* mask = shift ? day.overnight : day.active;
+      IntervalQuery q;
+      int t;
+      interval_query_init(&trips, from + shift, to + shift, &q);
+      while (interval_query_next(&trips, &q, &t)) {
+        if (!TRIP_ACTIVE(mask, t)) continue;
+        const Trip* trip = &tt.trips[t];
+        const StopTime* st = &tt.stop_times[trip->first_stop_time];
+        char dep[16], arr[16];
+        format_gtfs_time(st[0].departure_time - shift, dep, sizeof(dep));
+        format_gtfs_time(st[trip->num_stop_times - 1].arrival_time - shift,
+                         arr, sizeof(arr));
+        printf("  %s-%s  route %s  trip %s to %s\n", dep, arr,
+               trip->route >= 0 ? tt.routes[trip->route].route_short_name
+                                : "",
+               trip->trip_id, trip->trip_headsign);
+        count++;
+      }
+    }
+    printf("%d trips running (query %.3f ms)\n", count,
+           (now_seconds() - t0) * 1000.0);
+    service_day_free(&day);
+  }
+  interval_index_free(&trips);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// VEHICLE POSITIONS
+// ============================================================================
+
+/**
+ * VehiclePosition structure
+ * Where the vehicle running one trip (or one instance of a frequency-based
+ * trip) is at the snapshot time.
+ */
+typedef struct {
+  int trip;       ///< Trip index
+  int shift;      ///< Added to the trip's stop times to give snapshot-day
+                  ///< times: -86400 for the previous day's trips, or the
+                  ///< instance's start for frequency-based trips
+  int stop_time;  ///< Last stop time reached (index into stop_times); the
+                  ///< vehicle is there or on its way to the next one
+  double lat;     ///< Latitude
+  double lon;     ///< Longitude
+} VehiclePosition;
+
+/**
+ * vehicle_locate()
+ *
+ * Positions the vehicle of a trip at `time`, given in the trip's own stop
+ * time clock and within its first departure and last arrival. Between two
+ * stops it is placed by the share of the running time elapsed, at the same
+ * share of the distance between the stops' anchors (which come from
+ * shape_dist_traveled where it fits), then on the shape at that distance;
+ * trips without a shape move in a straight line.
+ */
+void vehicle_locate(const Timetable* tt, int trip, int time,
+                    VehiclePosition* out) {
+  const Trip* tr = &tt->trips[trip];
+  const StopTime* st = tt->stop_times;
+  int lo = tr->first_stop_time, hi = lo + tr->num_stop_times - 1;
+  // Last stop time already reached
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (st[mid].arrival_time <= time) lo = mid;
+    else hi = mid - 1;
+  }
+  const ShapeAnchor* a = &tt->shape_anchors[lo];
+  out->trip = trip;
+  out->stop_time = lo;
+  out->lat = a->lat;
+  out->lon = a->lon;
+  int last = tr->first_stop_time + tr->num_stop_times - 1;
+  if (lo == last || time <= st[lo].departure_time) return;
+
+  const ShapeAnchor* b = a + 1;
+  double f = (double)(time - st[lo].departure_time) /
+             (st[lo + 1].arrival_time - st[lo].departure_time);
+  double lat0 = a->lat, lon0 = a->lon, m0 = a->dist_m;
+  double lat1 = b->lat, lon1 = b->lon, m1 = b->dist_m;
+  if (a->point >= 0) {
+    // Shape points strictly between the anchors: the first one at or
+    // beyond the distance, and the one before it, bracket the position
+    double d = a->dist_m + f * (b->dist_m - a->dist_m);
+    int p = a->point + 1, end = b->point + 1;
+    while (p < end) {
+      int mid = p + (end - p) / 2;
+      if (tt->shape_m[mid] < d) p = mid + 1;
+      else end = mid;
+    }
+    if (p > a->point + 1) {
+      lat0 = tt->shape_lat[p - 1];
+      lon0 = tt->shape_lon[p - 1];
+      m0 = tt->shape_m[p - 1];
+    }
+    if (p <= b->point) {
+      lat1 = tt->shape_lat[p];
+      lon1 = tt->shape_lon[p];
+      m1 = tt->shape_m[p];
+    }
+    f = m1 > m0 ? (d - m0) / (m1 - m0) : 0.0;
+    if (f < 0.0) f = 0.0;
+    if (f > 1.0) f = 1.0;
+  }
+  out->lat = lat0 + f * (lat1 - lat0);
+  out->lon = lon0 + f * (lon1 - lon0);
+}
+
+/**
+ * vehicle_positions()
+ *
+ * Snapshot of every vehicle running at `time` on a service day: the day's
+ * trips between their first departure and last arrival, the previous
+ * day's trips still running past midnight, and the running instances of
+ * frequency-based trips. Allocates nothing.
+ *
+ * Parameters:
+ *   tt    - Loaded timetable
+ *   trips - Scheduled trips by running time (trip_intervals_build())
+ *   day   - Trips running on the snapshot day
+ *   time  - Snapshot time in seconds
+ *   out   - Output array
+ *   max   - Capacity of out
+ *
+ * Returns:
+ *   Number of running vehicles; only the first max are written to out
+ */
+int vehicle_positions(const Timetable* tt, const IntervalIndex* trips,
+                      const ServiceDay* day, int time, VehiclePosition* out,
+                      int max) {
+  int n = 0;
+  for (int shift = 0; shift <= SECONDS_PER_DAY; shift += SECONDS_PER_DAY) {
+    const uint32_t* mask = shift ? day->overnight : day->active;
+    int t = time + shift, trip;
+    IntervalQuery q;
+    interval_query_init(trips, t, t, &q);
+    while (interval_query_next(trips, &q, &trip)) {
+      if (!TRIP_ACTIVE(mask, trip)) continue;
+      if (n < max) {
+        vehicle_locate(tt, trip, t, &out[n]);
+        out[n].shift = -shift;
+      }
+      n++;
+    }
+
+    for (int f = 0; f < tt->num_frequencies; ++f) {
+      const Frequency* fr = &tt->frequencies[f];
+      const Trip* trip = &tt->trips[fr->trip];
+      if (!TRIP_ACTIVE(mask, fr->trip)) continue;
+      const StopTime* st = &tt->stop_times[trip->first_stop_time];
+      int duration = st[trip->num_stop_times - 1].arrival_time -
+                     st[0].departure_time;
+      // Instances that started in [t - duration, t]
+      int from = t - duration - fr->start_time;
+      int k = from <= 0 ? 0 : (from + fr->headway - 1) / fr->headway;
+      for (; k < fr->num_instances; ++k) {
+        int start = fr->start_time + k * fr->headway;
+        if (start > t) break;
+        if (n < max) {
+          vehicle_locate(tt, fr->trip, t - start + st[0].departure_time,
+                         &out[n]);
+          out[n].shift = start - st[0].departure_time - shift;
+        }
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+/**
+ * run_positions_mode()
+ *
+ * Command line: positions [HH:MM:SS] [rounds]
+ * Prints where every vehicle is at the time (default 08:00:00), then how
+ * long one snapshot takes, best of `rounds` (default 1000).
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_positions_mode(int argc, char** argv, const TimetableOptions* opts) {
+  int time = parse_gtfs_time(argc > 0 ? argv[0] : "08:00:00");
+  int rounds = argc > 1 ? atoi(argv[1]) : 1000;
+  if (time < 0) {
+    fprintf(stderr, "invalid time '%s'\n", argv[0]);
+    return 1;
+  }
+  if (rounds < 1) rounds = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  // Every trip and instance can run at most once on each of the two days
+  int max = tt.num_trips;
+  for (int f = 0; f < tt.num_frequencies; ++f)
+    max += tt.frequencies[f].num_instances;
+  max = 2 * max + 1;
+  IntervalIndex trips;
+  ServiceDay day;
+  VehiclePosition* out = malloc((size_t)max * sizeof(VehiclePosition));
+  int ok = trip_intervals_build(&tt, &trips) && out;
+  ok = ok && timetable_query_day(&tt, opts, &day);
+  if (ok) {
+    int n = vehicle_positions(&tt, &trips, &day, time, out, max);
+    double best = 0.0;
+    for (int r = 0; r < rounds; ++r) {
+      double t0 = now_seconds();
+      vehicle_positions(&tt, &trips, &day, time, out, max);
+      double spent = now_seconds() - t0;
+      if (r == 0 || spent < best) best = spent;
+    }
+    char hms[16];
+    for (int i = 0; i < n; ++i) {
+      const Trip* trip = &tt.trips[out[i].trip];
+      const StopTime* st = &tt.stop_times[out[i].stop_time];
+      format_gtfs_time(st->departure_time + out[i].shift, hms, sizeof(hms));
+      printf("  %.6f,%.6f  route %s  trip %s  last stop %s (%s)\n", out[i].lat,
+             out[i].lon,
+             trip->route >= 0 ? tt.routes[trip->route].route_short_name : "",
+             trip->trip_id, tt.stops[st->stop].stop_name, hms);
+    }
+    format_gtfs_time(time, hms, sizeof(hms));
+    printf("%d vehicles running at %s; snapshot in %.1f us\n", n, hms,
+           best * 1e6);
+    service_day_free(&day);
+  }
+  free(out);
+  interval_index_free(&trips);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// TRIP-BASED ROUTING
+// ============================================================================
+
+/**
+ * TbTransfer structure
+ * A precomputed transfer target: board `trip` at stop position `pos`.
+ */
+typedef struct {
+  int trip;  ///< Index of the trip boarded
+  int pos;   ///< Position of the boarding stop within that trip
+} TbTransfer;
+
+/**
+ * TbVisit structure
+ * A line calling at a stop, at the given position of its stop sequence.
+ */
+typedef struct {
+  int line;  ///< Index of the line
+  int pos;   ///< Position of the stop within the line
+} TbVisit;
+
+/**
+ * TbIndex structure
+ * Trip-based (TB) routing data. Lines group trips that share a stop
+ * sequence and never overtake each other, earliest first. Transfers are
+ * kept per stop time (trip, position) in a CSR array aligned with
+ * Timetable.stop_times.
+ */
+typedef struct {
+  int num_lines;          ///< Number of lines
+  int* line_offsets;      ///< Per line: start of its trips in line_trips
+  int* line_trips;        ///< Trips of each line, earliest first
+  int* trip_line;         ///< Per trip: its line, -1 for trips with < 2 stops
+  int* trip_rank;         ///< Per trip: its position within the line
+  int* visit_offsets;     ///< Per stop: start of its slice of visits
+  TbVisit* visits;        ///< Line visits grouped by stop
+  int* transfer_offsets;  ///< Per stop time: start of its transfers
+                          ///< (num_stop_times + 1 entries)
+  TbTransfer* transfers;  ///< Reduced trip-to-trip transfers
+  int num_transfers;      ///< Number of transfers
+} TbIndex;
+
+/** Sort key grouping trips by stop sequence, then departure. */
+typedef struct {
+  unsigned hash;  ///< Hash of the stop sequence
+  int len;        ///< Number of stops
+  int dep;        ///< First departure
+  int trip;       ///< Index of the trip
+} TbTripKey;
+
+int compare_tb_trip_keys(const void* a, const void* b) {
+  const TbTripKey* x = a;
+  const TbTripKey* y = b;
+  if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+  if (x->len != y->len) return x->len < y->len ? -1 : 1;
+  if (x->dep != y->dep) return x->dep < y->dep ? -1 : 1;
+  return (x->trip > y->trip) - (x->trip < y->trip);
+}
+
+/**
+ * tb_fits_line()
+ *
+ * Returns:
+ *   1 if trip `b` has the same stop sequence as `first` and never departs
+ *   or arrives before `last` (so appending it keeps the line FIFO)
+ */
+int tb_fits_line(const Timetable* tt, int first, int last, int b) {
+  const Trip* tf = &tt->trips[first];
+  const Trip* tb = &tt->trips[b];
+  if (tf->num_stop_times != tb->num_stop_times) return 0;
+  const StopTime* sf = &tt->stop_times[tf->first_stop_time];
+  const StopTime* sl = &tt->stop_times[tt->trips[last].first_stop_time];
+  const StopTime* sb = &tt->stop_times[tb->first_stop_time];
+  for (int i = 0; i < tb->num_stop_times; ++i) {
+    if (sf[i].stop != sb[i].stop) return 0;
+    if (sb[i].departure_time < sl[i].departure_time ||
+        sb[i].arrival_time < sl[i].arrival_time)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * tb_build_lines()
+ *
+ * Partitions trips into FIFO lines and indexes the lines calling at each
+ * stop.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tb_build_lines(const Timetable* tt, TbIndex* tb) {
+  int nt = tt->num_trips;
+  TbTripKey* keys = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(TbTripKey));
+  int* lineFirst = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  int* lineLast = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  tb->trip_line = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  tb->trip_rank = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  if (!keys || !lineFirst || !lineLast || !tb->trip_line || !tb->trip_rank) {
+    free(keys);
+    free(lineFirst);
+    free(lineLast);
+    return 0;
+  }
+
+  int nk = 0;
+  for (int t = 0; t < nt; ++t) {
+    const Trip* trip = &tt->trips[t];
+    tb->trip_line[t] = -1;
+    // Frequency-based trips are only generated by the connection scan
+    if (trip->num_stop_times < 2 || trip->frequency >= 0) continue;
+    const StopTime* st = &tt->stop_times[trip->first_stop_time];
+    unsigned h = 2166136261u;
+    for (int i = 0; i < trip->num_stop_times; ++i)
+      h = hash_bytes(&st[i].stop, sizeof(int), h);
+    keys[nk].hash = h;
+    keys[nk].len = trip->num_stop_times;
+    keys[nk].dep = st[0].departure_time;
+    keys[nk].trip = t;
+    nk++;
+  }
+  qsort(keys, nk, sizeof(TbTripKey), compare_tb_trip_keys);
+
+  // Greedy assignment: within a group of equal sequence hashes, append each
+  // trip (in departure order) to the first line it does not overtake.
+  int numLines = 0;
+  for (int g = 0; g < nk;) {
+    int groupEnd = g;
+    while (groupEnd < nk && keys[groupEnd].hash == keys[g].hash &&
+           keys[groupEnd].len == keys[g].len)
+      groupEnd++;
+    int groupFirstLine = numLines;
+    for (int k = g; k < groupEnd; ++k) {
+      int t = keys[k].trip;
+      int line = groupFirstLine;
+      while (line < numLines && !tb_fits_line(tt, lineFirst[line],
+                                               lineLast[line], t))
+        line++;
+      if (line == numLines) lineFirst[numLines++] = t;
+      lineLast[line] = t;
+      tb->trip_line[t] = line;
+    }
+    g = groupEnd;
+  }
+  free(lineLast);
+
+  tb->num_lines = numLines;
+  tb->line_offsets = calloc((size_t)numLines + 1, sizeof(int));
+  tb->line_trips = malloc((size_t)(nk > 0 ? nk : 1) * sizeof(int));
+  if (!tb->line_offsets || !tb->line_trips) {
+    free(keys);
+    free(lineFirst);
+    return 0;
+  }
+  for (int k = 0; k < nk; ++k)
+    tb->line_offsets[tb->trip_line[keys[k].trip] + 1]++;
+  for (int l = 0; l < numLines; ++l)
+    tb->line_offsets[l + 1] += tb->line_offsets[l];
+  // keys are in departure order within each line, so filling in key order
+  // leaves every line sorted
+  int* fill = malloc((size_t)(numLines > 0 ? numLines : 1) * sizeof(int));
+  if (!fill) {
+    free(keys);
+    free(lineFirst);
+    return 0;
+  }
+  memcpy(fill, tb->line_offsets, (size_t)numLines * sizeof(int));
+  for (int k = 0; k < nk; ++k) {
+    int t = keys[k].trip;
+    int slot = fill[tb->trip_line[t]]++;
+    tb->line_trips[slot] = t;
+    tb->trip_rank[t] = slot - tb->line_offsets[tb->trip_line[t]];
+  }
+  free(fill);
+  free(keys);
+
+  // Stop -> (line, position) visits; the last stop of a line is never a
+  // boarding point and is left out
+  tb->visit_offsets = calloc((size_t)tt->num_stops + 1, sizeof(int));
+  if (!tb->visit_offsets) {
+    free(lineFirst);
+    return 0;
+  }
+  int numVisits = 0;
+  for (int l = 0; l < numLines; ++l) {
+    const Trip* trip = &tt->trips[lineFirst[l]];
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+      tb->visit_offsets[tt->stop_times[trip->first_stop_time + i].stop + 1]++;
+      numVisits++;
+    }
+  }
+  for (int i = 0; i < tt->num_stops; ++i)
+    tb->visit_offsets[i + 1] += tb->visit_offsets[i];
+  tb->visits =
+      malloc((size_t)(numVisits > 0 ? numVisits : 1) * sizeof(TbVisit));
+  fill = malloc((size_t)(tt->num_stops > 0 ? tt->num_stops : 1) * sizeof(int));
+  if (!tb->visits || !fill) {
+    free(fill);
+    free(lineFirst);
+    return 0;
+  }
+  memcpy(fill, tb->visit_offsets, (size_t)tt->num_stops * sizeof(int));
+  for (int l = 0; l < numLines; ++l) {
+    const Trip* trip = &tt->trips[lineFirst[l]];
+    for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+      TbVisit* v =
+          &tb->visits[fill[tt->stop_times[trip->first_stop_time + i].stop]++];
+      v->line = l;
+      v->pos = i;
+    }
+  }
+  free(fill);
+  free(lineFirst);
+  return 1;
+}
+
+/**
+ * tb_earliest_trip()
+ *
+ * Binary search for the earliest trip of a line departing from position
+ * `pos` at or after `time`.
+ *
+ * Returns:
+ *   Index of the trip, or -1 if none departs late enough
+ */
+int tb_earliest_trip(const Timetable* tt, const TbIndex* tb, int line, int pos,
+                     int time) {
+  int lo = tb->line_offsets[line], hi = tb->line_offsets[line + 1];
+  int end = hi;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const Trip* t = &tt->trips[tb->line_trips[mid]];
+    if (tt->stop_times[t->first_stop_time + pos].departure_time < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < end ? tb->line_trips[lo] : -1;
+}
+
+/** A transfer found during preprocessing, before it is placed in the CSR. */
+typedef struct {
+  int from_pos;  ///< Alighting position within the source trip
+  int trip;      ///< Trip boarded
+  int pos;       ///< Boarding position within that trip
+} TbRawTransfer;
+
+/**
+ * TbWorker structure
+ * Per-thread state of the transfer preprocessing: output buffer plus the
+ * scratch labels used by the reduction step.
+ */
+typedef struct {
+  TbRawTransfer* items;  ///< Kept transfers of all trips this worker handled
+  int count;             ///< Number of items
+  int capacity;          ///< Capacity of items
+  int* best;             ///< Per stop: earliest arrival seen by reduction
+  int* touched;          ///< Stops whose best label must be reset
+  int num_touched;       ///< Number of touched stops
+  long generated;        ///< Transfers generated before reduction
+} TbWorker;
+
+/** Shared state of the parallel transfer preprocessing. */
+typedef struct {
+  const Timetable* tt;
+  const TbIndex* tb;
+  TbWorker* workers;
+  int* result_worker;  ///< Per trip: worker that holds its transfers
+  int* result_begin;   ///< Per trip: first transfer in that worker's items
+  int* result_count;   ///< Per trip: number of kept transfers
+  int failed;          ///< Set if a worker ran out of memory
+} TbBuildJob;
+
+/**
+ * tb_improve()
+ *
+ * Lowers w->best[stop] to `time` (and the labels of stops within walking
+ * distance). With commit == 0 the labels are only compared, not written.
+ *
+ * Returns:
+ *   1 if any label improved, 0 otherwise
+ */
+int tb_improve(const Timetable* tt, TbWorker* w, int stop, int time,
+               int commit) {
+  int improved = 0;
+  if (time < w->best[stop]) {
+    if (!commit) return 1;
+    if (w->best[stop] == TIME_INFINITY) w->touched[w->num_touched++] = stop;
+    w->best[stop] = time;
+    improved = 1;
+  }
+  for (int f = tt->footpath_offsets[stop]; f < tt->footpath_offsets[stop + 1];
+       ++f) {
+    int q = tt->footpaths[f].to_stop;
+    int t = time + tt->footpaths[f].walk_time;
+    if (t < w->best[q]) {
+      if (!commit) return 1;
+      if (w->best[q] == TIME_INFINITY) w->touched[w->num_touched++] = q;
+      w->best[q] = t;
+      improved = 1;
+    }
+  }
+  return improved;
+}
+
+/**
+ * tb_always_with()
+ *
+ * Returns:
+ *   1 if trip a can be ridden by every query that can ride trip b: it runs
+ *   on the same days (always, without a calendar) and offers at least b's
+ *   attributes
+ */
+int tb_always_with(const Timetable* tt, int a, int b) {
+  const Trip* ta = &tt->trips[a];
+  const Trip* tb = &tt->trips[b];
+  return (!tt->has_calendar || ta->service == tb->service) &&
+         (tb->attributes & ~ta->attributes) == 0;
+}
+
+/**
+ * tb_push_transfer()
+ *
+ * Appends a transfer to the worker buffer.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tb_push_transfer(TbWorker* w, int fromPos, int trip, int pos) {
+  if (!grow_array((void**)&w->items, &w->capacity, w->count + 1,
+                  sizeof(TbRawTransfer)))
+    return 0;
+  TbRawTransfer* r = &w->items[w->count++];
+  r->from_pos = fromPos;
+  r->trip = trip;
+  r->pos = pos;
+  return 1;
+}
+
+/**
+ * tb_trip_transfers_task()
+ *
+ * Parallel task: generates all transfers out of one trip, then drops the
+ * ones that never yield an earlier arrival anywhere (Witt's reduction:
+ * positions are processed from the last stop backwards, and a transfer is
+ * kept only if riding the target trip improves some stop label).
+ *
+ * With a service calendar or attribute filters the earliest trip of a line
+ * may not be available to a query riding `t`, so transfers are generated
+ * to successive trips of the line up to the first one always available
+ * with t (tb_always_with()), and only such transfers lower the reduction
+ * labels; other transfers are kept whenever they would improve one.
+ */
+void tb_trip_transfers_task(void* ctx, int worker, int t) {
+  TbBuildJob* job = ctx;
+  const Timetable* tt = job->tt;
+  const TbIndex* tb = job->tb;
+  TbWorker* w = &job->workers[worker];
+  const Trip* trip = &tt->trips[t];
+  const StopTime* st = &tt->stop_times[trip->first_stop_time];
+  int line = tb->trip_line[t];
+  int begin = w->count;
+
+  job->result_worker[t] = worker;
+  job->result_begin[t] = begin;
+  job->result_count[t] = 0;
+  if (line < 0) return;
+
+  // Generation: from every arrival, the earliest trip of each line calling
+  // at the stop or at a stop within walking distance
+  for (int i = 1; i < trip->num_stop_times; ++i) {
+    int p = st[i].stop;
+    // f == offsets[p] - 1 stands for staying at p itself
+    int f = tt->footpath_offsets[p] - 1;
+    for (; f < tt->footpath_offsets[p + 1]; ++f) {
+      int atStop = f < tt->footpath_offsets[p];
+      int q = atStop ? p : tt->footpaths[f].to_stop;
+      int walk = atStop ? 0 : tt->footpaths[f].walk_time;
+      for (int v = tb->visit_offsets[q]; v < tb->visit_offsets[q + 1]; ++v) {
+        int j = tb->visits[v].pos;
+        int vl = tb->visits[v].line;
+        int u = tb_earliest_trip(tt, tb, vl, j, st[i].arrival_time + walk);
+        if (u < 0) continue;
+        int k = tb->line_offsets[vl] + tb->trip_rank[u];
+        for (; k < tb->line_offsets[vl + 1]; ++k) {
+          u = tb->line_trips[k];
+          int last = tb_always_with(tt, u, t);
+          if (u == t) break;
+          // Staying on the trip beats changing to a later trip of the line
+          if (vl == line && tb->trip_rank[u] >= tb->trip_rank[t] && j >= i)
+            break;
+          // U-turn: getting off only to ride straight back to the last stop
+          const StopTime* su = &tt->stop_times[tt->trips[u].first_stop_time];
+          if (!(walk == 0 && su[j + 1].stop == st[i - 1].stop &&
+                st[i - 1].arrival_time <= su[j + 1].departure_time)) {
+            w->generated++;
+            if (!tb_push_transfer(w, i, u, j)) {
+              job->failed = 1;
+              return;
+            }
+          }
+          if (last) break;
+        }
+      }
+    }
+  }
+
+  // Reduction
+  int k = w->count;
+  for (int i = trip->num_stop_times - 1; i >= 1; --i) {
+    tb_improve(tt, w, st[i].stop, st[i].arrival_time, 1);
+    while (k > begin && w->items[k - 1].from_pos == i) {
+      TbRawTransfer* r = &w->items[--k];
+      const Trip* tu = &tt->trips[r->trip];
+      const StopTime* su = &tt->stop_times[tu->first_stop_time];
+      int commit = tb_always_with(tt, r->trip, t);
+      int keep = 0;
+      for (int m = r->pos + 1; m < tu->num_stop_times && (commit || !keep);
+           ++m)
+        keep |= tb_improve(tt, w, su[m].stop, su[m].arrival_time, commit);
+      if (!keep) r->trip = -1;
+    }
+  }
+  for (int i = 0; i < w->num_touched; ++i)
+    w->best[w->touched[i]] = TIME_INFINITY;
+  w->num_touched = 0;
+
+  // Compact the kept transfers (still in from_pos order)
+  int out = begin;
+  for (int i = begin; i < w->count; ++i)
+    if (w->items[i].trip >= 0) w->items[out++] = w->items[i];
+  w->count = out;
+  job->result_count[t] = out - begin;
+}
+
+/**
+ * tb_build_transfers()
+ *
+ * Computes and reduces all trip-to-trip transfers on numThreads threads and
+ * gathers them into the per-stop-time CSR array.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int tb_build_transfers(const Timetable* tt, TbIndex* tb, int numThreads) {
+  int nt = tt->num_trips;
+  if (numThreads < 1) numThreads = 1;
+  TbBuildJob job;
+  job.tt = tt;
+  job.tb = tb;
+  job.failed = 0;
+  job.workers = calloc((size_t)numThreads, sizeof(TbWorker));
+  job.result_worker = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  job.result_begin = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  job.result_count = malloc((size_t)(nt > 0 ? nt : 1) * sizeof(int));
+  int ok = job.workers && job.result_worker && job.result_begin &&
+           job.result_count;
+  for (int w = 0; ok && w < numThreads; ++w) {
+    // A stop is touched at most once per trip, so num_stops bounds touched
+    job.workers[w].best = malloc((size_t)tt->num_stops * sizeof(int));
+    job.workers[w].touched = malloc((size_t)tt->num_stops * sizeof(int));
+    ok = job.workers[w].best && job.workers[w].touched;
+    if (ok)
+      for (int i = 0; i < tt->num_stops; ++i)
+        job.workers[w].best[i] = TIME_INFINITY;
+  }
+  if (ok) ok = parallel_for(nt, numThreads, tb_trip_transfers_task, &job);
+  if (ok) ok = !job.failed;
+
+  if (ok) {
+    long generated = 0;
+    int total = 0;
+    for (int w = 0; w < numThreads; ++w) {
+      generated += job.workers[w].generated;
+      total += job.workers[w].count;
+    }
+    tb->num_transfers = total;
+    tb->transfer_offsets =
+        calloc((size_t)tt->num_stop_times + 1, sizeof(int));
+    tb->transfers =
+        malloc((size_t)(total > 0 ? total : 1) * sizeof(TbTransfer));
+    ok = tb->transfer_offsets && tb->transfers;
+    // Trips are visited in order, so the CSR fills front to back
+    int k = 0;
+    for (int t = 0; ok && t < nt; ++t) {
+      const TbRawTransfer* r =
+          job.workers[job.result_worker[t]].items + job.result_begin[t];
+      int first = tt->trips[t].first_stop_time;
+      for (int i = 0; i < job.result_count[t]; ++i) {
+        tb->transfer_offsets[first + r[i].from_pos + 1]++;
+        tb->transfers[k].trip = r[i].trip;
+        tb->transfers[k].pos = r[i].pos;
+        k++;
+      }
+    }
+    for (int i = 0; ok && i < tt->num_stop_times; ++i)
+      tb->transfer_offsets[i + 1] += tb->transfer_offsets[i];
+    if (ok)
+      printf("trip-based: %d lines, %ld transfers generated, %d kept\n",
+             tb->num_lines, generated, total);
+  }
+
+  for (int w = 0; job.workers && w < numThreads; ++w) {
+    free(job.workers[w].items);
+    free(job.workers[w].best);
+    free(job.workers[w].touched);
+  }
+  free(job.workers);
+  free(job.result_worker);
+  free(job.result_begin);
+  free(job.result_count);
+  return ok;
+}
+
+/** Cache file holding the reduced transfers. */
+#define TB_CACHE_FILE "trip_transfers.bin"
+#define TB_CACHE_VERSION 3
+
+/**
+ * tb_save_transfers()
+ *
+ * Persists the transfer CSR next to the dataset (see open_cache_file()).
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int tb_save_transfers(const Timetable* tt, const TbIndex* tb) {
+  FILE* fp = open_cache_file(tt, TB_CACHE_FILE, "GECT", TB_CACHE_VERSION, 1);
+  if (!fp) return 0;
+  int32_t counts[2] = {tt->num_stop_times, tb->num_transfers};
+  int ok = fwrite(counts, sizeof(counts), 1, fp) == 1 &&
+           fwrite(tb->transfer_offsets, sizeof(int),
+                  (size_t)tt->num_stop_times + 1,
+                  fp) == (size_t)tt->num_stop_times + 1 &&
+           fwrite(tb->transfers, sizeof(TbTransfer), (size_t)tb->num_transfers,
+                  fp) == (size_t)tb->num_transfers;
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * tb_load_transfers()
+ *
+ * Loads the transfer CSR saved by tb_save_transfers(), if it matches the
+ * loaded timetable.
+ *
+ * Returns:
+ *   1 if loaded, 0 if missing, stale or unreadable
+ */
+int tb_load_transfers(const Timetable* tt, TbIndex* tb) {
+  FILE* fp = open_cache_file(tt, TB_CACHE_FILE, "GECT", TB_CACHE_VERSION, 0);
+  if (!fp) return 0;
+  int32_t counts[2];
+  int ok = fread(counts, sizeof(counts), 1, fp) == 1 &&
+           counts[0] == tt->num_stop_times && counts[1] >= 0;
+  if (ok) {
+    size_t n = (size_t)tt->num_stop_times + 1;
+    tb->num_transfers = counts[1];
+    tb->transfer_offsets = malloc(n * sizeof(int));
+    tb->transfers =
+        malloc((size_t)(counts[1] > 0 ? counts[1] : 1) * sizeof(TbTransfer));
+    ok = tb->transfer_offsets && tb->transfers &&
+         fread(tb->transfer_offsets, sizeof(int), n, fp) == n &&
+         fread(tb->transfers, sizeof(TbTransfer), (size_t)counts[1], fp) ==
+             (size_t)counts[1];
+    if (!ok) {
+      free(tb->transfer_offsets);
+      free(tb->transfers);
+      tb->transfer_offsets = NULL;
+      tb->transfers = NULL;
+    }
+  }
+  fclose(fp);
+  return ok;
+}
+
+void tb_free(TbIndex* tb) {
+  free(tb->line_offsets);
+  free(tb->line_trips);
+  free(tb->trip_line);
+  free(tb->trip_rank);
+  free(tb->visit_offsets);
+  free(tb->visits);
+  free(tb->transfer_offsets);
+  free(tb->transfers);
+  memset(tb, 0, sizeof(*tb));
+}
+
+/**
+ * tb_load_or_build()
+ *
+ * Builds the lines and loads the saved transfers, or computes (in parallel)
+ * and saves them when no valid cache exists.
+ *
+ * Parameters:
+ *   tt         - Loaded timetable
+ *   tb         - Index to fill
+ *   numThreads - Threads for preprocessing
+ *   rebuild    - Nonzero to ignore any saved transfers
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int tb_load_or_build(const Timetable* tt, TbIndex* tb, int numThreads,
+                     int rebuild) {
+  memset(tb, 0, sizeof(*tb));
+  if (!tb_build_lines(tt, tb)) return 0;
+  if (!rebuild && tb_load_transfers(tt, tb)) return 1;
+
+  double t0 = now_seconds();
+  if (!tb_build_transfers(tt, tb, numThreads)) return 0;
+  printf("trip-based: preprocessing took %.3f s on %d threads\n",
+         now_seconds() - t0, numThreads);
+  if (!tb_save_transfers(tt, tb))
+    fprintf(stderr, "could not save %s\n", TB_CACHE_FILE);
+  return 1;
+}
+
+/**
+ * TbSegment structure
+ * A trip ridden from position `from` (boarding) up to `to` in the TB
+ * breadth-first search, with a link to the segment it was reached from.
+ */
+typedef struct {
+  int trip;        ///< Index of the trip
+  int from;        ///< Boarding position
+  int to;          ///< Last position covered by this segment
+  int parent;      ///< Queue index of the previous segment, -1 at origin
+  int parent_pos;  ///< Alighting position in the previous segment
+} TbSegment;
+
+/**
+ * TbScratch structure
+ * Per-query working memory of the TB search, reused across queries.
+ */
+typedef struct {
+  int* reached;        ///< Per trip: lowest position reached so far
+  int* target_walk;    ///< Per stop: walking time to the target, -1 if none
+  TbSegment* queue;    ///< Segment queue; each push lowers some reached[]
+                       ///< entry, which is reset once per service day
+                       ///< searched, so 2 * num_stop_times entries suffice
+  double time_limit;   ///< now_seconds() time at which a search gives up,
+                       ///< 0 for none
+  int partial;         ///< Set when the last search hit the time limit
+} TbScratch;
+
+int tb_scratch_init(TbScratch* s, const Timetable* tt) {
+  s->reached = malloc((size_t)tt->num_trips * sizeof(int));
+  s->target_walk = malloc((size_t)tt->num_stops * sizeof(int));
+  s->queue = malloc(
+      (size_t)2 * (tt->num_stop_times > 0 ? tt->num_stop_times : 1) *
+      sizeof(TbSegment));
+  if (s->target_walk)
+    for (int i = 0; i < tt->num_stops; ++i) s->target_walk[i] = -1;
+  s->time_limit = 0;
+  s->partial = 0;
+  return s->reached && s->target_walk && s->queue;
+}
+
+void tb_scratch_free(TbScratch* s) {
+  free(s->reached);
+  free(s->target_walk);
+  free(s->queue);
+  memset(s, 0, sizeof(*s));
+}
+
+/**
+ * tb_enqueue()
+ *
+ * Queues trip `t` from position `pos` unless it (or an earlier trip of its
+ * line) is already reached at or before that position, and marks the trip
+ * and every later trip of the line as reached from `pos`.
+ */
+void tb_enqueue(const Timetable* tt, const TbIndex* tb, TbScratch* s, int* len,
+                int t, int pos, int parent, int parentPos) {
+  if (pos >= s->reached[t]) return;
+  TbSegment* seg = &s->queue[(*len)++];
+  seg->trip = t;
+  seg->from = pos;
+  seg->to = s->reached[t] == TIME_INFINITY ? tt->trips[t].num_stop_times - 1
+                                           : s->reached[t];
+  seg->parent = parent;
+  seg->parent_pos = parentPos;
+  int line = tb->trip_line[t];
+  for (int k = tb->line_offsets[line] + tb->trip_rank[t];
+       k < tb->line_offsets[line + 1]; ++k) {
+    int u = tb->line_trips[k];
+    if (s->reached[u] <= pos) break;
+    s->reached[u] = pos;
+  }
+}
+
+/**
+ * tb_append_walk()
+ *
+ * Appends a walking leg to a journey if `from` and `to` differ.
+ */
+void tb_append_walk(const Timetable* tt, Journey* j, int from, int to,
+                    int time) {
+  if (from == to || j->num_legs >= MAX_JOURNEY_LEGS) return;
+  JourneyLeg* leg = &j->legs[j->num_legs++];
+  leg->trip = -1;
+  leg->last_trip = -1;
+  leg->from_stop = from;
+  leg->to_stop = to;
+  leg->dep_time = time;
+  leg->arr_time = time + footpath_time(tt, from, to);
+}
+
+/**
+ * tb_board()
+ *
+ * Boards the earliest running trip of every line at `stop` or a stop
+ * within walking distance, arriving there at `time`.
+ *
+ * Parameters:
+ *   active    - Trips that may be boarded
+ *   parent    - Queue index of the segment arriving at `stop` (-1: the
+ *               origin)
+ *   parentPos - Alighting position in that segment
+ */
+void tb_board(const Timetable* tt, const TbIndex* tb, TbScratch* s, int* len,
+              const uint32_t* active, int stop, int time, int parent,
+              int parentPos) {
+  int f = tt->footpath_offsets[stop] - 1;
+  for (; f < tt->footpath_offsets[stop + 1]; ++f) {
+    int atStop = f < tt->footpath_offsets[stop];
+    int q = atStop ? stop : tt->footpaths[f].to_stop;
+    int walk = atStop ? 0 : tt->footpaths[f].walk_time;
+    for (int v = tb->visit_offsets[q]; v < tb->visit_offsets[q + 1]; ++v) {
+      int line = tb->visits[v].line, pos = tb->visits[v].pos;
+      int u = tb_earliest_trip(tt, tb, line, pos, time + walk);
+      if (u < 0) continue;
+      int k = tb->line_offsets[line] + tb->trip_rank[u];
+      while (k < tb->line_offsets[line + 1] &&
+             !TRIP_ACTIVE(active, tb->line_trips[k]))
+        ++k;
+      if (k < tb->line_offsets[line + 1])
+        tb_enqueue(tt, tb, s, len, tb->line_trips[k], pos, parent,
+                   parentPos);
+    }
+  }
+}
+
+/**
+ * tb_earliest_arrival()
+ *
+ * Trip-based earliest-arrival query: a breadth-first search over trip
+ * segments linked by the precomputed transfers, pruned by the best arrival
+ * found so far.
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   tb       - Trip-based index
+ *   s        - Scratch owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   target   - Index of the destination stop
+ *   day      - Trips the query may ride (timetable_service_day()). The
+ *              previous day's trips running past midnight are searched
+ *              first, one day ahead in their own clock (their transfers
+ *              are the same ones shifted by a day); the query day's pass
+ *              also boards wherever that first pass arrived
+ *   bound    - Per stop: lower bound on the travel time to target
+ *              (landmark_bounds()), or NULL; transfers out of a stop are
+ *              skipped when they cannot beat the best arrival
+ *   j        - Output journey (may be NULL)
+ *
+ * Past s->time_limit the search stops with s->partial set and returns the
+ * best journey found so far.
+ *
+ * Returns:
+ *   Earliest arrival time at target, or TIME_INFINITY if unreachable
+ */
+int tb_earliest_arrival(const Timetable* tt, const TbIndex* tb, TbScratch* s,
+                        int origin, int dep_time, int target,
+                        const ServiceDay* day, const int* bound,
+                        Journey* j) {
+  const Footpath* tf = tt->footpaths + tt->footpath_offsets[target];
+  const Footpath* tfEnd = tt->footpaths + tt->footpath_offsets[target + 1];
+  for (const Footpath* f = tf; f < tfEnd; ++f)
+    s->target_walk[f->to_stop] = f->walk_time;
+  s->target_walk[target] = 0;
+
+  int best = TIME_INFINITY, bestSeg = -1, bestPos = -1;
+  if (s->target_walk[origin] >= 0) best = dep_time + s->target_walk[origin];
+
+  // First the previous day's trips, in their own clock one day ahead,
+  // then the query day's, boarded at the origin or wherever the first
+  // pass arrived. Times compared with best are shifted back.
+  s->partial = 0;
+  int len = 0, overnightEnd = 0;
+  for (int shift = SECONDS_PER_DAY; shift >= 0 && !s->partial;
+       shift -= SECONDS_PER_DAY) {
+    const uint32_t* active = shift ? day->overnight : day->active;
+    for (int t = 0; t < tt->num_trips; ++t) s->reached[t] = TIME_INFINITY;
+    int first = len;
+    tb_board(tt, tb, s, &len, active, origin, dep_time + shift, -1, -1);
+    for (int h = 0; !shift && h < overnightEnd; ++h) {
+      const TbSegment* seg = &s->queue[h];
+      const StopTime* st =
+          &tt->stop_times[tt->trips[seg->trip].first_stop_time];
+      for (int i = seg->from + 1; i <= seg->to; ++i) {
+        int a = st[i].arrival_time - SECONDS_PER_DAY;
+        if (a >= best) break;
+        tb_board(tt, tb, s, &len, active, st[i].stop, a, h, i);
+      }
+    }
+
+    // The queue is processed in push order, i.e. round by round
+    for (int head = first; head < len; ++head) {
+      // Segments are heavier than connections; check more often
+      if (head % (TIME_LIMIT_CHECK_INTERVAL / 16) == 0 &&
+          time_limit_reached(s->time_limit)) {
+        s->partial = 1;
+        break;
+      }
+      TbSegment seg = s->queue[head];
+      const StopTime* st =
+          &tt->stop_times[tt->trips[seg.trip].first_stop_time];
+      for (int i = seg.from + 1; i <= seg.to; ++i) {
+        int a = st[i].arrival_time - shift;
+        if (a >= best) break;
+        int w = s->target_walk[st[i].stop];
+        if (w >= 0 && a + w < best) {
+          best = a + w;
+          bestSeg = head;
+          bestPos = i;
+        }
+        if (bound && a >= best - bound[st[i].stop]) continue;
+        int idx = tt->trips[seg.trip].first_stop_time + i;
+        for (int k = tb->transfer_offsets[idx];
+             k < tb->transfer_offsets[idx + 1]; ++k)
+          if (TRIP_ACTIVE(active, tb->transfers[k].trip))
+            tb_enqueue(tt, tb, s, &len, tb->transfers[k].trip,
+                       tb->transfers[k].pos, head, i);
+      }
+    }
+    if (shift) overnightEnd = len;
+  }
+
+  for (const Footpath* f2 = tf; f2 < tfEnd; ++f2)
+    s->target_walk[f2->to_stop] = -1;
+  s->target_walk[target] = -1;
+
+  if (j && best != TIME_INFINITY) {
+    // Collect vehicle legs from the destination backwards
+    JourneyLeg rides[MAX_JOURNEY_LEGS];
+    int n = 0;
+    for (int sg = bestSeg, pos = bestPos; sg >= 0 && n < MAX_JOURNEY_LEGS;) {
+      const TbSegment* seg = &s->queue[sg];
+      const StopTime* st =
+          &tt->stop_times[tt->trips[seg->trip].first_stop_time];
+      int shift = sg < overnightEnd ? SECONDS_PER_DAY : 0;
+      JourneyLeg* leg = &rides[n++];
+      leg->trip = seg->trip;
+      leg->last_trip = seg->trip;
+      leg->from_stop = st[seg->from].stop;
+      leg->to_stop = st[pos].stop;
+      leg->dep_time = st[seg->from].departure_time - shift;
+      leg->arr_time = st[pos].arrival_time - shift;
+      pos = seg->parent_pos;
+      sg = seg->parent;
+    }
+    // Emit in travel order with the walking legs in between
+    j->num_legs = 0;
+    int at = origin, time = dep_time;
+    for (int i = n - 1; i >= 0; --i) {
+      tb_append_walk(tt, j, at, rides[i].from_stop, time);
+      if (j->num_legs < MAX_JOURNEY_LEGS) j->legs[j->num_legs++] = rides[i];
+      at = rides[i].to_stop;
+      time = rides[i].arr_time;
+    }
+    tb_append_walk(tt, j, at, target, time);
+    journey_merge_seated(tt, j);
+  }
+  return best;
+}
+
+/**
+ * run_tb_mode()
+ *
+ * Command lines:
+ *   tbroute <from> <to> [HH:MM:SS] [threads]
+ *       Earliest-arrival journey with the trip-based engine; preprocesses
+ *       and saves the transfers on first use
+ *   tbbuild [threads]
+ *       Recomputes and saves the transfers
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_tb_mode(int argc, char** argv, int buildOnly,
+                const TimetableOptions* opts) {
+  if (!buildOnly && argc < 2) {
+    fprintf(stderr, "usage: tbroute <from> <to> [HH:MM:SS] [threads]\n");
+    return 1;
+  }
+  const char* threadArg = buildOnly ? (argc > 0 ? argv[0] : NULL)
+                                    : (argc > 3 ? argv[3] : NULL);
+  int threads = threadArg ? atoi(threadArg) : default_thread_count();
+  int time = parse_gtfs_time(!buildOnly && argc > 2 ? argv[2] : "08:00:00");
+  if (time < 0) {
+    fprintf(stderr, "invalid time '%s'\n", argv[2]);
+    return 1;
+  }
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  TbIndex tb;
+  if (!tb_load_or_build(&tt, &tb, threads, buildOnly)) {
+    tb_free(&tb);
+    free_timetable(&tt);
+    return 1;
+  }
+  if (buildOnly) {
+    tb_free(&tb);
+    free_timetable(&tt);
+    return 0;
+  }
+
+  int origin = find_stop_index(&tt, argv[0]);
+  int target = find_stop_index(&tt, argv[1]);
+  int rc = 1;
+  TbScratch s;
+  ServiceDay day;
+  timetable_service_day(&tt, opts->service_day, &day);
+  if (origin < 0 || target < 0) {
+    printf("No matching stop found for '%s'.\n",
+           origin < 0 ? argv[0] : argv[1]);
+  } else if (service_day_require(&tt, opts->require, &day) &&
+             tb_scratch_init(&s, &tt)) {
+    // Without landmarks the query still runs, just unpruned
+    Landmarks lm;
+    int* bound = malloc((size_t)tt.num_stops * sizeof(int));
+    if (bound && !landmarks_load_or_build(&tt, &lm, threads, 0)) {
+      landmarks_free(&lm);
+      free(bound);
+      bound = NULL;
+    }
+    Journey j;
+    double t0 = now_seconds();
+    s.time_limit = query_time_limit(opts);
+    if (bound) landmark_bounds(&tt, &lm, target, 1, bound);
+    int arrival = tb_earliest_arrival(&tt, &tb, &s, origin, time, target, &day,
+                                      bound, &j);
+    double elapsed = now_seconds() - t0;
+    printf("From: %s (%s)\nTo:   %s (%s)\n", tt.stops[origin].stop_name,
+           tt.stops[origin].stop_id, tt.stops[target].stop_name,
+           tt.stops[target].stop_id);
+    if (arrival != TIME_INFINITY) {
+      print_journey(&tt, &j);
+      rc = 0;
+    } else {
+      printf("No journey found.\n");
+    }
+    if (s.partial) printf("partial result: time limit reached\n");
+    printf("query time: %.3f ms\n", elapsed * 1000.0);
+    if (bound) landmarks_free(&lm);
+    free(bound);
+    tb_scratch_free(&s);
+  }
+  service_day_free(&day);
+  tb_free(&tb);
+  free_timetable(&tt);
+  return rc;
+}
+
+// ============================================================================
+// TRANSFER PATTERNS
+// ============================================================================
+
+/**
+ * TpNode structure
+ * Node of a per-pair transfer-pattern DAG, stored in preorder. Node 0 is
+ * the origin; every other node is reached from its parent by one ride (or
+ * one walk), and nodes at the target end a pattern. Patterns sharing a
+ * prefix share the nodes of that prefix.
+ */
+typedef struct {
+  int stop;    ///< Index of the stop
+  int parent;  ///< Index of the parent within the pair's nodes (-1: root)
+  int walk;    ///< Nonzero if reached from the parent on foot
+} TpNode;
+
+/**
+ * TpDirect structure
+ * A line that runs from one stop to another without a transfer.
+ */
+typedef struct {
+  int to;        ///< Index of the destination stop
+  int line;      ///< Index of the line (see TbIndex)
+  int from_pos;  ///< Position of the departure stop in the line
+  int to_pos;    ///< Position of the destination stop in the line
+} TpDirect;
+
+/**
+ * TpIndex structure
+ * Transfer patterns (Bast et al.): for every origin/target pair, the
+ * sequences of transfer stops used by optimal journeys at any departure
+ * time. A query evaluates the pair's DAG, looking up each ride in the
+ * direct-connection table, instead of searching the network.
+ */
+typedef struct {
+  TbIndex lines;         ///< Lines only (no trip transfers)
+  int* direct_offsets;   ///< Per stop: start of its direct connections
+  TpDirect* direct;      ///< Direct connections grouped by departure stop,
+                         ///< sorted by destination
+  int* pair_offsets;     ///< [origin * num_stops + target]: start of the
+                         ///< pair's nodes (num_stops^2 + 1 entries)
+  TpNode* nodes;         ///< All pair DAGs
+  int num_nodes;         ///< Number of nodes
+  int max_pair_nodes;    ///< Largest pair DAG, sizes TpScratch
+} TpIndex;
+
+int compare_tp_direct(const void* a, const void* b) {
+  const TpDirect* x = a;
+  const TpDirect* y = b;
+  if (x->to != y->to) return x->to < y->to ? -1 : 1;
+  return (x->line > y->line) - (x->line < y->line);
+}
+
+/**
+ * tp_build_direct()
+ *
+ * Builds the direct-connection table: for every line and every pair of
+ * positions i < j, an entry from its i-th to its j-th stop.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tp_build_direct(const Timetable* tt, TpIndex* tp) {
+  const TbIndex* tb = &tp->lines;
+  tp->direct_offsets = calloc((size_t)tt->num_stops + 1, sizeof(int));
+  if (!tp->direct_offsets) return 0;
+  // Pass 0 counts the entries per stop, pass 1 fills them in
+  for (int pass = 0; pass < 2; ++pass) {
+    int* fill = NULL;
+    if (pass == 1) {
+      for (int v = 0; v < tt->num_stops; ++v)
+        tp->direct_offsets[v + 1] += tp->direct_offsets[v];
+      int total = tp->direct_offsets[tt->num_stops];
+      tp->direct = malloc((size_t)(total > 0 ? total : 1) * sizeof(TpDirect));
+      fill = malloc((size_t)(tt->num_stops > 0 ? tt->num_stops : 1) *
+                    sizeof(int));
+      if (!tp->direct || !fill) {
+        free(fill);
+        return 0;
+      }
+      memcpy(fill, tp->direct_offsets, (size_t)tt->num_stops * sizeof(int));
+    }
+    for (int line = 0; line < tb->num_lines; ++line) {
+      const Trip* trip = &tt->trips[tb->line_trips[tb->line_offsets[line]]];
+      const StopTime* st = &tt->stop_times[trip->first_stop_time];
+      for (int i = 0; i + 1 < trip->num_stop_times; ++i) {
+        for (int j = i + 1; j < trip->num_stop_times; ++j) {
+          if (pass == 0) {
+            tp->direct_offsets[st[i].stop + 1]++;
+            continue;
+          }
+          TpDirect* d = &tp->direct[fill[st[i].stop]++];
+          d->to = st[j].stop;
+          d->line = line;
+          d->from_pos = i;
+          d->to_pos = j;
+        }
+      }
+    }
+    free(fill);
+  }
+  for (int v = 0; v < tt->num_stops; ++v)
+    qsort(tp->direct + tp->direct_offsets[v],
+          (size_t)(tp->direct_offsets[v + 1] - tp->direct_offsets[v]),
+          sizeof(TpDirect), compare_tp_direct);
+  return 1;
+}
+
+/**
+ * tp_ride()
+ *
+ * Direct-connection lookup: the earliest arrival at stop `to` riding one
+ * trip from stop `from`, boarding at or after `time` (the previous service
+ * day's trips after midnight included).
+ *
+ * Parameters:
+ *   tt   - Loaded timetable
+ *   tp   - Transfer-pattern index
+ *   day  - Trips the query may ride (timetable_service_day())
+ *   from - Index of the boarding stop
+ *   to   - Index of the alighting stop
+ *   time - Earliest boarding time in seconds
+ *   leg  - Output: the ride, valid if the result is not TIME_INFINITY
+ *
+ * Returns:
+ *   Arrival time at `to`, or TIME_INFINITY if no trip serves the pair
+ */
+int tp_ride(const Timetable* tt, const TpIndex* tp, const ServiceDay* day,
+            int from, int to, int time, JourneyLeg* leg) {
+  const TbIndex* tb = &tp->lines;
+  int lo = tp->direct_offsets[from], hi = tp->direct_offsets[from + 1];
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tp->direct[mid].to < to)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int best = TIME_INFINITY;
+  for (int e = lo; e < tp->direct_offsets[from + 1] && tp->direct[e].to == to;
+       ++e) {
+    const TpDirect* d = &tp->direct[e];
+    // Shift 0 is the query day, shift SECONDS_PER_DAY the previous day
+    for (int shift = 0; shift <= SECONDS_PER_DAY; shift += SECONDS_PER_DAY) {
+      const uint32_t* active = shift ? day->overnight : day->active;
+      int u = tb_earliest_trip(tt, tb, d->line, d->from_pos, time + shift);
+      if (u < 0) continue;
+      int k = tb->line_offsets[d->line] + tb->trip_rank[u];
+      while (k < tb->line_offsets[d->line + 1] &&
+             !TRIP_ACTIVE(active, tb->line_trips[k]))
+        ++k;
+      if (k == tb->line_offsets[d->line + 1]) continue;
+      const Trip* trip = &tt->trips[tb->line_trips[k]];
+      const StopTime* st = &tt->stop_times[trip->first_stop_time];
+      int arr = st[d->to_pos].arrival_time - shift;
+      if (arr < best) {
+        best = arr;
+        leg->trip = tb->line_trips[k];
+        leg->last_trip = leg->trip;
+        leg->from_stop = from;
+        leg->to_stop = to;
+        leg->dep_time = st[d->from_pos].departure_time - shift;
+        leg->arr_time = arr;
+      }
+    }
+  }
+  return best;
+}
+
+/** Trie node used while collecting the patterns of one origin. */
+typedef struct {
+  int stop;     ///< Index of the stop
+  int walk;     ///< Nonzero if reached from the parent on foot
+  int child;    ///< First child, -1 if none
+  int sibling;  ///< Next sibling, -1 if none
+} TpTrieNode;
+
+/**
+ * TpWorker structure
+ * Per-thread state of the pattern preprocessing.
+ */
+typedef struct {
+  CsaScratch scratch;   ///< Labels for the profile scans
+  TpTrieNode* trie;     ///< Trie nodes of the current origin
+  int trie_count;       ///< Number of trie nodes
+  int trie_capacity;    ///< Capacity of trie
+  int* roots;           ///< Per target: its trie root, -1 if none yet
+  int* events;          ///< Departure times scanned for the current origin
+  int events_capacity;  ///< Capacity of events
+  int* stack;           ///< Stack used when flattening the tries
+  int stack_capacity;   ///< Capacity of stack
+  int* best;            ///< Per target: arrival at the last event scanned
+  long scans;           ///< Connection scans run
+} TpWorker;
+
+/** Shared state of the parallel pattern preprocessing. */
+typedef struct {
+  const Timetable* tt;
+  TpWorker* workers;
+  ServiceDay day;        ///< Every trip, every day
+  TpNode** origin_nodes; ///< Per origin: its pairs' nodes, target by target
+  int** origin_offsets;  ///< Per origin: num_stops + 1 offsets into those
+  int failed;            ///< Set if a worker ran out of memory
+} TpBuildJob;
+
+/**
+ * tp_trie_child()
+ *
+ * Returns:
+ *   The child of `node` for (stop, walk), created if missing; -1 on
+ *   allocation failure
+ */
+int tp_trie_child(TpWorker* w, int node, int stop, int walk) {
+  int c = node >= 0 ? w->trie[node].child : -1;
+  for (; c >= 0; c = w->trie[c].sibling)
+    if (w->trie[c].stop == stop && w->trie[c].walk == walk) return c;
+  if (!grow_array((void**)&w->trie, &w->trie_capacity, w->trie_count + 1,
+                  sizeof(TpTrieNode)))
+    return -1;
+  c = w->trie_count++;
+  w->trie[c].stop = stop;
+  w->trie[c].walk = walk;
+  w->trie[c].child = -1;
+  w->trie[c].sibling = -1;
+  if (node >= 0) {
+    w->trie[c].sibling = w->trie[node].child;
+    w->trie[node].child = c;
+  }
+  return c;
+}
+
+/**
+ * tp_insert_journey()
+ *
+ * Adds the pattern of a journey (its leg end stops) to the target's trie.
+ * A leg staying seated through several trips of a block is split at the
+ * block's trip ends, since the direct connections only cover single lines.
+ *
+ * Returns:
+ *   1 on success, 0 on allocation failure
+ */
+int tp_insert_journey(const Timetable* tt, TpWorker* w, int origin,
+                      int target, const Journey* j) {
+  if (w->roots[target] < 0) w->roots[target] = tp_trie_child(w, -1, origin, 0);
+  int node = w->roots[target];
+  for (int i = 0; node >= 0 && i < j->num_legs; ++i) {
+    const JourneyLeg* leg = &j->legs[i];
+    for (int t = leg->trip; t >= 0 && t != leg->last_trip && node >= 0;
+         t = tt->trips[t].block_next) {
+      const Trip* trip = &tt->trips[t];
+      int end = tt->stop_times[trip->first_stop_time + trip->num_stop_times -
+                               1].stop;
+      node = tp_trie_child(w, node, end, 0);
+    }
+    if (node >= 0) node = tp_trie_child(w, node, leg->to_stop, leg->trip < 0);
+  }
+  return node >= 0;
+}
+
+int compare_tp_events(const void* a, const void* b) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * tp_collect_events()
+ *
+ * Lists the departure times at which optimal journeys from `origin` can
+ * change: every departure from the origin and, less the walk, from each
+ * stop within walking distance (previous-day departures past midnight
+ * shifted back a day). A query at time t is answered by the first event
+ * at or after t, since no journey can leave earlier.
+ *
+ * Returns:
+ *   Number of distinct events in w->events, -1 on allocation failure
+ */
+int tp_collect_events(const Timetable* tt, TpWorker* w, int origin) {
+  int n = 0;
+  int f = tt->footpath_offsets[origin] - 1;
+  for (; f < tt->footpath_offsets[origin + 1]; ++f) {
+    int atOrigin = f < tt->footpath_offsets[origin];
+    int q = atOrigin ? origin : tt->footpaths[f].to_stop;
+    int walk = atOrigin ? 0 : tt->footpaths[f].walk_time;
+    int first = tt->departure_offsets[q], last = tt->departure_offsets[q + 1];
+    if (!grow_array((void**)&w->events, &w->events_capacity,
+                    n + 2 * (last - first), sizeof(int)))
+      return -1;
+    for (int d = first; d < last; ++d) {
+      int t = tt->departures[d].time - walk;
+      if (t >= 0) w->events[n++] = t;
+      if (t >= SECONDS_PER_DAY) w->events[n++] = t - SECONDS_PER_DAY;
+    }
+  }
+  qsort(w->events, (size_t)n, sizeof(int), compare_tp_events);
+  int unique = 0;
+  for (int i = 0; i < n; ++i)
+    if (unique == 0 || w->events[unique - 1] != w->events[i])
+      w->events[unique++] = w->events[i];
+  return unique;
+}
+
+/**
+ * tp_origin_task()
+ *
+ * Parallel task: runs a connection scan from one origin at every event
+ * time, inserts the pattern of the optimal journey to every target into a
+ * per-target trie, then flattens the tries into preorder TpNode arrays.
+ * Events are scanned latest first; a target whose arrival did not improve
+ * keeps the later journey, which is still optimal, and is not extracted.
+ */
+void tp_origin_task(void* ctx, int worker, int origin) {
+  TpBuildJob* job = ctx;
+  const Timetable* tt = job->tt;
+  TpWorker* w = &job->workers[worker];
+  int n = tt->num_stops;
+  w->trie_count = 0;
+  for (int v = 0; v < n; ++v) {
+    w->roots[v] = -1;
+    w->best[v] = TIME_INFINITY;
+  }
+
+  // Walking straight to a nearby target needs no vehicle at all
+  Journey j;
+  j.num_legs = 1;
+  for (int f = tt->footpath_offsets[origin];
+       f < tt->footpath_offsets[origin + 1]; ++f) {
+    j.legs[0].trip = -1;
+    j.legs[0].last_trip = -1;
+    j.legs[0].to_stop = tt->footpaths[f].to_stop;
+    if (!tp_insert_journey(tt, w, origin, j.legs[0].to_stop, &j))
+      job->failed = 1;
+  }
+
+  int numEvents = tp_collect_events(tt, w, origin);
+  if (numEvents < 0) job->failed = 1;
+  for (int e = numEvents - 1; e >= 0 && !job->failed; --e) {
+    csa_earliest_arrival(tt, &w->scratch, origin, w->events[e], &job->day, -1,
+                         NULL);
+    w->scans++;
+    for (int target = 0; target < n; ++target) {
+      if (target == origin || w->scratch.arrival[target] >= w->best[target])
+        continue;
+      w->best[target] = w->scratch.arrival[target];
+      if (!csa_extract_journey(tt, &w->scratch, origin, target, &j)) continue;
+      if (!tp_insert_journey(tt, w, origin, target, &j)) job->failed = 1;
+    }
+  }
+
+  // Flatten: preorder, so a node's parent always precedes it
+  int* offsets = malloc((size_t)(n + 1) * sizeof(int));
+  TpNode* nodes = malloc((size_t)(w->trie_count > 0 ? w->trie_count : 1) *
+                         sizeof(TpNode));
+  if (!offsets || !nodes || job->failed) {
+    free(offsets);
+    free(nodes);
+    job->failed = 1;
+    return;
+  }
+  int count = 0;
+  for (int target = 0; target < n; ++target) {
+    offsets[target] = count;
+    if (w->roots[target] < 0) continue;
+    int base = count, top = 0;
+    if (!grow_array((void**)&w->stack, &w->stack_capacity, 2, sizeof(int))) {
+      job->failed = 1;
+      break;
+    }
+    // Stack of (trie node, parent index) pairs
+    w->stack[top++] = w->roots[target];
+    w->stack[top++] = -1;
+    while (top > 0) {
+      int parent = w->stack[--top];
+      int t = w->stack[--top];
+      TpNode* out = &nodes[count];
+      out->stop = w->trie[t].stop;
+      out->walk = w->trie[t].walk;
+      out->parent = parent;
+      int self = count++ - base;
+      for (int c = w->trie[t].child; c >= 0; c = w->trie[c].sibling) {
+        if (!grow_array((void**)&w->stack, &w->stack_capacity, top + 2,
+                        sizeof(int))) {
+          job->failed = 1;
+          top = 0;
+          break;
+        }
+        w->stack[top++] = c;
+        w->stack[top++] = self;
+      }
+    }
+  }
+  offsets[n] = count;
+  job->origin_nodes[origin] = nodes;
+  job->origin_offsets[origin] = offsets;
+}
+
+/**
+ * tp_build_patterns()
+ *
+ * Computes the transfer patterns of all pairs, origins spread over
+ * numThreads threads, and gathers them into tp->pair_offsets / tp->nodes.
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int tp_build_patterns(const Timetable* tt, TpIndex* tp, int numThreads) {
+  int n = tt->num_stops;
+  if (numThreads < 1) numThreads = 1;
+  TpBuildJob job;
+  memset(&job, 0, sizeof(job));
+  job.tt = tt;
+  timetable_service_day(tt, INT_MIN, &job.day);
+  job.workers = calloc((size_t)numThreads, sizeof(TpWorker));
+  job.origin_nodes = calloc((size_t)(n > 0 ? n : 1), sizeof(TpNode*));
+  job.origin_offsets = calloc((size_t)(n > 0 ? n : 1), sizeof(int*));
+  int ok = job.workers && job.origin_nodes && job.origin_offsets;
+  for (int w = 0; ok && w < numThreads; ++w) {
+    job.workers[w].roots = malloc((size_t)(n > 0 ? n : 1) * sizeof(int));
+    job.workers[w].best = malloc((size_t)(n > 0 ? n : 1) * sizeof(int));
+    ok = csa_scratch_init(&job.workers[w].scratch, tt) &&
+         job.workers[w].roots && job.workers[w].best;
+  }
+  if (ok) ok = parallel_for(n, numThreads, tp_origin_task, &job);
+  if (ok) ok = !job.failed;
+
+  if (ok) {
+    long total = 0, scans = 0;
+    for (int o = 0; o < n; ++o) total += job.origin_offsets[o][n];
+    for (int w = 0; w < numThreads; ++w) scans += job.workers[w].scans;
+    ok = total <= INT_MAX;
+    tp->pair_offsets = malloc(((size_t)n * n + 1) * sizeof(int));
+    tp->nodes = malloc((size_t)(total > 0 ? total : 1) * sizeof(TpNode));
+    ok = ok && tp->pair_offsets && tp->nodes;
+    int k = 0;
+    tp->max_pair_nodes = 0;
+    for (int o = 0; ok && o < n; ++o) {
+      const int* off = job.origin_offsets[o];
+      for (int t = 0; t < n; ++t) {
+        tp->pair_offsets[(size_t)o * n + t] = k + off[t];
+        if (off[t + 1] - off[t] > tp->max_pair_nodes)
+          tp->max_pair_nodes = off[t + 1] - off[t];
+      }
+      memcpy(tp->nodes + k, job.origin_nodes[o],
+             (size_t)off[n] * sizeof(TpNode));
+      k += off[n];
+    }
+    if (ok) {
+      tp->pair_offsets[(size_t)n * n] = k;
+      tp->num_nodes = k;
+      printf("transfer patterns: %ld scans, %d nodes for %d pairs\n",
+             scans, k, n * n);
+    }
+  }
+
+  for (int w = 0; job.workers && w < numThreads; ++w) {
+    csa_scratch_free(&job.workers[w].scratch);
+    free(job.workers[w].trie);
+    free(job.workers[w].roots);
+    free(job.workers[w].best);
+    free(job.workers[w].events);
+    free(job.workers[w].stack);
+  }
+  for (int o = 0; o < n; ++o) {
+    if (job.origin_nodes) free(job.origin_nodes[o]);
+    if (job.origin_offsets) free(job.origin_offsets[o]);
+  }
+  free(job.workers);
+  free(job.origin_nodes);
+  free(job.origin_offsets);
+  return ok;
+}
+
+/** File name of the saved patterns, in the dataset directory. */
+#define TP_CACHE_FILE "transfer_patterns.bin"
+/** Version of the transfer_patterns.bin format. */
+#define TP_CACHE_VERSION 1
+
+/**
+ * tp_save()
+ *
+ * Persists the pair DAGs next to the dataset (see open_cache_file()). The
+ * direct-connection table is rebuilt from the lines on load.
+ *
+ * Returns:
+ *   1 on success, 0 on I/O error
+ */
+int tp_save(const Timetable* tt, const TpIndex* tp) {
+  FILE* fp = open_cache_file(tt, TP_CACHE_FILE, "GECP", TP_CACHE_VERSION, 1);
+  if (!fp) return 0;
+  size_t pairs = (size_t)tt->num_stops * tt->num_stops + 1;
+  int32_t counts[3] = {tt->num_stops, tp->num_nodes, tp->max_pair_nodes};
+  int ok = fwrite(counts, sizeof(counts), 1, fp) == 1 &&
+           fwrite(tp->pair_offsets, sizeof(int), pairs, fp) == pairs &&
+           fwrite(tp->nodes, sizeof(TpNode), (size_t)tp->num_nodes, fp) ==
+               (size_t)tp->num_nodes;
+  if (fclose(fp) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * tp_load()
+ *
+ * Loads the pair DAGs saved by tp_save(), if they match the loaded
+ * timetable.
+ *
+ * Returns:
+ *   1 if loaded, 0 if missing, stale or unreadable
+ */
+int tp_load(const Timetable* tt, TpIndex* tp) {
+  FILE* fp = open_cache_file(tt, TP_CACHE_FILE, "GECP", TP_CACHE_VERSION, 0);
+  if (!fp) return 0;
+  int32_t counts[3];
+  int ok = fread(counts, sizeof(counts), 1, fp) == 1 &&
+           counts[0] == tt->num_stops && counts[1] >= 0 && counts[2] >= 0;
+  if (ok) {
+    size_t pairs = (size_t)tt->num_stops * tt->num_stops + 1;
+    tp->num_nodes = counts[1];
+    tp->max_pair_nodes = counts[2];
+    tp->pair_offsets = malloc(pairs * sizeof(int));
+    tp->nodes =
+        malloc((size_t)(counts[1] > 0 ? counts[1] : 1) * sizeof(TpNode));
+    ok = tp->pair_offsets && tp->nodes &&
+         fread(tp->pair_offsets, sizeof(int), pairs, fp) == pairs &&
+         fread(tp->nodes, sizeof(TpNode), (size_t)counts[1], fp) ==
+             (size_t)counts[1];
+  }
+  fclose(fp);
+  return ok;
+}
+
+void tp_free(TpIndex* tp) {
+  tb_free(&tp->lines);
+  free(tp->direct_offsets);
+  free(tp->direct);
+  free(tp->pair_offsets);
+  free(tp->nodes);
+  memset(tp, 0, sizeof(*tp));
+}
+
+/**
+ * tp_load_or_build()
+ *
+ * Builds the lines and direct connections, then loads the saved patterns,
+ * or computes (in parallel) and saves them when no valid cache exists.
+ *
+ * Parameters:
+ *   tt         - Loaded timetable
+ *   tp         - Index to fill
+ *   numThreads - Threads for preprocessing
+ *   rebuild    - Nonzero to ignore any saved patterns
+ *
+ * Returns:
+ *   1 on success, 0 on failure
+ */
+int tp_load_or_build(const Timetable* tt, TpIndex* tp, int numThreads,
+                     int rebuild) {
+  memset(tp, 0, sizeof(*tp));
+  if (!tb_build_lines(tt, &tp->lines) || !tp_build_direct(tt, tp)) return 0;
+  if (!rebuild && tp_load(tt, tp)) return 1;
+  free(tp->pair_offsets);
+  free(tp->nodes);
+  tp->pair_offsets = NULL;
+  tp->nodes = NULL;
+
+  double t0 = now_seconds();
+  if (!tp_build_patterns(tt, tp, numThreads)) return 0;
+  printf("transfer patterns: preprocessing took %.3f s on %d threads\n",
+         now_seconds() - t0, numThreads);
+  if (!tp_save(tt, tp)) fprintf(stderr, "could not save %s\n", TP_CACHE_FILE);
+  return 1;
+}
+
+/**
+ * TpScratch structure
+ * Per-query working memory for tp_earliest_arrival(), sized for the
+ * largest pair DAG.
+ */
+typedef struct {
+  int* arrival;       ///< Per DAG node: earliest arrival
+  JourneyLeg* leg;    ///< Per DAG node: the leg from its parent
+  double time_limit;  ///< now_seconds() time at which a query gives up,
+                      ///< 0 for none
+  int partial;        ///< Set when the last query hit the time limit
+} TpScratch;
+
+int tp_scratch_init(TpScratch* s, const TpIndex* tp) {
+  size_t n = (size_t)(tp->max_pair_nodes > 0 ? tp->max_pair_nodes : 1);
+  s->arrival = malloc(n * sizeof(int));
+  s->leg = malloc(n * sizeof(JourneyLeg));
+  s->time_limit = 0;
+  s->partial = 0;
+  return s->arrival && s->leg;
+}
+
+void tp_scratch_free(TpScratch* s) {
+  free(s->arrival);
+  free(s->leg);
+  memset(s, 0, sizeof(*s));
+}
+
+/**
+ * tp_earliest_arrival()
+ *
+ * Earliest-arrival query answered from the transfer patterns: the pair's
+ * DAG is evaluated in preorder, each ride by a direct-connection lookup
+ * (tp_ride()) and each walk by its footpath.
+ *
+ * Parameters:
+ *   tt       - Loaded timetable
+ *   tp       - Transfer-pattern index
+ *   s        - Scratch owned by the calling thread
+ *   origin   - Index of the origin stop
+ *   dep_time - Earliest departure time in seconds
+ *   target   - Index of the destination stop
+ *   day      - Trips the query may ride (timetable_service_day())
+ *   j        - Output: the journey found (may be NULL)
+ *
+ * Past s->time_limit the evaluation stops with s->partial set and returns
+ * the best journey among the nodes evaluated so far.
+ *
+ * Returns:
+ *   Earliest arrival time at target, or TIME_INFINITY if unreachable
+ */
+int tp_earliest_arrival(const Timetable* tt, const TpIndex* tp, TpScratch* s,
+                        int origin, int dep_time, int target,
+                        const ServiceDay* day, Journey* j) {
+  if (j) j->num_legs = 0;
+  if (origin == target) return dep_time;
+  size_t pair = (size_t)origin * tt->num_stops + target;
+  const TpNode* nodes = tp->nodes + tp->pair_offsets[pair];
+  int count = tp->pair_offsets[pair + 1] - tp->pair_offsets[pair];
+  int best = TIME_INFINITY, bestNode = -1;
+  s->partial = 0;
+  // Preorder: every parent is evaluated before its children
+  for (int i = 0; i < count; ++i) {
+    if (i % (TIME_LIMIT_CHECK_INTERVAL / 4) == 0 &&
+        time_limit_reached(s->time_limit)) {
+      s->partial = 1;
+      break;
+    }
+    const TpNode* node = &nodes[i];
+    if (node->parent < 0) {
+      s->arrival[i] = dep_time;
+      continue;
+    }
+    int from = nodes[node->parent].stop;
+    int time = s->arrival[node->parent];
+    int arr = TIME_INFINITY;
+    if (time != TIME_INFINITY && node->walk) {
+      int walk = footpath_time(tt, from, node->stop);
+      if (walk >= 0) {
+        arr = time + walk;
+        s->leg[i].trip = -1;
+        s->leg[i].last_trip = -1;
+        s->leg[i].from_stop = from;
+        s->leg[i].to_stop = node->stop;
+        s->leg[i].dep_time = time;
+        s->leg[i].arr_time = arr;
+      }
+    } else if (time != TIME_INFINITY) {
+      arr = tp_ride(tt, tp, day, from, node->stop, time, &s->leg[i]);
+    }
+    s->arrival[i] = arr;
+    if (node->stop == target && arr < best) {
+      best = arr;
+      bestNode = i;
+    }
+  }
+  if (j && bestNode >= 0) {
+    for (int i = bestNode; nodes[i].parent >= 0 &&
+                           j->num_legs < MAX_JOURNEY_LEGS;
+         i = nodes[i].parent)
+      j->legs[j->num_legs++] = s->leg[i];
+    for (int a = 0, b = j->num_legs - 1; a < b; ++a, --b) {
+      JourneyLeg t = j->legs[a];
+      j->legs[a] = j->legs[b];
+      j->legs[b] = t;
+    }
+    journey_merge_seated(tt, j);
+  }
+  return best;
+}
+
+/**
+ * run_tp_mode()
+ *
+ * Command lines:
+ *   tproute <from> <to> [HH:MM:SS] [threads]
+ *       Earliest-arrival journey from the transfer patterns; preprocesses
+ *       and saves them on first use
+ *   tpbuild [threads]
+ *       Recomputes and saves the transfer patterns
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_tp_mode(int argc, char** argv, int buildOnly,
+                const TimetableOptions* opts) {
+  if (!buildOnly && argc < 2) {
+    fprintf(stderr, "usage: tproute <from> <to> [HH:MM:SS] [threads]\n");
+    return 1;
+  }
+  const char* threadArg = buildOnly ? (argc > 0 ? argv[0] : NULL)
+                                    : (argc > 3 ? argv[3] : NULL);
+  int threads = threadArg ? atoi(threadArg) : default_thread_count();
+  int time = parse_gtfs_time(!buildOnly && argc > 2 ? argv[2] : "08:00:00");
+  if (time < 0) {
+    fprintf(stderr, "invalid time '%s'\n", argv[2]);
+    return 1;
+  }
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  TpIndex tp;
+  if (!tp_load_or_build(&tt, &tp, threads, buildOnly)) {
+    tp_free(&tp);
+    free_timetable(&tt);
+    return 1;
+  }
+  if (buildOnly) {
+    tp_free(&tp);
+    free_timetable(&tt);
+    return 0;
+  }
+
+  int origin = find_stop_index(&tt, argv[0]);
+  int target = find_stop_index(&tt, argv[1]);
+  int rc = 1;
+  TpScratch s;
+  ServiceDay day;
+  timetable_service_day(&tt, opts->service_day, &day);
+  if (origin < 0 || target < 0) {
+    printf("No matching stop found for '%s'.\n",
+           origin < 0 ? argv[0] : argv[1]);
+  } else if (service_day_require(&tt, opts->require, &day) &&
+             tp_scratch_init(&s, &tp)) {
+    Journey j;
+    double t0 = now_seconds();
+    s.time_limit = query_time_limit(opts);
+    int arrival =
+        tp_earliest_arrival(&tt, &tp, &s, origin, time, target, &day, &j);
+    double elapsed = now_seconds() - t0;
+    printf("From: %s (%s)\nTo:   %s (%s)\n", tt.stops[origin].stop_name,
+           tt.stops[origin].stop_id, tt.stops[target].stop_name,
+           tt.stops[target].stop_id);
+    if (arrival != TIME_INFINITY) {
+      print_journey(&tt, &j);
+      rc = 0;
+    } else {
+      printf("No journey found.\n");
+    }
+    if (s.partial) printf("partial result: time limit reached\n");
+    printf("query time: %.3f ms\n", elapsed * 1000.0);
+    tp_scratch_free(&s);
+  }
+  service_day_free(&day);
+  tp_free(&tp);
+  free_timetable(&tt);
+  return rc;
+}
+
+// ============================================================================
+// ROUTING BENCHMARKS
+// ============================================================================
+
+/** Straight-line distance classes reported by run_alt_bench_mode(). */
+#define ALT_NUM_CLASSES 3
+#define ALT_SHORT_M 2000.0
+#define ALT_MEDIUM_M 5000.0
+
+/** Engines timed by run_alt_bench_mode(), in column order. */
+#define ALT_NUM_ENGINES 5
+
+/**
+ * run_alt_bench_mode()
+ *
+ * Command line:
+ *   altbench [queries] [threads]
+ *
+ * Answers random earliest-arrival queries (fixed seed, departures between
+ * 06:00 and 22:00) five ways: a full one-to-all connection scan, the scan
+ * stopping once the target cannot improve, that scan with landmark
+ * pruning, and the trip-based query without and with landmark pruning.
+ * Checks that all agree on the arrival and prints mean query times per
+ * straight-line distance class, with the landmark speedup of each engine
+ * (the bound computation is included in the pruned times). Preprocesses
+ * landmarks and transfers on `threads` threads when no saved copy exists.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_alt_bench_mode(int argc, char** argv, const TimetableOptions* opts) {
+  static const char* names[ALT_NUM_CLASSES] = {"short (<2 km)", "medium",
+                                               "long (>5 km)"};
+  int queries = argc > 0 ? atoi(argv[0]) : 2000;
+  int threads = argc > 1 ? atoi(argv[1]) : default_thread_count();
+  if (queries < 1) queries = 1;
+  if (threads < 1) threads = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  CsaScratch s;
+  TbScratch ts;
+  TbIndex tb;
+  Landmarks lm;
+  memset(&tb, 0, sizeof(tb));
+  memset(&lm, 0, sizeof(lm));
+  int* bound = malloc((size_t)tt.num_stops * sizeof(int));
+  // Both scratches are always initialized, so both can be freed below
+  int ok = csa_scratch_init(&s, &tt) & tb_scratch_init(&ts, &tt);
+  ok = ok && bound && tt.num_stops > 0 &&
+       landmarks_load_or_build(&tt, &lm, threads, 0) &&
+       tb_load_or_build(&tt, &tb, threads, 0);
+  ServiceDay day;
+  timetable_service_day(&tt, opts->service_day, &day);
+  ok = ok && service_day_require(&tt, opts->require, &day);
+
+  int count[ALT_NUM_CLASSES] = {0};
+  double spent[ALT_NUM_CLASSES][ALT_NUM_ENGINES] = {{0}};
+  int mismatches = 0;
+  srand(1);
+  for (int q = 0; ok && q < queries; ++q) {
+    int origin = rand() % tt.num_stops;
+    int target = rand() % tt.num_stops;
+    int time = 6 * 3600 + rand() % (16 * 3600);
+    const Stop* a = &tt.stops[origin];
+    const Stop* b = &tt.stops[target];
+    double dist = haversine_m(a->stop_lat, a->stop_lon, b->stop_lat,
+                              b->stop_lon);
+    int cls = dist < ALT_SHORT_M ? 0 : dist < ALT_MEDIUM_M ? 1 : 2;
+    count[cls]++;
+
+    int arrival[ALT_NUM_ENGINES];
+    double t0 = now_seconds();
+    csa_earliest_arrival(&tt, &s, origin, time, &day, -1, NULL);
+    arrival[0] = s.arrival[target];
+    double t1 = now_seconds();
+    csa_earliest_arrival(&tt, &s, origin, time, &day, target, NULL);
+    arrival[1] = s.arrival[target];
+    double t2 = now_seconds();
+    landmark_bounds(&tt, &lm, target, 1, bound);
+    csa_earliest_arrival(&tt, &s, origin, time, &day, target, bound);
+    arrival[2] = s.arrival[target];
+    double t3 = now_seconds();
+    arrival[3] = tb_earliest_arrival(&tt, &tb, &ts, origin, time, target,
+                                     &day, NULL, NULL);
+    double t4 = now_seconds();
+    landmark_bounds(&tt, &lm, target, 1, bound);
+    arrival[4] = tb_earliest_arrival(&tt, &tb, &ts, origin, time, target,
+                                     &day, bound, NULL);
+    double t5 = now_seconds();
+
+    for (int e = 1; e < ALT_NUM_ENGINES; ++e)
+      if (arrival[e] != arrival[0]) mismatches++;
+    spent[cls][0] += t1 - t0;
+    spent[cls][1] += t2 - t1;
+    spent[cls][2] += t3 - t2;
+    spent[cls][3] += t4 - t3;
+    spent[cls][4] += t5 - t4;
+  }
+
+  if (ok) {
+    printf("%-19s %10s %8s %8s %6s %11s %8s %6s\n", "mean ms per query",
+           "CSA full", "stop", "ALT", "gain", "TB plain", "ALT", "gain");
+    for (int c = 0; c < ALT_NUM_CLASSES; ++c) {
+      if (count[c] == 0) continue;
+      double ms[ALT_NUM_ENGINES];
+      for (int e = 0; e < ALT_NUM_ENGINES; ++e)
+        ms[e] = spent[c][e] * 1000.0 / count[c];
+      printf("%-14s %4d %10.3f %8.3f %8.3f %5.2fx %11.3f %8.3f %5.2fx\n",
+             names[c], count[c], ms[0], ms[1], ms[2],
+             ms[2] > 0 ? ms[1] / ms[2] : 0.0, ms[3], ms[4],
+             ms[4] > 0 ? ms[3] / ms[4] : 0.0);
+    }
+    printf("mismatched arrivals: %d\n", mismatches);
+  }
+
+  csa_scratch_free(&s);
+  tb_scratch_free(&ts);
+  tb_free(&tb);
+  landmarks_free(&lm);
+  free(bound);
+  service_day_free(&day);
+  free_timetable(&tt);
+  return ok && mismatches == 0 ? 0 : 1;
+}
+
+/** Engines timed by run_p2p_bench_mode(), in column order. */
+#define P2P_NUM_ENGINES 7
+
+/**
+ * run_p2p_bench_mode()
+ *
+ * Command line:
+ *   p2pbench [queries]
+ *
+ * Times point-to-point queries on a fixed sample of origin/destination
+ * pairs drawn from the stops (fixed seed, distinct stops, departures
+ * between 06:00 and 22:00) against the full one-to-all scan they replace:
+ * the forward scan to the end of the day, stopped once the target cannot
+ * improve, and bidirectional (csa_bidirectional()); then the reverse scan
+ * for an arrival 90 minutes after the departure, in full and stopped once
+ * the origin cannot improve. Checks that each stopped query agrees with
+ * its full scan and prints mean query times per straight-line distance
+ * class, the speedups over the full scans and the share of stops the
+ * backward search settled. Last, the same pairs are timed late in the
+ * day (departures between 21:00 and 22:30, arrivals 90 minutes later),
+ * where the reverse scan also merges the previous day's past-midnight
+ * trips: the stopped forward query against the stopped reverse one.
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_p2p_bench_mode(int argc, char** argv, const TimetableOptions* opts) {
+  static const char* names[ALT_NUM_CLASSES] = {"short (<2 km)", "medium",
+                                               "long (>5 km)"};
+  int queries = argc > 0 ? atoi(argv[0]) : 2000;
+  if (queries < 1) queries = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  LbGraph g;
+  SegmentStats ss;
+  CsaScratch s;
+  BidiScratch bs;
+  ServiceDay day;
+  int ok = segment_stats_build(&tt, &ss, default_thread_count());
+  ok = lb_graph_build(&tt, &ss, &g) & ok;
+  segment_stats_free(&ss);
+  // Every scratch is always initialized, so all can be freed below
+  ok = csa_scratch_init(&s, &tt) & bidi_scratch_init(&bs, &tt, &g) & ok;
+  ok = ok && tt.num_stops > 1 && timetable_query_day(&tt, opts, &day);
+
+  int count[ALT_NUM_CLASSES] = {0};
+  double spent[ALT_NUM_CLASSES][P2P_NUM_ENGINES] = {{0}};
+  double settled[ALT_NUM_CLASSES] = {0};
+  int mismatches = 0;
+  srand(2);
+  for (int q = 0; ok && q < queries; ++q) {
+    int origin = rand() % tt.num_stops;
+    int target = rand() % (tt.num_stops - 1);
+    if (target >= origin) target++;
+    int time = 6 * 3600 + rand() % (16 * 3600);
+    int deadline = time + 90 * 60;
+    int late = 21 * 3600 + time % (90 * 60);
+    const Stop* a = &tt.stops[origin];
+    const Stop* b = &tt.stops[target];
+    double dist = haversine_m(a->stop_lat, a->stop_lon, b->stop_lat,
+                              b->stop_lon);
+    int cls = dist < ALT_SHORT_M ? 0 : dist < ALT_MEDIUM_M ? 1 : 2;
+    count[cls]++;
+
+    int result[P2P_NUM_ENGINES];
+    double t0 = now_seconds();
+    csa_earliest_arrival(&tt, &s, origin, time, &day, -1, NULL);
+    result[0] = s.arrival[target];
+    double t1 = now_seconds();
+    csa_earliest_arrival(&tt, &s, origin, time, &day, target, NULL);
+    result[1] = s.arrival[target];
+    double t2 = now_seconds();
+    result[2] = csa_bidirectional(&tt, &bs, origin, time, &day, target);
+    double t3 = now_seconds();
+    csa_latest_departure(&tt, &s, target, deadline, &day, -1, NULL);
+    result[3] = s.departure[origin];
+    double t4 = now_seconds();
+    csa_latest_departure(&tt, &s, target, deadline, &day, origin, NULL);
+    result[4] = s.departure[origin];
+    double t5 = now_seconds();
+    csa_earliest_arrival(&tt, &s, origin, late, &day, target, NULL);
+    double t6 = now_seconds();
+    csa_latest_departure(&tt, &s, target, late + 90 * 60, &day, origin,
+                         NULL);
+    double t7 = now_seconds();
+
+    mismatches += (result[1] != result[0]) + (result[2] != result[0]) +
+                  (result[4] != result[3]);
+    settled[cls] += (double)bs.settled / tt.num_stops;
+    spent[cls][0] += t1 - t0;
+    spent[cls][1] += t2 - t1;
+    spent[cls][2] += t3 - t2;
+    spent[cls][3] += t4 - t3;
+    spent[cls][4] += t5 - t4;
+    spent[cls][5] += t6 - t5;
+    spent[cls][6] += t7 - t6;
+  }
+
+  if (ok) {
+    printf("%-19s %9s %8s %6s %8s %6s %8s %9s %8s %6s\n",
+           "mean ms per query", "CSA full", "stop", "gain", "bidir", "gain",
+           "settled", "rev full", "stop", "gain");
+    for (int c = 0; c < ALT_NUM_CLASSES; ++c) {
+      if (count[c] == 0) continue;
+      double ms[P2P_NUM_ENGINES];
+      for (int e = 0; e < P2P_NUM_ENGINES; ++e)
+        ms[e] = spent[c][e] * 1000.0 / count[c];
+      printf("%-14s %4d %9.3f %8.3f %5.2fx %8.3f %5.2fx %7.1f%% %9.3f %8.3f "
+             "%5.2fx\n",
+             names[c], count[c], ms[0], ms[1], ms[1] > 0 ? ms[0] / ms[1] : 0.0,
+             ms[2], ms[2] > 0 ? ms[0] / ms[2] : 0.0,
+             100.0 * settled[c] / count[c], ms[3], ms[4],
+             ms[4] > 0 ? ms[3] / ms[4] : 0.0);
+    }
+    printf("%-19s %9s %8s %6s\n", "late, ms per query", "route",
+           "arriveby", "ratio");
+    for (int c = 0; c < ALT_NUM_CLASSES; ++c) {
+      if (count[c] == 0) continue;
+      double fwd = spent[c][5] * 1000.0 / count[c];
+      double rev = spent[c][6] * 1000.0 / count[c];
+      printf("%-14s %4d %9.3f %8.3f %5.2fx\n", names[c], count[c], fwd, rev,
+             fwd > 0 ? rev / fwd : 0.0);
+    }
+    printf("mismatched answers: %d\n", mismatches);
+    service_day_free(&day);
+  }
+
+  csa_scratch_free(&s);
+  bidi_scratch_free(&bs);
+  lb_graph_free(&g);
+  free_timetable(&tt);
+  return ok && mismatches == 0 ? 0 : 1;
+}
+
+/** Distance classes of run_geo_bench_mode(), upper bounds in metres. */
+#define GEO_BENCH_CLASSES 4
+
+/**
+ * run_geo_bench_mode()
+ *
+ * Command line:
+ *   geobench [rounds]
+ *
+ * Accuracy: compares the batch kernels against haversine_m() over every
+ * pair of stops, per straight-line distance class (the batch haversine
+ * must agree to rounding; the equirectangular one is reported as relative
+ * error). Throughput: times `rounds` passes (default 20) of distances from
+ * every stop to every stop, one call per pair with haversine_m() and one
+ * batch per origin with each kernel, and the length of every shape piece
+ * by piece and with geo_path_length_m().
+ *
+ * Returns:
+ *   Process exit code
+ */
+int run_geo_bench_mode(int argc, char** argv, const TimetableOptions* opts) {
+  static const char* names[GEO_BENCH_CLASSES] = {"< 250 m", "< 1 km",
+                                                 "< 10 km", ">= 10 km"};
+  static const double limits[GEO_BENCH_CLASSES] = {250.0, 1000.0,
+                                                   GEO_FAST_MAX_M, 1e300};
+  int rounds = argc > 0 ? atoi(argv[0]) : 20;
+  if (rounds < 1) rounds = 1;
+
+  Timetable tt;
+  if (!load_timetable(&tt, opts)) return 1;
+  int n = tt.num_stops;
+  GeoPoints pts;
+  double* ref = malloc((size_t)(n > 0 ? n : 1) * sizeof(double));
+  double* batch = malloc((size_t)(n > 0 ? n : 1) * sizeof(double));
+  double* fast = malloc((size_t)(n > 0 ? n : 1) * sizeof(double));
+  int ok = geo_points_init(&pts, n) && ref && batch && fast;
+  for (int i = 0; ok && i < n; ++i)
+    geo_points_set(&pts, i, tt.stops[i].stop_lat, tt.stops[i].stop_lon);
+
+  long count[GEO_BENCH_CLASSES] = {0};
+  double sumErr[GEO_BENCH_CLASSES] = {0}, maxErr[GEO_BENCH_CLASSES] = {0};
+  double maxBatchDiff = 0.0;
+  for (int a = 0; ok && a < n; ++a) {
+    const Stop* sa = &tt.stops[a];
+    for (int b = a + 1; b < n; ++b)
+      ref[b] = haversine_m(sa->stop_lat, sa->stop_lon, tt.stops[b].stop_lat,
+                           tt.stops[b].stop_lon);
+    geo_distances_m(sa->stop_lat, sa->stop_lon, &pts, a + 1, n, batch);
+    geo_distances_fast_m(sa->stop_lat, sa->stop_lon, &pts, a + 1, n, fast);
+    for (int b = a + 1; b < n; ++b) {
+      if (ref[b] <= 0) continue;
+      int c = 0;
+      while (ref[b] >= limits[c]) c++;
+      double err = fabs(fast[b - a - 1] - ref[b]) / ref[b];
+      count[c]++;
+      sumErr[c] += err;
+      if (err > maxErr[c]) maxErr[c] = err;
+      if (fabs(batch[b - a - 1] - ref[b]) > maxBatchDiff)
+        maxBatchDiff = fabs(batch[b - a - 1] - ref[b]);
+    }
+  }
+
+  // Throughput; the sampled sums keep the loops from being optimized away
+  // and check that the kernels agree
+  double spent[3] = {0}, check[3] = {0};
+  for (int r = 0; ok && r < rounds; ++r) {
+    for (int k = 0; k < 3; ++k) {
+      double t0 = now_seconds();
+      for (int a = 0; a < n; ++a) {
+        const Stop* sa = &tt.stops[a];
+        if (k == 0) {
+          for (int b = 0; b < n; ++b)
+            ref[b] = haversine_m(sa->stop_lat, sa->stop_lon,
+                                 tt.stops[b].stop_lat, tt.stops[b].stop_lon);
+        } else if (k == 1) {
+          geo_distances_m(sa->stop_lat, sa->stop_lon, &pts, 0, n, ref);
+        } else {
+          geo_distances_fast_m(sa->stop_lat, sa->stop_lon, &pts, 0, n, ref);
+        }
+        check[k] += ref[n - 1 - a];
+      }
+      spent[k] += now_seconds() - t0;
+    }
+  }
+  double pathSpent[2] = {0}, length[2] = {0};
+  for (int r = 0; ok && r < rounds; ++r) {
+    length[0] = length[1] = 0.0;
+    double t0 = now_seconds();
+    for (int i = 1; i < tt.num_shape_points; ++i)
+      length[0] += haversine_m(tt.shape_lat[i - 1], tt.shape_lon[i - 1],
+                               tt.shape_lat[i], tt.shape_lon[i]);
+    for (int sh = 0; sh < tt.num_shapes; ++sh) {
+      // The loop above also bridged consecutive shapes; take that back
+      int first = tt.shapes[sh].first_point;
+      if (first > 0)
+        length[0] -= haversine_m(tt.shape_lat[first - 1],
+                                 tt.shape_lon[first - 1],
+                                 tt.shape_lat[first], tt.shape_lon[first]);
+    }
+    double t1 = now_seconds();
+    for (int sh = 0; sh < tt.num_shapes; ++sh)
+      length[1] += geo_path_length_m(tt.shape_lat + tt.shapes[sh].first_point,
+                                     tt.shape_lon + tt.shapes[sh].first_point,
+                                     tt.shapes[sh].num_points, NULL);
+    pathSpent[0] += t1 - t0;
+    pathSpent[1] += now_seconds() - t1;
+  }
+
+  if (ok) {
+    printf("equirectangular vs haversine, %d stops:\n", n);
+    printf("%-10s %9s %12s %12s\n", "distance", "pairs", "mean rel err",
+           "max rel err");
+    for (int c = 0; c < GEO_BENCH_CLASSES; ++c)
+      if (count[c] > 0)
+        printf("%-10s %9ld %12.2e %12.2e\n", names[c], count[c],
+               sumErr[c] / count[c], maxErr[c]);
+    printf("batch haversine max difference: %.2e m\n", maxBatchDiff);
+    double pairs = (double)n * n * rounds;
+    static const char* kernels[3] = {"haversine_m per pair",
+                                     "geo_distances_m", "geo_distances_fast_m"};
+    printf("%-22s %10s %10s\n", "stop to stop", "ns/dist", "M dist/s");
+    for (int k = 0; k < 3; ++k)
+      printf("%-22s %10.2f %10.1f\n", kernels[k], spent[k] * 1e9 / pairs,
+             spent[k] > 0 ? pairs / spent[k] / 1e6 : 0.0);
+    double pieces = (double)(tt.num_shape_points - tt.num_shapes) * rounds;
+    printf("shape lengths (%.1f km): %.2f ns/piece per pair, %.2f ns/piece "
+           "geo_path_length_m (%.1f km)\n",
+           length[0] / 1000.0, pathSpent[0] * 1e9 / pieces,
+           pathSpent[1] * 1e9 / pieces, length[1] / 1000.0);
+    printf("kernels agree on sampled distances: %s\n",
+           fabs(check[1] - check[0]) <= 1e-6 * check[0] &&
+                   fabs(check[2] - check[0]) <= 1e-6 * check[0]
+               ? "yes"
+               : "no");
+  }
+  geo_points_free(&pts);
+  free(ref);
+  free(batch);
+  free(fast);
+  free_timetable(&tt);
+  return ok ? 0 : 1;
+}
+
+// ============================================================================
+// MAIN PROGRAM
+// ============================================================================
+
+/**
+ * main()
  *
- * Process:
+ * Entry point for the GTFS stop lookup program.
+ *
+ * With a mode argument, runs a batch tool instead of the interactive lookup.
+ * Options before the mode:
+ *   --walk-radius <m>  Footpath radius in metres (default 250)
+ *   --walk-speed <m/s> Walking speed for footpath times (default 1.25)
+ *   --date YYYYMMDD    Only ride trips running that day (needs calendar.csv
+ *                      and/or calendar_dates.csv; default: every trip)
+ *   --require <list>   Only ride trips offering these amenities:
+ *                      wheelchair and/or bikes, comma-separated
+ *   --time-limit <ms>  Stop a route, arriveby, alternatives, tbroute or
+ *                      tproute query after this long and print the best
+ *                      journey found so far (default: no limit)
+ * Modes:
+ *   matrix [HH:MM:SS] [threads] [out.bin] [out.csv]
+ *       Stop x stop travel-time matrix (see run_matrix_mode())
+ *   route <from> <to> [HH:MM:SS]
+ *       Earliest-arrival journey (see run_route_mode())
+ *   arriveby <from> <to> <HH:MM:SS>
+ *       Latest-departure journey arriving by a deadline
+ *   alternatives <from> <to> [HH:MM:SS] [k] [budget KiB]
+ *       Up to k journeys on distinct routes (see run_alternatives_mode())
+ *   board <stop> [HH:MM:SS] [N] | board -
+ *       Next departures at a stop (see run_board_mode())
+ *   tbroute <from> <to> [HH:MM:SS] [threads] | tbbuild [threads]
+ *       Trip-based routing and its preprocessing (see run_tb_mode())
+ *   tproute <from> <to> [HH:MM:SS] [threads] | tpbuild [threads]
+ *       Transfer-pattern routing and its preprocessing (see run_tp_mode())
+ *   altbench [queries] [threads]
+ *       Benchmark of landmark pruning (see run_alt_bench_mode())
+ *   p2pbench [queries]
+ *       Benchmark of point-to-point queries (see run_p2p_bench_mode())
+ *   geobench [rounds]
+ *       Accuracy and speed of the distance kernels (see
+ *       run_geo_bench_mode())
+ *   shape <trip_id|shape_id> [zoom|-] [text|polyline|varint]
+ *       Trip geometry at a map zoom level (see run_shape_mode())
+ *   segments [threads] [out.csv]
+ *       Running-time statistics per stop pair (see run_segments_mode())
+ *   positions [HH:MM:SS] [rounds]
+ *       Where every vehicle is at a time (see run_positions_mode())
+ *   trips <HH:MM:SS> [HH:MM:SS]
+ *       Trips running at a time or over a window (see run_trips_mode())
+ *   tiles [minzoom] [maxzoom] [threads] [dir]
+ *       Vector tiles of stops and shapes (see run_tiles_mode())
+ *
+ * Interactive process:
  * 1. Prompt user for origin stop (by name or ID)
  * 2. Prompt user for final/destination stop (by name or ID)
  * 3. Search and display the origin stop details
@@ -408,7 +9956,80 @@ int find_stop_in_csv(const char* stopsPath, const char* query) {
  * Returns:
  *   0 on successful completion, error code on failure
  */
-int main() {
+int main(int argc, char** argv) {
+  // Leading "--name value" options tune timetable preprocessing
+  TimetableOptions opts;
+  timetable_default_options(&opts);
+  int arg = 1;
+  while (arg + 1 < argc && strncmp(argv[arg], "--", 2) == 0) {
+    if (strcmp(argv[arg], "--walk-radius") == 0) {
+      opts.walk_radius_m = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "--walk-speed") == 0) {
+      opts.walk_speed_mps = atof(argv[arg + 1]);
+    } else if (strcmp(argv[arg], "--require") == 0) {
+      opts.require = parse_trip_attributes(argv[arg + 1]);
+      if (opts.require == 0) {
+        fprintf(stderr, "invalid attributes '%s'\n", argv[arg + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[arg], "--time-limit") == 0) {
+      opts.time_limit_ms = atof(argv[arg + 1]);
+      if (opts.time_limit_ms <= 0) {
+        fprintf(stderr, "invalid time limit '%s'\n", argv[arg + 1]);
+        return 1;
+      }
+    } else if (strcmp(argv[arg], "--date") == 0) {
+      opts.service_day = parse_gtfs_date(argv[arg + 1]);
+      if (opts.service_day == INT_MIN) {
+        fprintf(stderr, "invalid date '%s'\n", argv[arg + 1]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "unknown option '%s'\n", argv[arg]);
+      return 1;
+    }
+    arg += 2;
+  }
+  if (opts.walk_speed_mps <= 0) opts.walk_speed_mps = DEFAULT_WALK_SPEED_MPS;
+
+  const char* mode = arg < argc ? argv[arg] : "";
+  int modeArgc = argc - arg - 1;
+  char** modeArgv = argv + arg + 1;
+  if (strcmp(mode, "matrix") == 0)
+    return run_matrix_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "route") == 0)
+    return run_route_mode(modeArgc, modeArgv, 0, &opts);
+  if (strcmp(mode, "arriveby") == 0)
+    return run_route_mode(modeArgc, modeArgv, 1, &opts);
+  if (strcmp(mode, "alternatives") == 0)
+    return run_alternatives_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "board") == 0)
+    return run_board_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "tbroute") == 0)
+    return run_tb_mode(modeArgc, modeArgv, 0, &opts);
+  if (strcmp(mode, "tbbuild") == 0)
+    return run_tb_mode(modeArgc, modeArgv, 1, &opts);
+  if (strcmp(mode, "tproute") == 0)
+    return run_tp_mode(modeArgc, modeArgv, 0, &opts);
+  if (strcmp(mode, "tpbuild") == 0)
+    return run_tp_mode(modeArgc, modeArgv, 1, &opts);
+  if (strcmp(mode, "altbench") == 0)
+    return run_alt_bench_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "p2pbench") == 0)
+    return run_p2p_bench_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "geobench") == 0)
+    return run_geo_bench_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "shape") == 0)
+    return run_shape_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "segments") == 0)
+    return run_segments_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "positions") == 0)
+    return run_positions_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "trips") == 0)
+    return run_trips_mode(modeArgc, modeArgv, &opts);
+  if (strcmp(mode, "tiles") == 0)
+    return run_tiles_mode(modeArgc, modeArgv, &opts);
+
   // Buffers to store user input for origin and final stops
   char origin_input[256];
   char final_input[256];
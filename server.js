@@ -39,6 +39,65 @@ app.post('/run', (req, res) => {
     if (child.stdin.writable) child.stdin.end();
 });
 
+// Long-lived "gec2025.exe board -" process shared by all board requests.
+// Each request is one stdin line; each answer ends with an empty line.
+let boardChild = null;
+let boardBuffer = '';
+let boardLines = [];
+const boardWaiters = [];
+
+function getBoardChild() {
+    if (boardChild) return boardChild;
+    const exePath = path.join(__dirname, 'gec2025.exe');
+    boardChild = spawn(exePath, ['board', '-'], { cwd: __dirname });
+    boardChild.stdout.setEncoding('utf8');
+    boardChild.stdout.on('data', (chunk) => {
+        boardBuffer += chunk;
+        let nl;
+        while ((nl = boardBuffer.indexOf('\n')) !== -1) {
+            const line = boardBuffer.slice(0, nl).replace(/\r$/, '');
+            boardBuffer = boardBuffer.slice(nl + 1);
+            if (line !== '') {
+                boardLines.push(line);
+                continue;
+            }
+            const waiter = boardWaiters.shift();
+            if (waiter) waiter(boardLines);
+            boardLines = [];
+        }
+    });
+    const reset = () => {
+        boardChild = null;
+        boardBuffer = '';
+        boardLines = [];
+        while (boardWaiters.length) boardWaiters.shift()(null);
+    };
+    boardChild.on('error', reset);
+    boardChild.on('close', reset);
+    return boardChild;
+}
+
+// GET /departures?stop=<stop_id>&time=<HH:MM:SS>&n=<count>
+app.get('/departures', (req, res) => {
+    const stop = String(req.query.stop || '').replace(/\s/g, '');
+    const time = String(req.query.time || '08:00:00').replace(/\s/g, '');
+    const n = parseInt(req.query.n || '10', 10) || 10;
+    if (!stop) return res.status(400).json({ error: 'stop is required' });
+
+    boardWaiters.push((lines) => {
+        if (lines === null) return res.status(500).json({ error: 'board process exited' });
+        if (lines.length > 0 && lines[0].startsWith('error')) {
+            return res.status(400).json({ error: 'unknown stop or time' });
+        }
+        const departures = lines.map((line) => {
+            const [departure_time, route_short_name, trip_headsign] = line.split('\t');
+            return { departure_time, route_short_name, trip_headsign };
+        });
+        res.json({ stop, time, departures });
+    });
+    getBoardChild().stdin.write(`${stop} ${time} ${n}\n`);
+});
+
 const PORT = process.env.PORT || 3000;
 app.listen(PORT, () => {
     console.log(`Run server listening on http://localhost:${PORT}`);